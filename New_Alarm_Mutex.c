@@ -1,225 +1,343 @@
 #include <pthread.h>
-#include <regex.h>
 #include "errors.h"
 #include "debug.h"
+#include "parser.h"
+#include "alarm_index.h"
+#include "mailbox.h"
+#include "slab.h"
+#include "output.h"
+#include "command_queue.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 
 /**
- * These are the regexes for the commands that we must look for.
- */
-regex_parser regexes[] = {
-    {Start_Alarm,
-     "Start_Alarm\\(([0-9]+)\\):[[:space:]]([0-9]+)[[:space:]](.*)",
-     4},
-    {Change_Alarm,
-     "Change_Alarm\\(([0-9]+)\\):[[:space:]]([0-9]+)[[:space:]](.*)",
-     4},
-    {Cancel_Alarm,
-     "Cancel_Alarm\\(([0-9]+)\\)",
-     2},
-    {Suspend_Alarm,
-     "Suspend_Alarm\\(([0-9]+)\\)",
-     2},
-    {Reactivate_Alarm,
-     "Reactivate_Alarm\\(([0-9]+)\\)",
-     2},
-    {View_Alarms,
-     "View_Alarms",
-     1}
-};
+ * Header of the list of alarms.
+ */
+alarm_t alarm_header = {.unit = UNIT_SECONDS, .message = "", .next = NULL};
 
 /**
- * Header of the list of alarms.
+ * Last alarm in the list (or the header if the list is empty). New alarms
+ * usually have the largest ID so far, so sorted insertion starts here.
  */
-alarm_t alarm_header = {0, 0, "", NULL, false, 0, 0};
+alarm_t *alarm_tail = &alarm_header;
 
 /**
- * Mutex for the alarm list. Any thread reading or modifying the alarm list must
- * have this mutex locked.
+ * What View_Alarms shows of every alarm in the list (see snapshot.h). An
+ * alarm's record is written whenever the alarm is assigned, changed,
+ * suspended or reactivated, and removed with the alarm. It is protected by
+ * the alarm list mutex.
+ */
+view_table_t view_table = VIEW_TABLE_INITIALIZER;
+
+/**
+ * Hash index of the alarms in the list, keyed by alarm_id. It always holds
+ * exactly the alarms in the list and is protected by the alarm list mutex.
+ */
+alarm_index_t alarm_index = {NULL, 0, 0};
+
+/**
+ * Pool that alarms are allocated from, and each thread's cache of free alarms
+ * from the pool. Alarms are allocated by the main thread and freed by
+ * whichever thread expires or cancels them, so the caches give freed alarms
+ * back to the pool in batches instead of one free() at a time.
  */
-pthread_mutex_t alarm_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+slab_pool_t alarm_pool = SLAB_POOL_INITIALIZER(alarm_t);
+__thread slab_cache_t alarm_cache = {NULL, 0};
 
 /**
- * Condition variable for the alarm list. This allows threads to wait for
- * updates to the alarm list.
+ * Mutex for the alarm list. Any thread reading or modifying the alarm list must
+ * have this mutex locked. It counts its acquisitions, contention, wait and
+ * hold time for the Stats command (see lock_stats.h).
  */
-pthread_cond_t alarm_list_cond = PTHREAD_COND_INITIALIZER;
+metered_mutex_t alarm_list_mutex = METERED_MUTEX_INITIALIZER;
 
 /**
  * Header of the list of threads.
  */
-thread_t thread_header = {0,0,0,NULL, 0};
+thread_t thread_header = {.next = NULL, .prev = NULL};
+
+/**
+ * Last thread in the thread list (or the header if the list is empty), so
+ * that new threads are added without walking the list.
+ */
+thread_t *thread_tail = &thread_header;
+
+/**
+ * Condition variable that is broadcast (with the alarm list mutex) when the
+ * last thread leaves the thread list, or when every alarm left is suspended,
+ * so that batch mode knows when every alarm that can expire is done.
+ */
+pthread_cond_t thread_list_empty = PTHREAD_COND_INITIALIZER;
 
 /**
  * Mutex for the thread list. Any thread reading or modifying the thread list
- * must have this mutex locked.
+ * must have this mutex locked. Like the alarm list mutex, it counts how it
+ * is used.
  */
-pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+metered_mutex_t thread_list_mutex = METERED_MUTEX_INITIALIZER;
 
 /**
- * The current event being handled. If the event is NULL, then there is no
- * event being handled. Note that there can only be one event being handled at
- * any given time.
+ * Lateness histograms of the display threads that have exited, so that
+ * their samples are kept. Protected by the alarm list mutex.
  */
-event_t *event = NULL;
+histogram_t retired_lateness[LATENESS_KINDS];
 
 /**
- * Mutex for the event. Any thread reading or modifying the event must have
- * this mutex locked.
+ * Number of lines printed by the Stats command.
  */
-pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LINES 7
 
 /**
- * This method takes a string and checks if it matches any of the
- * command formats. If there is no match, NULL is returned. If there
- * is a match, it parses the string into a command and returns it.
+ * Counters for the Stats command and the metrics file, all protected by the
+ * alarm list mutex (but `display_thread_count`, which is protected by the
+ * thread list mutex):
+ *
+ *   - `suspended_alarms` is the number of suspended alarms in the list.
+ *   - `display_thread_count` is the number of threads in the thread list.
+ *   - `commands_by_type` counts the commands applied, by type, and
+ *     `bad_commands` the lines that were not valid commands.
+ *   - `alarms_expired` counts the alarms that have expired.
  */
-command_t *parse_command(char input[])
-{
-    regex_t regex; // Holds the regex that we are testing
+size_t suspended_alarms = 0;
+size_t display_thread_count = 0;
+uint64_t commands_by_type[COMMAND_TYPES];
+uint64_t bad_commands = 0;
+uint64_t alarms_expired = 0;
 
-    int re_status; // Holds the status of regex tests
+/**
+ * The metrics collected by the last Stats command (zero before the first),
+ * so that the next one shows the expirations per second in between.
+ */
+metrics_t last_stats;
 
-    regmatch_t matches[4]; // Holds the number of matches. (No command has more
-                           // than 3 matches, which we add 1 to because the
-                           // string itself counts as a match).
+/**
+ * The metrics file (NULL if there is none), and the number of seconds
+ * between two writes of it.
+ */
+#define DEFAULT_METRICS_INTERVAL 10
 
-    command_t *command; // Holds the pointer to the command that will be
-                        // returned. (This will be malloced, so it must be
-                        // freed later).
+const char *metrics_path = NULL;
+int metrics_interval = DEFAULT_METRICS_INTERVAL;
 
-    int number_of_regexes = 6; // Six regexes for six commands
+/**
+ * Wakeups of the display threads that have exited, and of the timer thread.
+ * Both are protected by the alarm list mutex.
+ */
+wakeup_stats_t retired_wakeups = {0, 0, 0};
+wakeup_stats_t timer_wakeups = {0, 0, 0};
 
-    char alarm_id_buffer[64]; // Buffer used to hold alarm_id as a string when
-                              // it is being converted to an int.
+/**
+ * First thread in the list of display threads that have space for another
+ * alarm (NULL if every thread is full). It is protected by the thread list
+ * mutex, and is updated whenever the number of alarms of a thread changes, so
+ * a new alarm can be given to a thread without searching the thread list.
+ */
+thread_t *threads_with_space = NULL;
 
-    char time_buffer[64]; // Buffer used to  hold time as a string when it is
-                          // being converted to an int.
 
-    /*
-     * Loop through the regexes and test each one.
-     */
-    for (int i = 0; i < number_of_regexes; i++)
-    {
-        /*
-         * Compile the regex
-         */
-        re_status = regcomp(
-            &regex,
-            regexes[i].regex_string,
-            REG_EXTENDED);
+/**
+ * Counter for thread IDs. This will be incremented every time a display thread
+ * is created so that each thread has a unique ID.
+ */
+int thread_id_counter = 0;
 
-        // Make sure regex compilation succeeded
-        if (re_status != 0)
-        {
-            fprintf(
-                stderr,
-                "Regex %d \"%s\" did not compile\n",
-                i,
-                regexes[i].regex_string);
-            exit(1);
-        }
+/**
+ * Nanoseconds between two prints of the same alarm.
+ */
+#define DISPLAY_INTERVAL (5 * NSEC_PER_SEC)
 
-        /*
-         * Test input string against regex
-         */
-        re_status = regexec(
-            &regex,
-            input,
-            regexes[i].expected_matches,
-            matches,
-            0);
+/**
+ * Default and largest number of alarms that one display thread can hold.
+ */
+#define DEFAULT_ALARMS_PER_THREAD 2
+#define MAX_ALARMS_PER_THREAD 65536
 
-        if (re_status == REG_NOMATCH)
-        {
-            /*
-             * If no match, then free the regex and continue on with
-             * the loop.
-             */
-            regfree(&regex);
-            continue;
-        }
-        else if (re_status != 0)
-        {
-            /*
-             * If regex test returned nonzero value, then it was an
-             * error. In this case, free the regex and stop the
-             * program.
-             */
-            fprintf(
-                stderr,
-                "Regex %d \"%s\" did not work with input \"%s\"\n",
-                i,
-                regexes[i].regex_string,
-                input);
-            regfree(&regex);
-            exit(1);
-        }
-        else
-        {
-            /*
-             * In this case (regex returned 0), we know the input has
-             * matched a command and we can now parse it.
-             */
+/**
+ * Number of alarms that one display thread can hold. It is set from the
+ * command line when the program starts and does not change afterwards.
+ */
+int alarms_per_thread = DEFAULT_ALARMS_PER_THREAD;
 
-            // Free the regex
-            regfree(&regex);
+/**
+ * The engine that drives alarm expiry and printing. It is set from the command
+ * line when the program starts and does not change afterwards.
+ */
+engine_type engine = ENGINE_THREADS;
 
-            /*
-             * Allocate command (IT MUST BE FREED LATER)
-             */
-            command = malloc(sizeof(command_t));
-            if (command == NULL)
-            {
-                errno_abort("Malloc failed");
-            }
+/**
+ * Timing wheel holding the next deadline (print or expiry) of every active
+ * alarm, when the timing wheel engine is used. It ticks once per millisecond
+ * of the monotonic clock and is protected by the alarm list mutex.
+ */
+timing_wheel_t alarm_wheel;
 
-            /*
-             * Fill command with data
-             */
-            command->type = regexes[i].type;
-            // Get the alarm_id from the input (if it exists)
-            if (regexes[i].expected_matches > 1)
-            {
-                strncpy(
-                    alarm_id_buffer,
-                    input + matches[1].rm_so,
-                    matches[1].rm_eo - matches[1].rm_so);
-                command->alarm_id = atoi(alarm_id_buffer);
-            }
-            else
-            {
-                command->alarm_id = 0;
-            }
-            // Get the time from the input (if it exists)
-            if (regexes[i].expected_matches > 2)
-            {
-                strncpy(
-                    time_buffer,
-                    input + matches[2].rm_so,
-                    matches[2].rm_eo - matches[2].rm_so);
-                command->time = atoi(time_buffer);
-            }
-            else
-            {
-                command->time = 0;
-            }
-            // Copy the message from the input (if it exists)
-            if (regexes[i].expected_matches > 3)
-            {
-                strncpy(
-                    command->message,
-                    input + matches[3].rm_so,
-                    matches[3].rm_eo - matches[3].rm_so);
-                command->message[matches[3].rm_eo - matches[3].rm_so] = 0;
-            }
+/**
+ * Min-heap of active alarms ordered by their next deadline (print or expiry),
+ * when the heap engine is used. It is protected by the alarm list mutex.
+ */
+min_heap_t alarm_heap = {NULL, 0, 0};
 
-            return command;
-        }
-    }
+/**
+ * Condition variable that the timer thread waits on (with the alarm list
+ * mutex) until the next deadline of a timer engine. It is initialized to use
+ * the monotonic clock when the timer thread is started.
+ */
+pthread_cond_t timer_cond;
 
-    return NULL;
+/**
+ * The time (monotonic, in nanoseconds) that the timer thread is sleeping
+ * until, or -1 if it is waiting without a timeout. The main thread only
+ * signals the timer thread when it schedules a deadline earlier than this.
+ */
+int64_t timer_deadline = -1;
+
+/**
+ * Largest number of workers in the pool engine, and the largest number of due
+ * alarms that a worker steals at once.
+ */
+#define MAX_POOL_WORKERS 1024
+#define POOL_STEAL_BATCH 64
+
+/**
+ * The workers of the pool engine, and how many there are. The number is set
+ * from the command line (or the number of online CPUs) when the program
+ * starts and does not change afterwards.
+ */
+pool_worker_t *pool_workers = NULL;
+int pool_size = 0;
+
+/**
+ * The pool workers that are idle and have not been woken up yet, as a stack
+ * of worker indexes, so that a busy worker finds one to wake up in constant
+ * time. It is protected by `pool_idle_mutex`, which is never locked together
+ * with another mutex; `pool_idle_count` is also read without it, so that a
+ * busy worker locks nothing when no worker is idle.
+ */
+int *pool_idle = NULL;
+int pool_idle_count = 0;
+pthread_mutex_t pool_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Size of the buffer that batch mode reads commands into, and the largest
+ * number of commands that the command thread applies with one lock of the
+ * alarm list mutex.
+ */
+#define BATCH_BUFFER_SIZE (1 << 20)
+#define BATCH_MAX_COMMANDS 4096
+
+/**
+ * Queue of commands that have been read (by the main thread, or by the
+ * reader threads in batch mode) and not applied yet. The command thread is
+ * its only consumer.
+ */
+command_queue_t command_queue;
+
+/**
+ * Number of commands (and bad lines) that the command thread has applied.
+ * It is protected by the alarm list mutex, and `commands_applied_cond` is
+ * broadcast whenever it grows.
+ */
+long commands_applied = 0;
+pthread_cond_t commands_applied_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Default number of milliseconds between two group commits of the journal.
+ */
+#define DEFAULT_JOURNAL_INTERVAL 10
+
+/**
+ * The journal of alarm changes, and whether one is kept (it is when a journal
+ * file is given on the command line).
+ */
+journal_t journal;
+bool journaling = false;
+
+/**
+ * Number of alarms restored from the checkpoint and the journal, and the
+ * number of alarms in them that expired while the program was not running.
+ */
+long alarms_restored = 0;
+long alarms_expired_while_stopped = 0;
+
+/**
+ * The checkpoint file (NULL if there is none), and the number of seconds
+ * between two checkpoints taken on a timer (0 if they are only taken by the
+ * Checkpoint command).
+ */
+const char *checkpoint_path = NULL;
+int checkpoint_interval = 0;
+
+/**
+ * Whether a checkpoint is being written. It is protected by the alarm list
+ * mutex, and `checkpoint_done` is broadcast when the checkpoint is finished,
+ * so that a second checkpoint waits for the first.
+ */
+bool checkpoint_running = false;
+pthread_cond_t checkpoint_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * What the command thread restores before it applies the first command: the
+ * checkpoint mapped at startup (if `restoring_checkpoint`), and the journal
+ * (if `journaling`).
+ */
+checkpoint_t restore_checkpoint;
+bool restoring_checkpoint = false;
+
+/**
+ * The trace that the commands applied are recorded in, and whether one is
+ * recorded (it is when a trace file is given on the command line).
+ */
+trace_t trace;
+bool tracing = false;
+
+/**
+ * The trace replayed in batch mode (NULL if there is none), and how fast it
+ * is replayed compared with how it was recorded (0 for as fast as the
+ * commands can be applied).
+ */
+const char *replay_path = NULL;
+double replay_speed = 1;
+
+/**
+ * How late each replayed command was added to the command queue, compared
+ * with its recorded time (scaled by the replay speed), and the recorded
+ * time of the last command. Only the replay thread writes them, and they
+ * are read once it has been joined.
+ */
+histogram_t replay_lag;
+int64_t replay_span = 0;
+
+/**
+ * Allocates an alarm from the alarm pool. The contents are undefined, except
+ * for its sequence counter, its counts of changes and of work items, which
+ * are 0, and `retired`, which is false.
+ */
+alarm_t *alloc_alarm()
+{
+    alarm_t *alarm = slab_alloc(&alarm_pool, &alarm_cache);
+
+    alarm->seq = 0;
+    alarm->changes = 0;
+    alarm->changes_printed = 0;
+    alarm->work_items = 0;
+    alarm->retired = false;
+    return alarm;
+}
+
+/**
+ * Gives an alarm back to the alarm pool.
+ */
+void free_alarm(alarm_t *alarm)
+{
+    slab_free(&alarm_pool, &alarm_cache, alarm);
 }
 
 /**
@@ -227,32 +345,33 @@ command_t *parse_command(char input[])
  *
  * Alarm list has to be locked by the caller of this method
  *
- * Goes through the linked list, when specified ID is found, pointer
- * to that alarm will be returned.
+ * The alarm is looked up in the alarm index, so this takes constant time
+ * regardless of the length of the list.
  *
  * If the specified ID is not found, return NULL.
  */
 alarm_t* find_alarm_by_id(int id) 
 {
-    alarm_t *alarm_node = alarm_header.next;
-    
-    //Loop through the list
-    while(alarm_node != NULL)
-    {
-        //if ID is found, return pointer to it
-        if(alarm_node-> alarm_id == id)
-        {
-            return alarm_node;
-        }
-        //if ID is NOT found, go to next node
-        else
-        {
-            alarm_node = alarm_node->next;
-        }
-    }
-    //If the entire list was searched and specified ID was not
-    //found, return NULL.
-    return NULL;
+    return alarm_index_find(&alarm_index, id);
+}
+
+/**
+ * Writes what View_Alarms shows of an alarm into its view record. The alarm
+ * must have been assigned to a display thread.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void view_alarm(alarm_t *alarm)
+{
+    view_record_t *record = view_table_write(&view_table, alarm->view_slot);
+
+    record->alarm_id = alarm->alarm_id;
+    record->thread_id = alarm->owner->thread_id;
+    record->creation_time = alarm->creation_time;
+    record->time = alarm->time;
+    record->unit = alarm->unit;
+    record->status = alarm->status;
+    strcpy(record->message, alarm->message);
 }
 
 /**
@@ -264,44 +383,47 @@ alarm_t* find_alarm_by_id(int id)
  * alarm_id, this method returns NULL (and prints an error message to
  * the console). Otherwise, the alarm is added to the list and the
  * alarm is returned.
+ *
+ * Duplicates are found through the alarm index. The list is still kept
+ * sorted by alarm_id, but the insertion point is searched for backwards from
+ * the tail, so inserting alarms in increasing ID order takes constant time.
  */
 alarm_t *insert_alarm_into_list(alarm_t *alarm)
 {
-    alarm_t *alarm_node = &alarm_header;
-    alarm_t *next_alarm_node = alarm_header.next;
+    alarm_t *alarm_node = alarm_tail;
 
-    // Find where to insert it by comparing alarm_id. The
-    // list should always be sorted by alarm_id.
-    while (next_alarm_node != NULL)
+    if (!alarm_index_insert(&alarm_index, alarm))
     {
-        if (alarm->alarm_id == next_alarm_node->alarm_id)
-        {
-            /*
-             * Invalid because two alarms cannot have the
-             * same alaarm_id. In this case, unlock the
-             * mutex and try again.
-             */
-            printf("Alarm with same ID exists\n");
-            return NULL;
-        }
-        else if (alarm->alarm_id < next_alarm_node->alarm_id)
-        {
-            // Insert before next_alarm_node
-            alarm_node->next = alarm;
-            alarm->next = next_alarm_node;
+        /*
+         * Invalid because two alarms cannot have the
+         * same alaarm_id.
+         */
+        output_printf("Alarm with same ID exists\n");
+        return NULL;
+    }
 
-            return alarm;
-        }
-        else
-        {
-            alarm_node = next_alarm_node;
-            next_alarm_node = next_alarm_node->next;
-        }
+    // Find the last alarm with a smaller alarm_id (or the header).
+    while (alarm_node != &alarm_header
+           && alarm_node->alarm_id > alarm->alarm_id)
+    {
+        alarm_node = alarm_node->prev;
     }
 
-    // Insert at the end of the list
+    // Insert after alarm_node
+    alarm->prev = alarm_node;
+    alarm->next = alarm_node->next;
+    if (alarm->next != NULL)
+    {
+        alarm->next->prev = alarm;
+    }
+    else
+    {
+        alarm_tail = alarm;
+    }
     alarm_node->next = alarm;
-    alarm->next = NULL;
+    alarm->view_slot = view_table_add(&view_table);
+    suspended_alarms += alarm->status == false;
+
     return alarm;
 }
 
@@ -310,63 +432,67 @@ alarm_t *insert_alarm_into_list(alarm_t *alarm)
  *
  * The alarm list mutex MUST BE LOCKED by the caller of this method.
  *
- * The linked list of alarms is searched and when the correct ID is found, it
- * edits the linked list to remove that alarm. The node that was removes is
- * then returned.
+ * The alarm with the given ID is found through the alarm index and unlinked
+ * from the list using its `prev` pointer. The node that was removed is then
+ * returned (or NULL if there was no alarm with that ID).
  */
 alarm_t *remove_alarm_from_list(int id)
 {
-    alarm_t *alarm_node = alarm_header.next;
-    alarm_t *alarm_prev = &alarm_header;
+    alarm_t *alarm_node = alarm_index_remove(&alarm_index, id);
 
-    // Keeps on searching the list until it finds the correct ID
-    while (alarm_node != NULL)
+    if (alarm_node == NULL)
     {
-        if (alarm_node->alarm_id == id)
-        {
-            alarm_prev->next = alarm_node->next;
-            break; // Exit loop since ID has been found
-        }
-        // If the ID is not found, move to the next node
-        alarm_node = alarm_node->next;
-        alarm_prev = alarm_prev->next;
+        return NULL;
+    }
+
+    alarm_node->prev->next = alarm_node->next;
+    if (alarm_node->next != NULL)
+    {
+        alarm_node->next->prev = alarm_node->prev;
     }
+    else
+    {
+        alarm_tail = alarm_node->prev;
+    }
+    view_table_remove(&view_table, alarm_node->view_slot);
+    suspended_alarms -= alarm_node->status == false;
+    if (alarm_index.count == suspended_alarms)
+    {
+        pthread_cond_broadcast(&thread_list_empty);
+    }
+
     return alarm_node;
 }
 
 /**
- * Reactivates an alarm in the alarm list by traversing the list until it finds
- * the alarm with the specified id and setting its status to true (active).
+ * Reactivates an alarm of the list (found through the alarm index) by
+ * setting its status to true (active). It runs for the time it had left when
+ * it was suspended. Returns true if the alarm was suspended and has been
+ * reactivated.
  */
-void reactivate_alarm_in_list(int alarm_id) {
-    alarm_t *alarm = alarm_header.next;
-
+bool reactivate_alarm_in_list(alarm_t *alarm) {
     /*
-     *Checks if the current alarm is the list is NULL
+     * Sets the alarms status to active and prints out the the alarm ID
+     * followed by the time the alarm was reactivated and the reactivation
+     * message.
      */
-    while(alarm != NULL){
-        /*
-         * Sets the alarms status to active and prints out the the alarm ID
-         * followed by the time the alarm was reactivated and the reactivation
-         * message.
-         */
-        if (alarm->alarm_id == alarm_id){
-            alarm->status = true;
-            printf(
-                "Alarm (%d) Reactivated at %ld: %s\n",
-                alarm->alarm_id,
-                time(NULL),
-                alarm->message
-            );
-            if (alarm->change_status = true) {
-                alarm->expiration_time = time(NULL) + alarm->time;
-            }
-            else {
-                alarm->expiration_time = time(NULL) + alarm->time_left;
-            }
-        }
-        alarm = alarm->next;
+    if (alarm == NULL || alarm->status == true) {
+        return false;
     }
+
+    suspended_alarms--;
+    seqlock_write_begin(&alarm->seq);
+    alarm->status = true;
+    alarm->expiration_time = clock_now() + alarm->time_left;
+    seqlock_write_end(&alarm->seq);
+    view_alarm(alarm);
+    output_printf(
+        "Alarm (%d) Reactivated at %ld: %s\n",
+        alarm->alarm_id,
+        clock_time(),
+        alarm->message
+    );
+    return true;
 }
 
 /**
@@ -374,139 +500,697 @@ void reactivate_alarm_in_list(int alarm_id) {
  *
  * The alarm list mutex MUST BE LOCKED by the caller of this method.
  *
- * The linked list of alarms is searched and when the correct ID is
- * found, it returns the integer 1.  If the ID is not found and the
- * entire list has been searched, the integer 0 will be returned.
+ * The alarm is looked up in the alarm index. When the ID is found, it returns
+ * the integer 1. If the ID is not found, the integer 0 will be returned.
  */
 int doesAlarmExist(int id)
 {
-    alarm_t *alarm_node = alarm_header.next;
-
-    // Loop to iterate through list
-    while (alarm_node != NULL)
-    {
-        // ID is found, return 1
-        if (alarm_node->alarm_id == id)
-        {
-            return 1;
-        }
-        // ID not found, move to next node
-        else
-        {
-            alarm_node = alarm_node->next;
-        }
-    }
-    // List has been searched and ID does not exist, return 0
-    return 0;
+    return find_alarm_by_id(id) != NULL;
 }
 
 
 /**
- * Adds a thread to the thread list.
+ * Adds a thread to the end of the thread list.
  *
  * The caller of this function must have the thread list mutex locked when
  * calling this function.
  */
 void add_to_thread_list(thread_t *thread){
-    thread_t *current_thread = &thread_header;
+    thread->prev = thread_tail;
+    thread->next = NULL;
+    thread_tail->next = thread;
+    thread_tail = thread;
+    display_thread_count++;
+}
 
-    while (current_thread != NULL){
-        if(current_thread->next == NULL){
-            current_thread->next = thread;
-            break;
-        }
-        current_thread = current_thread->next;
+/**
+ * Takes a thread out of the list of threads with space. This takes constant
+ * time.
+ *
+ * The caller of this function must have the thread list mutex locked when
+ * calling this function.
+ */
+void remove_from_space_list(thread_t *thread){
+    if (!thread->has_space){
+        return;
+    }
+
+    if (thread->space_prev != NULL){
+        thread->space_prev->space_next = thread->space_next;
+    } else {
+        threads_with_space = thread->space_next;
     }
+    if (thread->space_next != NULL){
+        thread->space_next->space_prev = thread->space_prev;
+    }
+    thread->has_space = false;
 }
 
 /**
- * Removes a thread from the thread list.
+ * Adds a thread to the list of threads with space, or takes it out, after
+ * its number of alarms has changed. This takes constant time.
  *
  * The caller of this function must have the thread list mutex locked when
  * calling this function.
+ */
+void update_thread_space(thread_t *thread){
+    if (thread->alarms >= alarms_per_thread){
+        remove_from_space_list(thread);
+        return;
+    }
+    if (thread->has_space){
+        return;
+    }
+
+    thread->space_prev = NULL;
+    thread->space_next = threads_with_space;
+    if (threads_with_space != NULL){
+        threads_with_space->space_prev = thread;
+    }
+    threads_with_space = thread;
+    thread->has_space = true;
+}
+
+/**
+ * Removes a thread from the thread list.
+ *
+ * The caller of this function must have the thread list mutex locked when
+ * calling this function. The alarm list mutex must be locked too, because
+ * thread_list_empty is broadcast when the last thread leaves.
  *
- * The linked list of threads is searched and when the correct ID is found, it
- * edits the linked list to remove that alarm. The thread that was removed is
+ * The thread is unlinked using its `prev` pointer, so this takes constant
+ * time no matter how many threads there are. The thread that was removed is
  * then returned.
  */
 thread_t* remove_from_thread_list(thread_t *thread){
-    thread_t *thread_node = thread_header.next;
-    thread_t *thread_prev = &thread_header;
+    thread->prev->next = thread->next;
+    if (thread->next != NULL) {
+        thread->next->prev = thread->prev;
+    }
+    else {
+        thread_tail = thread->prev;
+    }
 
-    // Keeps on searching the list until it finds the correct thread in the list
-    while (thread_prev != NULL){
-        if (thread_node == thread) {
-            thread_prev->next = thread_node->next; // Remove from list.
-            break;                                 // Exit loop.
-        }
-        // If the ID is not found, move to the next node
-        thread_node = thread_node->next;
-        thread_prev = thread_prev->next;
+    // A thread that is gone cannot be given alarms.
+    remove_from_space_list(thread);
+    display_thread_count--;
+
+    if (thread_header.next == NULL){
+        pthread_cond_broadcast(&thread_list_empty);
     }
 
-    return thread_node;
+    return thread;
 }
 
 /**
- * Checks if there are any threads in the thread list that have space for an
- * alarm. Returns true if all the threads are full (no space left), and false if
- * there is at least one thread with space for an alarm.
+ * Frees a display thread's entry (which was malloced by the main thread).
+ *
+ * Its lateness histograms and wakeups are added to the ones of the threads
+ * that have exited.
+ *
+ * The caller of this function must have the alarm list mutex and the thread
+ * list mutex locked when calling this function, and the thread must not be
+ * in the thread list.
  */
-bool thread_full_check(){
-    thread_t *current_thread = thread_header.next;
-
-    while(current_thread != NULL){
-        if(current_thread->alarms != 2){
-            return false;
+void free_thread(thread_t *thread){
+    if (thread->lateness != NULL)
+    {
+        for (int kind = 0; kind < LATENESS_KINDS; kind++)
+        {
+            histogram_merge(&retired_lateness[kind], &thread->lateness[kind]);
         }
-        current_thread = current_thread->next;
+        free(thread->lateness);
     }
-
-    return true;
+    wakeup_stats_add(&retired_wakeups, &thread->wakeups);
+    mailbox_destroy(&thread->mailbox);
+    free(thread->slots);
+    free(thread->free_slots);
+    free(thread);
 }
 
 /**
- * DISPLAY THREAD
- * * * * * * * * *
- *
- * This is the function that will be used for display threads. It will loop
- * every 5 seconds, waiting on a condition variable. When the wait times out, it
- * prints the alarms that it holds, unless either of its alarm has expired, in
- * which case it will delete the alarm.
- *
- * The main thread communicates to the display threads through events and a
- * condition variable. When the main thread needs an event to be handled by a
- * display thread, it creates an event, stored in a global variable, and
- * broadcasts a condition variable.
+ * Finds a thread in the thread list that has space for an alarm. Returns NULL
+ * if all the threads are full (no space left).
  *
- * If a display thread can handle an event, it will perform actions to handle it
- * and delete the event once it is finished. Other display threads will not
- * handle a deleted event, ensuring the event is only handled once. If a thread
- * cannot handle an event, it will do nothing.
+ * The caller of this function must have the thread list mutex locked when
+ * calling this function.
  *
- * Once a display thread has no alarms left (either because they expired or were
- * cancelled) it will remove and free its entry from the thread list and return
- * from this function (which will allow the thread to be recycled by the
- * operating system).
+ * The first thread of the list of threads with space is returned, so this
+ * takes constant time no matter how many threads there are.
  */
-void *client_thread(void *arg)
-{
+thread_t *find_thread_with_space(){
+    return threads_with_space;
+}
+
+/**
+ * Records how late (in nanoseconds) a display thread expired or printed one
+ * of its alarms.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void record_lateness(thread_t *thread, lateness_kind kind, int64_t lateness)
+{
+    if (thread->lateness == NULL)
+    {
+        thread->lateness = calloc(LATENESS_KINDS, sizeof(histogram_t));
+        if (thread->lateness == NULL)
+        {
+            errno_abort("Calloc failed");
+        }
+    }
+    histogram_record(&thread->lateness[kind], lateness);
+}
+
+/**
+ * Merges the lateness histograms of every display thread (and of the ones
+ * that have exited, and of the pool workers), and formats a line for each
+ * kind of deadline into `lines`.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void report_lateness(char lines[LATENESS_KINDS][160])
+{
+    histogram_t *merged;
+    thread_t *thread;
+
+    merged = malloc(sizeof(retired_lateness));
+    if (merged == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    memcpy(merged, retired_lateness, sizeof(retired_lateness));
+
+    metered_mutex_lock(&thread_list_mutex);
+    for (thread = thread_header.next; thread != NULL; thread = thread->next)
+    {
+        if (thread->lateness == NULL)
+        {
+            continue;
+        }
+        for (int kind = 0; kind < LATENESS_KINDS; kind++)
+        {
+            histogram_merge(&merged[kind], &thread->lateness[kind]);
+        }
+    }
+    metered_mutex_unlock(&thread_list_mutex);
+
+    for (int i = 0; i < pool_size && engine == ENGINE_POOL; i++)
+    {
+        pthread_mutex_lock(&pool_workers[i].mutex);
+        for (int kind = 0; kind < LATENESS_KINDS; kind++)
+        {
+            histogram_merge(&merged[kind], &pool_workers[i].lateness[kind]);
+        }
+        pthread_mutex_unlock(&pool_workers[i].mutex);
+    }
+
+    histogram_format(
+        &merged[LATENESS_EXPIRY], "Expiry", lines[LATENESS_EXPIRY], 160);
+    histogram_format(
+        &merged[LATENESS_PRINT], "Print", lines[LATENESS_PRINT], 160);
+    free(merged);
+}
+
+/**
+ * Collects the metrics of the program into `metrics`. The number of
+ * expirations per second is left for the reader to set with metrics_rate().
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void collect_metrics(metrics_t *metrics)
+{
+    wakeup_stats_t wakeups = retired_wakeups;
+    thread_t *thread;
+
+    metrics->taken_at = clock_monotonic();
+    metrics->alarms = alarm_index.count;
+    metrics->suspended = suspended_alarms;
+    metrics->commands_queued =
+        __atomic_load_n(&command_queue.tail, __ATOMIC_RELAXED)
+        - __atomic_load_n(&command_queue.head, __ATOMIC_RELAXED);
+    memcpy(metrics->commands, commands_by_type, sizeof(commands_by_type));
+    metrics->bad_commands = bad_commands;
+    metrics->expired = alarms_expired;
+    metrics->expired_per_second = 0;
+    slab_stats(&alarm_pool, &metrics->pool);
+    mutex_metrics_copy(
+        &metrics->mutexes[0], "alarm_list_mutex", &alarm_list_mutex);
+
+    metered_mutex_lock(&thread_list_mutex);
+    mutex_metrics_copy(
+        &metrics->mutexes[1], "thread_list_mutex", &thread_list_mutex);
+    metrics->display_threads = display_thread_count;
+    metrics->events_pending = 0;
+    for (thread = thread_header.next; thread != NULL; thread = thread->next)
+    {
+        metrics->events_pending += thread->mailbox.count;
+        wakeup_stats_add(&wakeups, &thread->wakeups);
+    }
+    metered_mutex_unlock(&thread_list_mutex);
+
+    if (engine == ENGINE_THREADS)
+    {
+        metrics->waiters = "display threads";
+        metrics->wakeups = wakeups;
+    }
+    else if (engine == ENGINE_POOL)
+    {
+        metrics->waiters = "pool workers";
+        metrics->wakeups = (wakeup_stats_t){0, 0, 0};
+        for (int i = 0; i < pool_size; i++)
+        {
+            pthread_mutex_lock(&pool_workers[i].mutex);
+            wakeup_stats_add(&metrics->wakeups, &pool_workers[i].wakeups);
+            pthread_mutex_unlock(&pool_workers[i].mutex);
+        }
+    }
+    else
+    {
+        metrics->waiters = "timer thread";
+        metrics->wakeups = timer_wakeups;
+    }
+}
+
+/**
+ * Formats metrics into the lines printed by the Stats command, and returns
+ * the number of lines.
+ */
+int format_stats(const metrics_t *metrics, char lines[STATS_LINES][256])
+{
+    const mutex_metrics_t *mutex;
+    int length;
+
+    snprintf(
+        lines[0],
+        256,
+        "Alarms: %zu (%zu suspended), %zu display threads, "
+        "%zu events pending, %zu commands queued",
+        metrics->alarms,
+        metrics->suspended,
+        metrics->display_threads,
+        metrics->events_pending,
+        metrics->commands_queued);
+
+    length = snprintf(lines[1], 256, "Commands:");
+    for (int type = 0; type < COMMAND_TYPES; type++)
+    {
+        length += snprintf(
+            lines[1] + length,
+            256 - length,
+            " %s %llu,",
+            command_type_names[type],
+            (unsigned long long)metrics->commands[type]);
+    }
+    snprintf(
+        lines[1] + length,
+        256 - length,
+        " bad %llu",
+        (unsigned long long)metrics->bad_commands);
+
+    snprintf(
+        lines[2],
+        256,
+        "Expired: %llu alarms, %.1f per second",
+        (unsigned long long)metrics->expired,
+        metrics->expired_per_second);
+
+    for (int i = 0; i < METRICS_MUTEXES; i++)
+    {
+        mutex = &metrics->mutexes[i];
+        snprintf(
+            lines[3 + i],
+            256,
+            "Mutex %s: %llu acquisitions, %llu contended (%.1f%%), "
+            "wait %.3f ms, hold %.3f ms",
+            mutex->name,
+            (unsigned long long)mutex->acquisitions,
+            (unsigned long long)mutex->contended,
+            mutex->acquisitions > 0
+                ? 100.0 * mutex->contended / mutex->acquisitions
+                : 0.0,
+            mutex->wait_time / 1e6,
+            mutex->hold_time / 1e6);
+    }
+
+    snprintf(
+        lines[5],
+        256,
+        "Wakeups of %s: %llu useful, %llu timeout, %llu spurious",
+        metrics->waiters,
+        (unsigned long long)metrics->wakeups.useful,
+        (unsigned long long)metrics->wakeups.timeout,
+        (unsigned long long)metrics->wakeups.spurious);
+
+    snprintf(
+        lines[6],
+        256,
+        "Alarm pool: %zu live, %zu peak, %zu free, %zu chunks",
+        metrics->pool.live,
+        metrics->pool.peak,
+        metrics->pool.free,
+        metrics->pool.chunks);
+
+    return STATS_LINES;
+}
+
+/**
+ * Returns true if the message of an alarm has been changed since the alarm
+ * was last printed.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+bool alarm_changed(alarm_t *alarm)
+{
+    return alarm->changes
+        != __atomic_load_n(&alarm->changes_printed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies the printed fields of an alarm, without the alarm list mutex. If
+ * the command thread changes the alarm meanwhile, they are copied again, so
+ * the copy is never half old and half new.
+ *
+ * The alarm must not be freed while it is read, so this is only called by
+ * the display thread that owns the alarm (which is the only thread that
+ * frees it), or with the alarm list mutex locked.
+ */
+void alarm_read(alarm_t *alarm, alarm_print_t *copy)
+{
+    seqlock_t seq;
+
+    do
+    {
+        seq = seqlock_read_begin(&alarm->seq);
+        copy->alarm_id = alarm->alarm_id;
+        copy->time = alarm->time;
+        copy->unit = alarm->unit;
+        copy->status = alarm->status;
+        copy->changes = alarm->changes;
+        copy->expiration_time = alarm->expiration_time;
+        memcpy(copy->message, alarm->message, sizeof(copy->message));
+    }
+    while (seqlock_read_retry(&alarm->seq, seq));
+
+    copy->change_status = copy->changes
+        != __atomic_load_n(&alarm->changes_printed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records that a copy of an alarm has been printed. If the copy showed a
+ * changed message, that change (and the ones before it) no longer needs to
+ * be announced; a change made after the copy was read still does.
+ *
+ * Only the thread that prints the alarm calls this, so no lock is needed.
+ */
+void alarm_printed(alarm_t *alarm, const alarm_print_t *copy)
+{
+    if (copy->change_status == true)
+    {
+        __atomic_store_n(
+            &alarm->changes_printed, copy->changes, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Prints a copy of an alarm that is still running, as a display thread does
+ * every DISPLAY_INTERVAL seconds. If the message of the alarm has been
+ * recently changed, it first prints that the display thread is starting to
+ * print the new message; the caller then calls alarm_printed().
+ *
+ * No lock is needed.
+ */
+void print_alarm(thread_t *thread, const alarm_print_t *alarm)
+{
+    if (alarm->change_status == true) {
+        output_printf(
+            "Display Thread %d Starts to Print Changed Message at %ld: %s\n",
+            thread->thread_id,
+            clock_time(),
+            alarm->message);
+    }
+
+    output_printf(
+        "Alarm (%d) Printed by Alarm Display Thread %d at "
+        "%ld: %d%s %s\n",
+        alarm->alarm_id,
+        thread->thread_id,
+        clock_time(),
+        alarm->time,
+        time_unit_suffixes[alarm->unit],
+        alarm->message);
+}
+
+/**
+ * Prints that an alarm has expired and removes it from the alarm list. The
+ * caller must take the alarm away from its display thread and free it.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void expire_alarm(thread_t *thread, alarm_t *alarm)
+{
+    alarms_expired++;
+    output_printf(
+        "Display Alarm Thread %d Removed Expired Alarm(%d) at "
+        "%ld: %d%s %s\n",
+        thread->thread_id,
+        alarm->alarm_id,
+        clock_time(),
+        alarm->time,
+        time_unit_suffixes[alarm->unit],
+        alarm->message
+    );
+
+    remove_alarm_from_list(alarm->alarm_id);
+}
+
+/**
+ * Suspends an alarm if it is active, remembering how much time it had left.
+ * Returns true if the alarm was suspended.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+bool suspend_alarm(alarm_t *alarm)
+{
+    if (alarm->status == false) {
+        return false;
+    }
+
+    output_printf(
+        "Alarm (%d) Suspended at %ld: %s\n",
+        alarm->alarm_id,
+        clock_time(),
+        alarm->message);
+
+    seqlock_write_begin(&alarm->seq);
+    alarm->status = false;
+    alarm->time_left = alarm->expiration_time - clock_now();
+    seqlock_write_end(&alarm->seq);
+    view_alarm(alarm);
+    suspended_alarms++;
+    if (alarm_index.count == suspended_alarms)
+    {
+        pthread_cond_broadcast(&thread_list_empty);
+    }
+    return true;
+}
+
+/**
+ * Prints that a display thread has removed a cancelled alarm. The alarm has
+ * already been removed from the alarm list by the main thread; the caller
+ * must take the alarm away from its display thread and free it.
+ */
+void print_cancelled_alarm(thread_t *thread, alarm_t *alarm)
+{
+    output_printf(
+        "Display Alarm Thread (%d) Removed Canceled Alarm(%d) at %ld: %s\n",
+        thread->thread_id,
+        alarm->alarm_id,
+        clock_time(),
+        alarm->message);
+}
+
+/**
+ * Prints one alarm of a display thread for View_Alarms.
+ */
+void print_assigned_alarm(view_record_t *record)
+{
+    output_printf(
+        "Alarm(%d): Created at %ld: Assigned at %d%s %s "
+        "Status %s\n",
+        record->alarm_id,
+        record->creation_time,
+        record->time,
+        time_unit_suffixes[record->unit],
+        record->message,
+        record->status == true ? "active" : "suspended");
+}
+
+/**
+ * Takes the alarm in slot `slot` away from a display thread and frees it,
+ * after it has expired or been cancelled. The slot can be given to the next
+ * alarm assigned to the thread.
+ *
+ * This runs on the display thread, which has the alarm list mutex locked.
+ */
+void free_slot(thread_t *thread, int slot)
+{
+    free_alarm(thread->slots[slot]);
+    thread->slots[slot] = NULL;
+
+    // Update thread list to show that this thread has one less alarm.
+    metered_mutex_lock(&thread_list_mutex);
+    thread->alarms--;
+    thread->free_slots[alarms_per_thread - thread->alarms - 1] = slot;
+    update_thread_space(thread);
+    metered_mutex_unlock(&thread_list_mutex);
+}
+
+/**
+ * Handles an event taken from the mailbox of a display thread, updating the
+ * thread's alarm slots if the event adds or removes an alarm.
+ *
+ * This runs on the display thread, which has the alarm list mutex locked.
+ */
+void handle_event(thread_t *thread, event_t *event)
+{
+    if (event->type == Start_Alarm)
+    {
+        /*
+         * A new alarm goes into the slot that the command thread chose for
+         * it when it assigned the alarm to this thread.
+         */
+        thread->slots[event->slot] = event->alarm;
+        DEBUG_PRINTF("Thread took alarm %d\n", event->alarm->alarm_id);
+    }
+    else if (event->type == Suspend_Alarm
+             || event->type == Reactivate_Alarm
+             || event->type == Change_Alarm)
+    {
+        /*
+         * The command thread has already suspended, reactivated or
+         * changed the alarm. The event only wakes this thread up, so that
+         * it stops waiting for the alarm's expiry, or waits for its new
+         * one.
+         */
+        DEBUG_PRINTF(
+            "Thread %d woken up for %s alarm %d\n",
+            thread->thread_id,
+            command_type_names[event->type],
+            event->alarmId
+        );
+    }
+    else if (event->type == Cancel_Alarm)
+    {
+        /*
+         * The alarm may have expired (and been freed) while the command
+         * thread waited for space in the mailbox, so it is only compared
+         * with the alarm in its slot.
+         */
+        if (thread->slots[event->slot] == event->alarm)
+        {
+            print_cancelled_alarm(thread, event->alarm);
+            free_slot(thread, event->slot);
+        } else {
+            DEBUG_PRINTF(
+                "Cancel_Alarm event for alarm %d not handled by "
+                "thread %d\n",
+                event->alarmId,
+                thread->thread_id
+            );
+        }
+    }
+}
+
+/**
+ * Prints every running alarm of a display thread that has not expired by
+ * `now` (or been cancelled), and returns how many were printed.
+ *
+ * This runs on the display thread with the alarm list mutex unlocked. The
+ * thread's slots only change on the thread itself, and only the thread frees
+ * its alarms, so they stay valid; each one is copied with alarm_read(), in
+ * case the command thread changes it meanwhile.
+ */
+int print_display_alarms(thread_t *thread, int64_t now)
+{
+    alarm_t *alarm;
+    alarm_print_t copy;
+    int printed = 0;
+
+    for (int i = 0; i < alarms_per_thread; i++)
+    {
+        alarm = thread->slots[i];
+        if (alarm == NULL || __atomic_load_n(&alarm->retired, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        alarm_read(alarm, &copy);
+        if (copy.status == false || copy.expiration_time <= now)
+        {
+            continue;
+        }
+        print_alarm(thread, &copy);
+        alarm_printed(alarm, &copy);
+        printed++;
+    }
+
+    return printed;
+}
+
+/**
+ * DISPLAY THREAD
+ * * * * * * * * *
+ *
+ * This is the function that will be used for display threads. It will loop
+ * every 5 seconds, waiting on a condition variable. When the wait times out, it
+ * prints the alarms that it holds, unless any of its alarms has expired, in
+ * which case it will delete the alarm. Each display thread holds up to
+ * `alarms_per_thread` alarms in an array of slots.
+ *
+ * The main thread communicates with each display thread through the thread's
+ * mailbox. When the main thread needs an event to be handled by a display
+ * thread, it picks the thread (the owner of the alarm, or a thread with space
+ * for a new alarm), copies the event into that thread's mailbox and signals
+ * that thread's condition variable. No other display thread is woken up.
+ *
+ * Every time a display thread wakes up, it handles all of the events in its
+ * mailbox in the order they were posted, so no event is lost when the main
+ * thread sends several events in a row.
+ *
+ * Once a display thread has no alarms left (either because they expired or were
+ * cancelled) it will remove and free its entry from the thread list and return
+ * from this function (which will allow the thread to be recycled by the
+ * operating system).
+ */
+void *client_thread(void *arg)
+{
     thread_t *thread = ((thread_t *)arg); // The thread parameter passed to this
                                           // thread.
 
-    alarm_t *alarm1 = NULL;               // The first slot for an alarm.
-
-    alarm_t *alarm2 = NULL;               // The second slot for an alarm.
+    alarm_t *alarm;                       // The alarm in the current slot.
 
     int status;                           // Vaariable to hold the status
                                           // returned by timed condition
                                           // variable waits.
 
-    time_t now;                           // Variable to hold the current time.
+    int64_t deadline;                     // Time to wake up at (monotonic
+                                          // clock, in nanoseconds).
+
+    int64_t print_deadline;               // Time the running alarms are
+                                          // due to be printed at.
+
+    int64_t now;                          // Time the wait timed out at.
 
     struct timespec t;                    // Variable for setting timeout for
                                           // timed condition variable waits.
 
+    event_t event;                        // Event taken from the mailbox.
+
+    int running;                          // Number of alarms left running
+                                          // after a timeout.
+
+    int printed;                          // Number of them printed.
+
     DEBUG_PRINTF("Creating thread %d\n", thread->thread_id);
 
     /*
@@ -520,15 +1204,9 @@ void *client_thread(void *arg)
             thread->alarm->alarm_id
         );
 
-        // Take alarm as alarm1
-        alarm1 = thread->alarm;
-
-        // Update the number of available alarms for this thread in
-        // the thread list. Note that we need the mutex to do this
-        // because multiple threads can access the list of threads.
-        pthread_mutex_lock(&thread_list_mutex);
-        thread->alarms++;
-        pthread_mutex_unlock(&thread_list_mutex);
+        // Take alarm into the first slot. The main thread has already
+        // counted it in the number of alarms of this thread.
+        thread->slots[thread->alarm->slot] = thread->alarm;
     } else {
         DEBUG_PRINTF("Thread %d was not given an alarm\n", thread->thread_id);
     }
@@ -536,21 +1214,26 @@ void *client_thread(void *arg)
     /*
      * Lock the mutex so that this thread can access the alarm list.
      */
-    pthread_mutex_lock(&alarm_list_mutex);
+    metered_mutex_lock(&alarm_list_mutex);
 
     while (1)
     {
         /*
-         * If both alarms are NULL, then we can remove this thread.
+         * If this thread has no alarms (including alarms that were assigned
+         * to it but are still in its mailbox), then we can remove this
+         * thread. The thread also stays while the main thread is waiting for
+         * space in its mailbox.
          *
          * Note that the thread is given an alarm in the parameter when it is
          * created, so it should not exit immediately after creation.
          */
-        if (alarm1 == NULL && alarm2 == NULL) {
-            printf(
+        if (thread->alarms == 0
+            && thread->mailbox.count == 0
+            && thread->mailbox.waiting_posters == 0) {
+            output_printf(
                 "Display Alarm Thread %d Exiting at %ld\n",
                 thread->thread_id,
-                time(NULL)
+                clock_time()
             );
 
             /*
@@ -559,442 +1242,2318 @@ void *client_thread(void *arg)
              * mutex, and break so that we exit the main loop and this thread
              * can be destroyed.
              */
-            pthread_mutex_lock(&thread_list_mutex);
+            metered_mutex_lock(&thread_list_mutex);
             remove_from_thread_list(thread);
-            free(thread);
-            pthread_mutex_unlock(&thread_list_mutex);
+            free_thread(thread);
+            metered_mutex_unlock(&thread_list_mutex);
+
+            // Give the alarms this thread freed back to the alarm pool, and
+            // its output ring to the writer thread.
+            slab_cache_flush(&alarm_pool, &alarm_cache);
+            output_release();
             break;
         }
 
         /*
-         * Get current time (in seconds from UNIX epoch).
-         */
-        now = time(NULL);
-
-        /*
-         * Calculate timeout.
+         * Calculate timeout. Wake up in 5 seconds to print the alarms, or
+         * earlier if an active alarm expires before that. The mailbox
+         * condition variable waits on the monotonic clock, which is also the
+         * clock of the expiration times, so the wait ends exactly at (or just
+         * after) the expiry, never before it.
          */
-        if (alarm1 != NULL && alarm1->status == false) {
-            if (alarm2 != NULL && alarm2->expiration_time - now < 5) {
-                t.tv_sec = alarm2->expiration_time;
-            }
-            else {
-                // Set timeout to 5 seconds in the future because none of the
-                // alarms are expiring soon.
-                t.tv_sec = now + 5;
-            }
-        }
-        else if (alarm2 != NULL && alarm2->status == false) {
-            if (alarm1 != NULL && alarm1->expiration_time - now < 5) {
-                t.tv_sec = alarm1->expiration_time;
-            }
-            else {
-                // Set timeout to 5 seconds in the future because none of the
-                // alarms are expiring soon.
-                t.tv_sec = now + 5;
-            }
-        }
-        else if (alarm1 != NULL && alarm1->expiration_time - now < 5 && alarm1->status == true) {
-            if (alarm2 == NULL) {
-                // Alarm 1 expires first
-                t.tv_sec = alarm1->expiration_time;
-            } else if (alarm1->expiration_time < alarm2->expiration_time) {
-                // Alarm 1 expires first
-                t.tv_sec = alarm1->expiration_time;
-            } else {
-                // Alarm 2 expires first
-                t.tv_sec = alarm2->expiration_time;
-            }
-        } else if (alarm2 != NULL && alarm2->expiration_time - now < 5 && alarm2->status == true) {
-            if (alarm1 == NULL) {
-                // Alarm 2 expires first
-                t.tv_sec = alarm2->expiration_time;
-            } else if (alarm2->expiration_time < alarm1->expiration_time) {
-                // Alarm 2 expires first
-                t.tv_sec = alarm2->expiration_time;
-            } else {
-                // Alarm 1 expires first
-                t.tv_sec = alarm1->expiration_time;
+        print_deadline = clock_now() + DISPLAY_INTERVAL;
+        deadline = print_deadline;
+        for (int i = 0; i < alarms_per_thread; i++)
+        {
+            alarm = thread->slots[i];
+            if (alarm != NULL
+                && alarm->status == true
+                && !alarm->retired
+                && alarm->expiration_time < deadline)
+            {
+                deadline = alarm->expiration_time;
             }
-        } else {
-            // Set timeout to 5 seconds in the future because none of the
-            // alarms are expiring soon.
-            t.tv_sec = now + 5;
         }
-        /*
-         * Add 10 milliseconds (10,000,000 nanoseconds) to the timeout to make
-         * sure the expiry is reached. If we don't do this, we get a bug where
-         * the alarm prints out many times in quick succession before expiring.
-         */
-        t.tv_nsec = 10000000;
+        clock_timespec(deadline, &t);
 
         /*
-         * Wait for condition variable to be broadcast. When we get a
-         * broadcast, this thread will wake up and will have the mutex
-         * locked.
+         * Wait for an event to be posted to our mailbox, unless there is one
+         * already. When an event is posted, this thread will wake up and will
+         * have the mutex locked.
          *
          * Since this is a timed wait, we may also be woken up by the
          * time expiring. In this case, the status returned will be
          * ETIMEDOUT.
          */
-        status = pthread_cond_timedwait(
-            &alarm_list_cond,
-            &alarm_list_mutex,
-            &t
-        );
-
-        /*
-         * In this case, the 5 seconds timed out, so we must print the
-         * alarm.
-         */
-        if (status == ETIMEDOUT)
+        status = 0;
+        if (thread->mailbox.count == 0)
         {
-            if (alarm1 != NULL && alarm1->expiration_time <= time(NULL) && alarm1->status == true) {
-                printf(
-                    "Display Alarm Thread %d Removed Expired Alarm(%d) at "
-                    "%ld: %d %s\n",
-                    thread->thread_id,
-                    alarm1->alarm_id,
-                    time(NULL),
-                    alarm1->time,
-                    alarm1->message
-                );
+            status = metered_cond_timedwait(
+                &thread->mailbox.cond,
+                &alarm_list_mutex,
+                &t
+            );
 
-                /*
-                 * If alarm1 has expired, remove it from the list, free the
-                 * alarm, remove it from this thread, and update the thread list
-                 * to show that this thread has another space left.
-                 */
-                remove_alarm_from_list(alarm1->alarm_id);
-                free(alarm1);
-                alarm1 = NULL;
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms--;
-                pthread_mutex_unlock(&thread_list_mutex);
-            }
-            else if (alarm1 != NULL && alarm1->status == true)
+            // Count what the wakeup was for.
+            if (status == ETIMEDOUT)
             {
-                /*
-                 * If the message for alarm1 has been recently changed, print that
-                 * the display thread is starting to print the new message.
-                 */
-                if (alarm1->change_status == true) {
-                    printf(
-                        "Display Thread %d Starts to Print Changed Message at %ld: %s\n",
-                        thread->thread_id,
-                        time(NULL),
-                        alarm1->message);
-                    alarm1->change_status = false;
-                }
-                /*
-                * If alarm 1 is defined in this thread, print it.
-                */
-                printf(
-                    "Alarm (%d) Printed by Alarm Display Thread %d at "
-                    "%ld: %d %s\n",
-                    alarm1->alarm_id,
-                    thread->thread_id,
-                    time(NULL),
-                    alarm1->time,
-                    alarm1->message);
+                thread->wakeups.timeout++;
             }
-
-            if (alarm2 != NULL && alarm2->expiration_time <= time(NULL) && alarm2->status == true) {
-                printf(
-                    "Display Alarm Thread %d Removed Expired Alarm(%d) at "
-                    "%ld: %d %s\n",
-                    thread->thread_id,
-                    alarm2->alarm_id,
-                    time(NULL),
-                    alarm2->time,
-                    alarm2->message
-                );
-
-                /*
-                 * If alarm2 has expired, remove it from the list, free the
-                 * alarm, remove it from this thread, and update the thread list
-                 * to show that this thread has another space left.
-                 */
-                remove_alarm_from_list(alarm2->alarm_id);
-                free(alarm2);
-                alarm2 = NULL;
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms--;
-                pthread_mutex_unlock(&thread_list_mutex);
+            else if (thread->mailbox.count > 0)
+            {
+                thread->wakeups.useful++;
             }
-            else if (alarm2 != NULL && alarm2->status == true)
+            else
             {
-                /*
-                 * If the message for alarm2 has been recently changed, print that
-                 * the display thread is starting to print the new message.
-                 */
-                if (alarm2->change_status == true) {
-                    printf(
-                        "Display Thread %d Starts to Print Changed Message at %ld: %s\n",
-                        thread->thread_id,
-                        time(NULL),
-                        alarm2->message);
-                    alarm2->change_status = false;
-                }
-                /*
-                 * If alarm 2 is defined in this thread, print it.
-                 */
-                printf(
-                    "Alarm (%d) Printed by Alarm Display Thread %d at "
-                    "%ld: %d %s\n",
-                    alarm2->alarm_id,
-                    thread->thread_id,
-                    time(NULL),
-                    alarm2->time,
-                    alarm2->message);
+                thread->wakeups.spurious++;
             }
-
-            /*
-             * Since the thread was woken up by a timeout, we continue
-             * here so that we don't execute any code below. The code
-             * below is for event handling, and there was no event.
-             */
-            continue;
         }
 
         /*
-         * If we reach this part of the code, then the thread was
-         * woken up by an event and not a timeout. In this case, lock
-         * the event mutex so we can try to handle the event.
-         */
-        pthread_mutex_lock(&event_mutex);
-
-        /*
-         * If event is null, then it was either a false alarm, or the
-         * event was already handled by another thread, so we can
-         * ignore it.
+         * Handle every event in the mailbox, oldest first. This is done
+         * before handling a timeout so that, for example, a cancelled alarm
+         * is not printed or expired first.
          */
-        if (event == NULL)
+        while (mailbox_take(&thread->mailbox, &event))
         {
-            pthread_mutex_unlock(&event_mutex);
-            continue;
+            handle_event(thread, &event);
         }
 
         /*
-         * Event type of 1 means a new alarm was created.
+         * In this case, the 5 seconds timed out, so we must print the
+         * alarms, and remove the ones that have expired.
          */
-        if (event->type == Start_Alarm)
+        if (status == ETIMEDOUT)
         {
+            now = clock_now();
+            running = 0;
+            for (int i = 0; i < alarms_per_thread; i++)
+            {
+                alarm = thread->slots[i];
+                if (alarm == NULL || alarm->status == false || alarm->retired)
+                {
+                    continue;
+                }
+
+                if (alarm->expiration_time <= now)
+                {
+                    record_lateness(
+                        thread,
+                        LATENESS_EXPIRY,
+                        now - alarm->expiration_time);
+                    expire_alarm(thread, alarm);
+                    free_slot(thread, i);
+                }
+                else
+                {
+                    running++;
+                }
+            }
+
             /*
-             * We need to check if this thread's alarms are NULL to
-             * see if we have capacity for the new alarm. If we take
-             * the alarm, then we must free the event and set it to
-             * NULL to show other threads that this event was already
-             * handled.
+             * Every alarm still running is printed when the wait times
+             * out. This is done with the alarm list mutex unlocked, so
+             * that the command thread does not wait for the output.
              */
-            if (alarm1 == NULL)
+            if (running > 0)
             {
+                metered_mutex_unlock(&alarm_list_mutex);
+                printed = print_display_alarms(thread, now);
+                output_throttle();
+                metered_mutex_lock(&alarm_list_mutex);
+
                 /*
-                 * If alarm1 is NULL, then take the alarm.
+                 * Only a wakeup for the print deadline is a print sample;
+                 * one for an earlier expiry would count as on time.
                  */
-                alarm1 = event->alarm;
-                DEBUG_PRINTF("Thread took alarm %d\n", alarm1->alarm_id);
-                free(event);
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms++;
-                pthread_mutex_unlock(&thread_list_mutex);
-                event = NULL;
+                if (now >= print_deadline)
+                {
+                    for (int i = 0; i < printed; i++)
+                    {
+                        record_lateness(
+                            thread,
+                            LATENESS_PRINT,
+                            now - print_deadline);
+                    }
+                }
             }
-            else if (alarm2 == NULL)
+        }
+
+        DEBUG_PRINT_ALARM_LIST(alarm_header.next);
+    }
+
+    /*
+     * Unlock alarm list mutex.
+     */
+    metered_mutex_unlock(&alarm_list_mutex);
+    return NULL;
+}
+
+/**
+ * Sends an event about an alarm to the display thread that owns it (threads
+ * engine only). Only that thread is woken up, and only if its mailbox was
+ * empty; the other display threads go on sleeping.
+ *
+ * The alarm list mutex must be locked by the caller. It is released while
+ * waiting if the thread's mailbox is full.
+ */
+void notify_owner(alarm_t *alarm, command_type type)
+{
+    event_t event;
+
+    event.type = type;
+    event.alarmId = alarm->alarm_id;
+    event.alarm = alarm;
+    event.slot = alarm->slot;
+    mailbox_post(&alarm->owner->mailbox, event, &alarm_list_mutex);
+}
+
+/**
+ * Finds a display thread with space for an alarm, or creates one if all
+ * threads are full, and assigns the alarm to it. The alarm is counted in the
+ * thread's number of alarms right away, so that the next alarm does not go to
+ * the same free slot.
+ *
+ * With the thread engine, a new display thread is started with the alarm as
+ * its parameter, and an existing display thread is sent the alarm in a
+ * Start_Alarm event. With the timer engines, display threads are records in
+ * the thread list that do not run as threads.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void assign_display_thread(alarm_t *alarm)
+{
+    thread_t *thread;
+    bool created = false;
+
+    metered_mutex_lock(&thread_list_mutex);
+
+    thread = find_thread_with_space();
+    if (thread == NULL)
+    {
+        // Allocate space for a new thread.
+        thread = malloc(sizeof(thread_t));
+        if (thread == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        // Fill in data for the thread
+        thread->thread_id = thread_id_counter++;
+        thread->alarms = 0;
+        thread->next = NULL;
+        thread->alarm = alarm;
+        thread->slots = NULL;
+        thread->free_slots = NULL;
+        if (engine == ENGINE_THREADS)
+        {
+            thread->slots = calloc(alarms_per_thread, sizeof(alarm_t *));
+            thread->free_slots = malloc(alarms_per_thread * sizeof(int));
+            if (thread->slots == NULL || thread->free_slots == NULL)
             {
-                /*
-                 * If alarm2 is NULL, we can still take the alarm.
-                 */
-                alarm2 = event->alarm;
-                DEBUG_PRINTF("Thread took alarm %d\n", alarm2->alarm_id);
-                free(event);
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms++;
-                pthread_mutex_unlock(&thread_list_mutex);
-                event = NULL;
+                errno_abort("Malloc failed");
             }
-            else
+            // Slot 0 is on top, for the alarm the thread is created with.
+            for (int i = 0; i < alarms_per_thread; i++)
             {
-                /*
-                 * If both alarms are not NULL, we cannot take the
-                 * alarm.
-                 */
-                DEBUG_PRINTF(
-                    "Thread at capacity, did not take alarm %d\n",
-                    event->alarm->alarm_id);
+                thread->free_slots[i] = alarms_per_thread - 1 - i;
             }
+        }
+        mailbox_init(&thread->mailbox);
+        thread->has_space = false;
+        thread->lateness = NULL;
+        thread->wakeups = (wakeup_stats_t){0, 0, 0};
+        add_to_thread_list(thread);
+        created = true;
+    }
+
+    if (engine == ENGINE_THREADS)
+    {
+        alarm->slot =
+            thread->free_slots[alarms_per_thread - thread->alarms - 1];
+    }
+    thread->alarms++;
+    update_thread_space(thread);
+    alarm->owner = thread;
+    view_alarm(alarm);
+
+    metered_mutex_unlock(&thread_list_mutex);
+
+    if (created)
+    {
+        if (engine == ENGINE_THREADS)
+        {
+            // Create the new thread.
+            pthread_create(&thread->thread, NULL, client_thread, thread);
+        }
+
+        DEBUG_PRINT_THREAD_LIST(thread_header);
+
+        output_printf(
+            "New Display Alarm Thread %d Created at %ld: %d%s %s\n",
+            thread->thread_id,
+            clock_time(),
+            alarm->time,
+            time_unit_suffixes[alarm->unit],
+            alarm->message
+        );
+    }
+    else if (engine == ENGINE_THREADS)
+    {
+        notify_owner(alarm, Start_Alarm);
+    }
+}
+
+/**
+ * Takes an alarm away from its display thread. If the thread has no alarms
+ * left, it is removed from the thread list and freed, just like a display
+ * thread that exits.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void release_display_thread(alarm_t *alarm)
+{
+    thread_t *thread = alarm->owner;
+
+    metered_mutex_lock(&thread_list_mutex);
+
+    alarm->owner = NULL;
+    thread->alarms--;
+    update_thread_space(thread);
+    if (thread->alarms == 0)
+    {
+        output_printf(
+            "Display Alarm Thread %d Exiting at %ld\n",
+            thread->thread_id,
+            clock_time()
+        );
+        remove_from_thread_list(thread);
+        free_thread(thread);
+    }
+
+    metered_mutex_unlock(&thread_list_mutex);
+}
+
+/**
+ * Returns the pool worker that keeps the deadlines of an alarm. All the alarms
+ * of a display thread go to the same worker.
+ */
+pool_worker_t *pool_worker_of(alarm_t *alarm)
+{
+    return &pool_workers[alarm->owner->thread_id % pool_size];
+}
+
+/**
+ * Puts the next deadline of an alarm into the heap of its pool worker, and
+ * wakes the worker up if it is sleeping past the new deadline.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void schedule_pool_timer(alarm_t *alarm, int64_t deadline)
+{
+    pool_worker_t *worker = pool_worker_of(alarm);
+
+    pthread_mutex_lock(&worker->mutex);
+
+    if (heap_node_queued(&alarm->heap_node))
+    {
+        min_heap_update(&worker->heap, &alarm->heap_node, deadline);
+    }
+    else
+    {
+        min_heap_insert(&worker->heap, &alarm->heap_node, deadline);
+    }
+
+    if (worker->deadline == -1 || deadline < worker->deadline)
+    {
+        worker->deadline = deadline;
+        pthread_cond_signal(&worker->cond);
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+/**
+ * Puts the next deadline of an active alarm (the earlier of its next print and
+ * its expiry) into the timing wheel or heap, replacing its previous deadline.
+ * In the heap this is a decrease-key or increase-key. If the timer thread is
+ * sleeping past the new deadline, it is woken up.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void schedule_alarm_timer(alarm_t *alarm)
+{
+    int64_t deadline = alarm->next_print;
+
+    if (alarm->expiration_time < deadline)
+    {
+        deadline = alarm->expiration_time;
+    }
+
+    if (engine == ENGINE_POOL)
+    {
+        schedule_pool_timer(alarm, deadline);
+        return;
+    }
+
+    if (engine == ENGINE_WHEEL)
+    {
+        // The wheel ticks every millisecond. Round up, so that the tick
+        // is never before the deadline.
+        alarm->timer.data = alarm;
+        timing_wheel_schedule(
+            &alarm_wheel,
+            &alarm->timer,
+            (deadline + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+    }
+    else if (heap_node_queued(&alarm->heap_node))
+    {
+        min_heap_update(&alarm_heap, &alarm->heap_node, deadline);
+    }
+    else
+    {
+        min_heap_insert(&alarm_heap, &alarm->heap_node, deadline);
+    }
+
+    /*
+     * Only the earliest new deadline needs a wakeup. The timer thread
+     * recomputes timer_deadline when it wakes up, so recording the deadline
+     * here keeps a batch of commands from signalling once per alarm.
+     */
+    if (timer_deadline == -1 || deadline < timer_deadline)
+    {
+        timer_deadline = deadline;
+        pthread_cond_signal(&timer_cond);
+    }
+}
+
+/**
+ * Takes the deadline of an alarm out of the timing wheel or heap, for example
+ * because it was suspended or cancelled.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void cancel_alarm_timer(alarm_t *alarm)
+{
+    pool_worker_t *worker;
+
+    if (engine == ENGINE_POOL)
+    {
+        // A key of -1 tells a due work item for the alarm that it is stale.
+        worker = pool_worker_of(alarm);
+        pthread_mutex_lock(&worker->mutex);
+        min_heap_remove(&worker->heap, &alarm->heap_node);
+        alarm->heap_node.key = -1;
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    else if (engine == ENGINE_WHEEL)
+    {
+        timing_wheel_cancel(&alarm_wheel, &alarm->timer);
+    }
+    else
+    {
+        min_heap_remove(&alarm_heap, &alarm->heap_node);
+    }
+}
+
+/**
+ * Retires an alarm of the pool engine that has been cancelled, so that the
+ * due work items that still point at it are skipped. Returns true if there
+ * are none, and the caller frees the alarm; otherwise, the worker that drops
+ * the last item frees it.
+ *
+ * The alarm list mutex must be locked by the caller, and the alarm must
+ * still have its display thread.
+ */
+bool retire_pool_alarm(alarm_t *alarm)
+{
+    pool_worker_t *worker = pool_worker_of(alarm);
+    bool unused;
+
+    pthread_mutex_lock(&worker->mutex);
+    alarm->retired = true;
+    unused = alarm->work_items == 0;
+    pthread_mutex_unlock(&worker->mutex);
+    return unused;
+}
+
+/**
+ * Starts (or restarts) the periodic printing of an active alarm: it is first
+ * printed DISPLAY_INTERVAL seconds from now, unless it expires before that.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void start_alarm_timer(alarm_t *alarm)
+{
+    alarm->next_print = clock_now() + DISPLAY_INTERVAL;
+    schedule_alarm_timer(alarm);
+}
+
+/**
+ * Called when an alarm reaches its deadline. If the alarm has expired, it is
+ * removed from the list and freed. Otherwise it is printed and its next
+ * deadline is scheduled.
+ *
+ * This runs on the timer thread, which has the alarm list mutex locked. The
+ * alarm's deadline has already been taken out of the timing wheel or heap.
+ */
+void fire_alarm_timer(alarm_t *alarm)
+{
+    int64_t now = clock_now();
+    alarm_print_t copy;
+
+    if (alarm->expiration_time <= now) {
+        record_lateness(
+            alarm->owner,
+            LATENESS_EXPIRY,
+            now - alarm->expiration_time);
+        expire_alarm(alarm->owner, alarm);
+        release_display_thread(alarm);
+        free_alarm(alarm);
+        return;
+    }
+
+    record_lateness(alarm->owner, LATENESS_PRINT, now - alarm->next_print);
+    alarm_read(alarm, &copy);
+    print_alarm(alarm->owner, &copy);
+    alarm_printed(alarm, &copy);
+
+    alarm->next_print = now + DISPLAY_INTERVAL;
+    schedule_alarm_timer(alarm);
+}
+
+/**
+ * Called by the timing wheel for every timer that fires.
+ */
+void fire_wheel_timer(wheel_timer_t *timer)
+{
+    fire_alarm_timer(timer->data);
+}
+
+/**
+ * Fires every alarm in the heap whose deadline is at or before `now`.
+ */
+void fire_due_heap_timers(int64_t now)
+{
+    heap_node_t *top;
+
+    while ((top = min_heap_top(&alarm_heap)) != NULL && top->key <= now)
+    {
+        min_heap_remove(&alarm_heap, top);
+        fire_alarm_timer(top->data);
+    }
+}
+
+/**
+ * Returns the next deadline (monotonic clock) in the timing wheel or heap,
+ * rounded up to the tick of the timing wheel, or -1 if there is none.
+ */
+int64_t next_timer_deadline()
+{
+    uint64_t tick;
+
+    if (engine == ENGINE_WHEEL)
+    {
+        tick = timing_wheel_next_tick(&alarm_wheel);
+        return tick == UINT64_MAX ? -1 : (int64_t)tick * NSEC_PER_MSEC;
+    }
+    return alarm_heap.count == 0 ? -1 : min_heap_top(&alarm_heap)->key;
+}
+
+/**
+ * TIMER THREAD
+ * * * * * * * *
+ *
+ * This is the function for the timer thread of the timer engines. It sleeps
+ * until the next deadline in the timing wheel or heap (or until the main
+ * thread schedules an earlier one), then fires every alarm that is due.
+ *
+ * The number of wakeups depends on the number of due deadlines, not on the
+ * number of alarms or display threads.
+ */
+void *timer_thread(void *arg)
+{
+    struct timespec t; // Variable for setting timeout for timed condition
+                       // variable waits.
+
+    int64_t next;      // Next deadline (or tick of the timing wheel) with
+                       // work to do, or -1 if there is none.
+
+    int64_t now;       // Current time of the monotonic clock.
+
+    int status;        // Status returned by the condition variable wait.
+
+    (void)arg;
+    output_reserve();
+    metered_mutex_lock(&alarm_list_mutex);
+
+    while (1)
+    {
+        now = clock_now();
+        if (engine == ENGINE_WHEEL)
+        {
+            timing_wheel_advance(
+                &alarm_wheel,
+                now / NSEC_PER_MSEC,
+                fire_wheel_timer);
+        }
+        else
+        {
+            fire_due_heap_timers(now);
+        }
+
+        /*
+         * The expiries are printed with the alarm list mutex locked, so
+         * their lines may have spilled; wait for the writer without it.
+         */
+        if (output_spilled())
+        {
+            metered_mutex_unlock(&alarm_list_mutex);
+            output_throttle();
+            metered_mutex_lock(&alarm_list_mutex);
+        }
+        next = next_timer_deadline();
+
+        timer_deadline = next;
+        if (next == -1)
+        {
+            status = metered_cond_wait(&timer_cond, &alarm_list_mutex);
+        }
+        else
+        {
+            clock_timespec(next, &t);
+            status = metered_cond_timedwait(
+                &timer_cond,
+                &alarm_list_mutex,
+                &t);
+        }
+
+        // The timer thread is only signalled for an earlier deadline.
+        if (status == ETIMEDOUT)
+        {
+            timer_wakeups.timeout++;
+        }
+        else if (timer_deadline != next)
+        {
+            timer_wakeups.useful++;
+        }
+        else
+        {
+            timer_wakeups.spurious++;
+        }
+    }
+
+    metered_mutex_unlock(&alarm_list_mutex);
+    return NULL;
+}
+
+/**
+ * Moves the virtual clock forward to `target`, stopping at every deadline
+ * in the timing wheel or heap on the way to fire the alarms that are due
+ * there, in the order the timer thread would fire them. With a `target` of
+ * INT64_MAX, the clock stops at the last deadline, once no active alarm is
+ * left.
+ *
+ * On a virtual clock there is no timer thread; this runs on the command
+ * thread, which has the alarm list mutex locked.
+ */
+void advance_virtual_clock(int64_t target)
+{
+    int64_t next;      // Next deadline (or tick of the timing wheel) with
+                       // work to do, or -1 if there is none.
+
+    while (1)
+    {
+        next = next_timer_deadline();
+        if (next == -1 || next > target)
+        {
+            break;
+        }
+
+        clock_virtual_set(next);
+        if (engine == ENGINE_WHEEL)
+        {
+            timing_wheel_advance(
+                &alarm_wheel,
+                next / NSEC_PER_MSEC,
+                fire_wheel_timer);
+        }
+        else
+        {
+            fire_due_heap_timers(next);
+        }
+    }
+
+    if (target != INT64_MAX)
+    {
+        clock_virtual_set(target);
+    }
+}
+
+/**
+ * Moves every alarm in the heap of a pool worker whose deadline is at or
+ * before `now` to the back of the worker's due deque. Each item pins its
+ * alarm until it is fired or skipped.
+ *
+ * The worker's mutex must be locked by the caller.
+ */
+void collect_due_pool_timers(pool_worker_t *worker, int64_t now)
+{
+    heap_node_t *top;
+    work_item_t item;
+
+    while ((top = min_heap_top(&worker->heap)) != NULL && top->key <= now)
+    {
+        min_heap_remove(&worker->heap, top);
+        item.alarm = top->data;
+        item.deadline = top->key;
+        item.home = worker->index;
+        item.alarm->work_items++;
+        work_deque_push_back(&worker->due, item);
+    }
+}
+
+/**
+ * Adds a pool worker to the stack of idle workers, or takes it out, when it
+ * runs out of work or finds some.
+ *
+ * Only the worker itself calls this, and no worker mutex may be locked by
+ * the caller. Since only the worker adds itself to the stack, it can tell
+ * without the stack's mutex that it is not in it.
+ */
+void set_pool_worker_idle(pool_worker_t *worker, bool idle)
+{
+    pool_worker_t *last;
+
+    worker->idle = idle;
+    if (!idle
+        && __atomic_load_n(&worker->idle_index, __ATOMIC_RELAXED) == -1)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_idle_mutex);
+    if (idle && worker->idle_index == -1)
+    {
+        worker->idle_index = pool_idle_count;
+        pool_idle[pool_idle_count] = worker->index;
+        __atomic_store_n(
+            &pool_idle_count, pool_idle_count + 1, __ATOMIC_RELAXED);
+    }
+    else if (!idle && worker->idle_index != -1)
+    {
+        // Move the worker on top of the stack into the worker's place.
+        last = &pool_workers[pool_idle[pool_idle_count - 1]];
+        pool_idle[worker->idle_index] = last->index;
+        __atomic_store_n(
+            &last->idle_index, worker->idle_index, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker->idle_index, -1, __ATOMIC_RELAXED);
+        __atomic_store_n(
+            &pool_idle_count, pool_idle_count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool_idle_mutex);
+}
+
+/**
+ * Tells one idle pool worker that there are due alarms to steal. The worker
+ * is taken off the stack of idle workers, so that the next call wakes up
+ * another one. This takes constant time, and locks nothing if no worker is
+ * idle.
+ *
+ * No worker mutex may be locked by the caller.
+ */
+void wake_idle_pool_worker()
+{
+    pool_worker_t *worker;
+
+    if (__atomic_load_n(&pool_idle_count, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_idle_mutex);
+    if (pool_idle_count == 0)
+    {
+        pthread_mutex_unlock(&pool_idle_mutex);
+        return;
+    }
+    worker = &pool_workers[pool_idle[pool_idle_count - 1]];
+    __atomic_store_n(&worker->idle_index, -1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool_idle_count, pool_idle_count - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_idle_mutex);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->steal_hints++;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+/**
+ * Steals due alarms from the back of another worker's due deque: half of
+ * them (rounded up, and at most POOL_STEAL_BATCH). The first stolen item is
+ * returned in `item` and the rest go into the thief's own deque. Returns
+ * false if no other worker has due alarms.
+ *
+ * No worker mutex may be locked by the caller. Only one worker mutex is
+ * locked at a time, so two workers stealing from each other cannot deadlock.
+ */
+bool steal_pool_work(pool_worker_t *thief, work_item_t *item)
+{
+    work_item_t stolen[POOL_STEAL_BATCH];
+    pool_worker_t *victim;
+    size_t count = 0;
+    size_t wanted;
+
+    for (int i = 1; i < pool_size && count == 0; i++)
+    {
+        victim = &pool_workers[(thief->index + i) % pool_size];
+
+        pthread_mutex_lock(&victim->mutex);
+        wanted = (victim->due.count + 1) / 2;
+        if (wanted > POOL_STEAL_BATCH)
+        {
+            wanted = POOL_STEAL_BATCH;
+        }
+        while (count < wanted)
+        {
+            work_deque_pop_back(&victim->due, &stolen[count++]);
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+
+    if (count == 0)
+    {
+        return false;
+    }
+
+    // The items came off the back, so the earliest one is the last.
+    *item = stolen[--count];
+    if (count > 0)
+    {
+        pthread_mutex_lock(&thief->mutex);
+        while (count > 0)
+        {
+            work_deque_push_back(&thief->due, stolen[--count]);
+        }
+        pthread_mutex_unlock(&thief->mutex);
+    }
+
+    return true;
+}
+
+/**
+ * Drops a work item's pin on its alarm, and returns true if the alarm is
+ * retired and this was the last item, in which case the caller frees it.
+ *
+ * The mutex of the item's home worker must be locked by the caller.
+ */
+bool drop_pool_work(work_item_t item)
+{
+    return --item.alarm->work_items == 0 && item.alarm->retired;
+}
+
+/**
+ * Returns true if a work item is for the current deadline of its alarm. The
+ * alarm may have been cancelled, suspended, changed or reactivated since the
+ * item was queued; in that case the alarm is retired, is not in the heap
+ * with the item's deadline any more (a suspended alarm's key is -1), or has
+ * a new deadline in the heap.
+ *
+ * The mutex of the item's home worker must be locked by the caller.
+ */
+bool pool_work_is_due(work_item_t item)
+{
+    return !item.alarm->retired
+        && !heap_node_queued(&item.alarm->heap_node)
+        && item.alarm->heap_node.key == item.deadline;
+}
+
+/**
+ * Expires an alarm whose due work item found it expired. This needs the
+ * alarm list mutex, which is locked before the home worker's mutex, so the
+ * item is checked again once both are locked.
+ *
+ * No mutex may be locked by the caller. The item still pins the alarm.
+ */
+void expire_pool_work(work_item_t item)
+{
+    pool_worker_t *home = &pool_workers[item.home];
+    alarm_t *alarm = item.alarm;
+    int64_t now;
+    bool due;
+    bool unused;
+
+    metered_mutex_lock(&alarm_list_mutex);
+
+    pthread_mutex_lock(&home->mutex);
+    due = pool_work_is_due(item);
+    if (due)
+    {
+        // Retire the alarm, so that any other item for it is skipped.
+        alarm->retired = true;
+        alarm->heap_node.key = -1;
+    }
+    unused = drop_pool_work(item);
+    pthread_mutex_unlock(&home->mutex);
+
+    /*
+     * Any change to the expiry time of the alarm since the item was checked
+     * would have given it a new deadline, so an item that is still due is
+     * for an alarm that has expired.
+     */
+    if (due)
+    {
+        now = clock_now();
+        record_lateness(
+            alarm->owner,
+            LATENESS_EXPIRY,
+            now - alarm->expiration_time);
+        expire_alarm(alarm->owner, alarm);
+        release_display_thread(alarm);
+    }
+    if (unused)
+    {
+        free_alarm(alarm);
+    }
+
+    metered_mutex_unlock(&alarm_list_mutex);
+}
+
+/**
+ * Fires a due alarm taken from a pool worker's deque, if it is still due.
+ *
+ * Printing an alarm that has not expired only locks the mutex of the item's
+ * home worker, so workers print alarms of different homes at the same time,
+ * without the alarm list mutex. The fields printed are copied with
+ * alarm_read(), since the command thread may change them meanwhile; it
+ * cannot free the alarm while the item pins it, and it locks the home
+ * worker's mutex before it takes the alarm away from its display thread.
+ * Only an expired alarm goes on to expire_pool_work().
+ *
+ * No worker mutex may be locked by the caller.
+ */
+void fire_pool_work(work_item_t item)
+{
+    pool_worker_t *home = &pool_workers[item.home];
+    alarm_t *alarm = item.alarm;
+    alarm_print_t copy;
+    int64_t now;
+    int64_t deadline;
+    bool unused;
+
+    pthread_mutex_lock(&home->mutex);
+
+    if (!pool_work_is_due(item))
+    {
+        unused = drop_pool_work(item);
+        pthread_mutex_unlock(&home->mutex);
+        if (unused)
+        {
+            free_alarm(alarm);
+        }
+        return;
+    }
+
+    now = clock_now();
+    alarm_read(alarm, &copy);
+    if (copy.status == false)
+    {
+        // The command thread is suspending the alarm, and will take its
+        // deadline out of the heap.
+        drop_pool_work(item);
+        pthread_mutex_unlock(&home->mutex);
+        return;
+    }
+    if (copy.expiration_time <= now)
+    {
+        pthread_mutex_unlock(&home->mutex);
+        expire_pool_work(item);
+        return;
+    }
+
+    histogram_record(&home->lateness[LATENESS_PRINT], now - item.deadline);
+    print_alarm(alarm->owner, &copy);
+    alarm_printed(alarm, &copy);
+
+    alarm->next_print = now + DISPLAY_INTERVAL;
+    deadline = alarm->next_print;
+    if (copy.expiration_time < deadline)
+    {
+        deadline = copy.expiration_time;
+    }
+    min_heap_insert(&home->heap, &alarm->heap_node, deadline);
+    drop_pool_work(item);
+
+    pthread_mutex_unlock(&home->mutex);
+}
+
+/**
+ * POOL WORKER THREAD
+ * * * * * * * * * * *
+ *
+ * This is the function for a worker thread of the pool engine. The worker
+ * moves its due alarms from its heap to its due deque and fires them one at
+ * a time. When its deque is empty, it steals due alarms from the other
+ * workers, and if there are none, it sleeps until its next deadline or until
+ * a busy worker wakes it up to steal.
+ *
+ * Printing an alarm locks only the mutex of the worker that keeps the
+ * alarm's deadline, so the workers share the printing of many due alarms
+ * between the cores. Expiring an alarm locks the alarm list mutex, just like
+ * the timer thread of the other timer engines. The worker's own mutex is
+ * not held while it fires an alarm of another worker.
+ */
+void *pool_worker_thread(void *arg)
+{
+    pool_worker_t *worker = arg;
+    struct timespec t;     // Variable for setting timeout for timed condition
+                           // variable waits.
+
+    work_item_t item;      // The due alarm being fired.
+    heap_node_t *top;      // The next deadline of the worker.
+    size_t due;            // Number of due alarms the worker has queued.
+    unsigned long hints;   // Steal hints seen before looking for work.
+    bool found;            // Whether the worker has an alarm to fire.
+    int status;            // Status returned by the condition variable wait.
+    int64_t slept_until;   // Deadline the worker went to sleep with.
+
+    output_reserve();
+    while (1)
+    {
+        pthread_mutex_lock(&worker->mutex);
+        collect_due_pool_timers(worker, clock_now());
+        found = work_deque_pop_front(&worker->due, &item);
+        due = worker->due.count;
+        hints = worker->steal_hints;
+        pthread_mutex_unlock(&worker->mutex);
+
+        if (!found)
+        {
+            set_pool_worker_idle(worker, true);
+            found = steal_pool_work(worker, &item);
+        }
+
+        if (found)
+        {
+            set_pool_worker_idle(worker, false);
+
+            // Let an idle worker help with the rest of the due alarms.
+            if (due > 0)
+            {
+                wake_idle_pool_worker();
+            }
+
+            fire_pool_work(item);
+            output_throttle();
+            continue;
+        }
+
+        /*
+         * Nothing to fire or steal. Sleep until the next deadline, unless
+         * something happened while looking for work: an alarm became due,
+         * or a busy worker gave a steal hint.
+         */
+        pthread_mutex_lock(&worker->mutex);
+        top = min_heap_top(&worker->heap);
+        if (worker->due.count == 0
+            && worker->steal_hints == hints
+            && (top == NULL || top->key > clock_now()))
+        {
+            slept_until = top == NULL ? -1 : top->key;
+            if (top == NULL)
+            {
+                worker->deadline = -1;
+                status = pthread_cond_wait(&worker->cond, &worker->mutex);
+            }
+            else
+            {
+                worker->deadline = top->key;
+                clock_timespec(top->key, &t);
+                status = pthread_cond_timedwait(
+                    &worker->cond,
+                    &worker->mutex,
+                    &t);
+            }
+
+            // A worker is signalled for an earlier deadline or a steal hint.
+            if (status == ETIMEDOUT)
+            {
+                worker->wakeups.timeout++;
+            }
+            else if (worker->steal_hints != hints
+                     || worker->deadline != slept_until)
+            {
+                worker->wakeups.useful++;
+            }
+            else
+            {
+                worker->wakeups.spurious++;
+            }
+        }
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates the workers of the pool engine.
+ */
+void start_pool_workers()
+{
+    int status;
+
+    pool_workers = calloc(pool_size, sizeof(pool_worker_t));
+    pool_idle = calloc(pool_size, sizeof(int));
+    if (pool_workers == NULL || pool_idle == NULL)
+    {
+        errno_abort("Calloc failed");
+    }
+
+    // Every worker is set up before any starts, since they steal from each
+    // other.
+    for (int i = 0; i < pool_size; i++)
+    {
+        pool_workers[i].index = i;
+        pool_workers[i].deadline = -1;
+        pool_workers[i].idle_index = -1;
+
+        status = pthread_mutex_init(&pool_workers[i].mutex, NULL);
+        if (status != 0)
+        {
+            err_abort(status, "Init mutex");
+        }
+        clock_cond_init(&pool_workers[i].cond);
+    }
+
+    for (int i = 0; i < pool_size; i++)
+    {
+        status = pthread_create(
+            &pool_workers[i].thread,
+            NULL,
+            pool_worker_thread,
+            &pool_workers[i]);
+        if (status != 0)
+        {
+            err_abort(status, "Create worker thread");
+        }
+    }
+}
+
+/**
+ * Prints the alarms of every display thread for View_Alarms from a
+ * snapshot, grouped by display thread. The records are sorted here, without
+ * the alarm list mutex.
+ */
+void print_view_snapshot(view_snapshot_t *snapshot)
+{
+    view_record_t **records = snapshot_sorted(snapshot);
+
+    for (size_t i = 0; i < snapshot->count; i++)
+    {
+        if (i == 0 || records[i - 1]->thread_id != records[i]->thread_id)
+        {
+            output_printf(
+                "Display Thread %d Assigned:\n",
+                records[i]->thread_id);
+        }
+        print_assigned_alarm(records[i]);
+        output_throttle();
+    }
+    free(records);
+}
+
+/**
+ * Appends a record of a change to an alarm to the journal (if one is kept).
+ * `type` is the command that changed the alarm; the record holds the state
+ * of the alarm after it.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void journal_alarm(command_type type, alarm_t *alarm)
+{
+    journal_record_t record;
+
+    if (!journaling)
+    {
+        return;
+    }
+
+    record.type = type;
+    record.unit = alarm->unit;
+    record.status = (alarm->status ? JOURNAL_ACTIVE : 0)
+        | (alarm_changed(alarm) ? JOURNAL_CHANGED : 0);
+    record.length = strlen(alarm->message);
+    record.alarm_id = alarm->alarm_id;
+    record.time = alarm->time;
+    record.creation_time = alarm->creation_time;
+    record.deadline = alarm->status
+        ? clock_wall_now() + (alarm->expiration_time - clock_now())
+        : alarm->time_left;
+    journal_append(&journal, &record, alarm->message);
+}
+
+/**
+ * Recreates an alarm from its last record in the journal (or its entry in
+ * the checkpoint), like Start_Alarm but without printing it, and with the
+ * time it had left. An alarm whose deadline passed while the program was not
+ * running is not restored, since it may have expired before the program
+ * stopped.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void restore_alarm(journal_entry_t *entry)
+{
+    journal_record_t *record = &entry->record;
+    bool active = record->status & JOURNAL_ACTIVE;
+    alarm_t *alarm;
+    int64_t left;
+
+    left = active
+        ? record->deadline - clock_wall_now()
+        : record->deadline;
+    if (left <= 0)
+    {
+        alarms_expired_while_stopped++;
+        return;
+    }
+
+    alarm = alloc_alarm();
+    alarm->alarm_id = record->alarm_id;
+    alarm->time = record->time;
+    alarm->unit = record->unit;
+    strcpy(alarm->message, entry->message);
+    alarm->status = active;
+    alarm->creation_time = record->creation_time;
+    alarm->expiration_time = clock_now() + left;
+    alarm->time_left = active ? 0 : left;
+    alarm->changes = (record->status & JOURNAL_CHANGED) != 0;
+
+    if (insert_alarm_into_list(alarm) == NULL)
+    {
+        free_alarm(alarm);
+        return;
+    }
+
+    heap_node_init(&alarm->heap_node, alarm);
+    alarm->timer.pending = false;
+    assign_display_thread(alarm);
+    if (engine != ENGINE_THREADS && alarm->status == true)
+    {
+        start_alarm_timer(alarm);
+    }
+    alarms_restored++;
+}
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+double monotonic_seconds()
+{
+    return (double)clock_monotonic() / NSEC_PER_SEC;
+}
+
+/**
+ * Restores the alarms of the checkpoint and of the journal. The journal
+ * holds the changes made after the checkpoint, so the last record of an
+ * alarm in the journal replaces its entry in the checkpoint (and a
+ * Cancel_Alarm record removes it).
+ *
+ * Both are in order of alarm ID, so they are merged in one pass, and every
+ * alarm is added at the tail of the alarm list. The alarm list mutex is
+ * locked for BATCH_MAX_COMMANDS alarms at a time, so the display threads of
+ * the alarms restored so far are not held up.
+ */
+void restore_alarms()
+{
+    journal_replay_t replay;   // Last record of each alarm in the journal.
+    journal_entry_t entry;     // Entry of the checkpoint being restored.
+    uint64_t count = 0;        // Number of alarms in the checkpoint.
+    uint64_t i = 0;            // Next alarm of the checkpoint.
+    size_t j = 0;              // Next entry of the journal.
+    long restored = 0;         // Number of entries looked at.
+    double start;              // Time when restoring started.
+    double elapsed;            // Time spent restoring.
+
+    start = monotonic_seconds();
+
+    memset(&replay, 0, sizeof(replay));
+    if (journaling)
+    {
+        journal_load(&journal, &replay);
+        journal_sort(&replay);
+    }
+    if (restoring_checkpoint)
+    {
+        count = restore_checkpoint.header->count;
+    }
+
+    metered_mutex_lock(&alarm_list_mutex);
+    while (i < count || j < replay.count)
+    {
+        if (j < replay.count
+            && (i == count
+                || replay.entries[j].record.alarm_id
+                   <= restore_checkpoint.alarm_id[i]))
+        {
+            if (i < count
+                && replay.entries[j].record.alarm_id
+                   == restore_checkpoint.alarm_id[i])
+            {
+                i++;
+            }
+            if (replay.entries[j].record.type != Cancel_Alarm)
+            {
+                restore_alarm(&replay.entries[j]);
+            }
+            j++;
+        }
+        else
+        {
+            checkpoint_entry(&restore_checkpoint, i, &entry);
+            restore_alarm(&entry);
+            i++;
+        }
+
+        if (++restored % BATCH_MAX_COMMANDS == 0)
+        {
+            metered_mutex_unlock(&alarm_list_mutex);
+            metered_mutex_lock(&alarm_list_mutex);
+        }
+    }
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    elapsed = monotonic_seconds() - start;
+    if (count > 0 || replay.records > 0)
+    {
+        fprintf(
+            stderr,
+            "Restore: %llu checkpoint alarms and %ld journal records in "
+            "%.3f seconds; %ld alarms restored, %ld expired while stopped\n",
+            (unsigned long long)count,
+            replay.records,
+            elapsed,
+            alarms_restored,
+            alarms_expired_while_stopped);
+    }
+
+    if (restoring_checkpoint)
+    {
+        checkpoint_free(&restore_checkpoint);
+        restoring_checkpoint = false;
+    }
+    journal_replay_free(&replay);
+}
+
+/**
+ * Writes a checkpoint of every alarm to the checkpoint file, and returns the
+ * number of alarms in it.
+ *
+ * The alarms are copied into the checkpoint with the alarm list mutex
+ * locked, and the journal is switched to a new file at the same moment, so
+ * that the checkpoint and the new journal hold every change between them.
+ * The mutex is released while the old journal and the checkpoint are
+ * written and synced; the old journal is dropped once the checkpoint is on
+ * disk.
+ *
+ * The alarm list mutex must be locked by the caller, and it is locked again
+ * when this returns.
+ */
+size_t write_checkpoint()
+{
+    checkpoint_t checkpoint;
+    alarm_t *alarm;
+    uint64_t strings_size = 0;
+    uint64_t count = 0;
+    uint64_t i = 0;
+    int64_t now;
+    int64_t wall_now;
+    size_t length;
+
+    while (checkpoint_running)
+    {
+        metered_cond_wait(&checkpoint_done, &alarm_list_mutex);
+    }
+    checkpoint_running = true;
+
+    for (alarm = alarm_header.next; alarm != NULL; alarm = alarm->next)
+    {
+        strings_size += strlen(alarm->message);
+        count++;
+    }
+    checkpoint_create(&checkpoint, count, strings_size);
+
+    now = clock_now();
+    wall_now = clock_wall_now();
+    strings_size = 0;
+    for (alarm = alarm_header.next; alarm != NULL; alarm = alarm->next, i++)
+    {
+        checkpoint.alarm_id[i] = alarm->alarm_id;
+        checkpoint.status[i] = alarm->status;
+        checkpoint.change_status[i] = alarm_changed(alarm);
+        checkpoint.expiration[i] =
+            wall_now + (alarm->expiration_time - now);
+        checkpoint.time_left[i] = alarm->time_left;
+        checkpoint.time[i] = alarm->time;
+        checkpoint.unit[i] = alarm->unit;
+        checkpoint.creation_time[i] = alarm->creation_time;
+        checkpoint.message[i] = strings_size;
+        length = strlen(alarm->message);
+        memcpy(checkpoint.strings + strings_size, alarm->message, length);
+        strings_size += length;
+    }
+    checkpoint.message[count] = strings_size;
+
+    if (journaling)
+    {
+        journal_rotate(&journal);
+    }
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    /*
+     * The records before the checkpoint are synced to the old journal
+     * before the checkpoint replaces the old one, without holding up the
+     * display threads and commands.
+     */
+    if (journaling)
+    {
+        journal_flush(&journal);
+    }
+    checkpoint_write(&checkpoint, checkpoint_path);
+    if (journaling)
+    {
+        journal_finish_rotation(&journal);
+    }
+    checkpoint_free(&checkpoint);
+
+    metered_mutex_lock(&alarm_list_mutex);
+    checkpoint_running = false;
+    pthread_cond_broadcast(&checkpoint_done);
+
+    return count;
+}
+
+/**
+ * CHECKPOINT THREAD
+ * * * * * * * * * *
+ *
+ * Writes a checkpoint every `checkpoint_interval` seconds. The command
+ * thread starts it once the alarms of the last checkpoint and journal have
+ * been restored.
+ */
+void *checkpoint_thread(void *arg)
+{
+    struct timespec t;
+
+    (void)arg;
+    while (1)
+    {
+        t.tv_sec = checkpoint_interval;
+        t.tv_nsec = 0;
+        while (nanosleep(&t, &t) != 0 && errno == EINTR)
+        {
+        }
+
+        metered_mutex_lock(&alarm_list_mutex);
+        write_checkpoint();
+        metered_mutex_unlock(&alarm_list_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * METRICS THREAD
+ * * * * * * * * *
+ *
+ * Writes the metrics file every `metrics_interval` seconds. The metrics are
+ * collected with the alarm list mutex locked, and written without it.
+ */
+void *metrics_thread(void *arg)
+{
+    metrics_t metrics;
+    metrics_t previous;
+    struct timespec t;
+
+    (void)arg;
+    metered_mutex_lock(&alarm_list_mutex);
+    collect_metrics(&previous);
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    while (1)
+    {
+        t.tv_sec = metrics_interval;
+        t.tv_nsec = 0;
+        while (nanosleep(&t, &t) != 0 && errno == EINTR)
+        {
+        }
+
+        metered_mutex_lock(&alarm_list_mutex);
+        collect_metrics(&metrics);
+        metered_mutex_unlock(&alarm_list_mutex);
+
+        metrics_rate(&metrics, &previous);
+        metrics_write(&metrics, metrics_path);
+        previous = metrics;
+    }
+
+    return NULL;
+}
+
+/**
+ * Prints how to start the program and exits.
+ */
+void usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [-e threads|wheel|heap|pool] [-s alarms_per_thread] "
+        "[-w workers]\n"
+        "       [-o block|drop|count] [-j journal_file] [-g milliseconds]\n"
+        "       [-c checkpoint_file] [-i seconds] [-m metrics_file] "
+        "[-r seconds]\n"
+        "       [-v] [-t trace_file] [-p trace_file] [-x speed] "
+        "[command_file ...]\n",
+        program);
+    fprintf(stderr, "  -e  engine that drives alarm expiry and printing:\n");
+    fprintf(stderr, "      threads  one display thread per two alarms "
+                    "(default)\n");
+    fprintf(stderr, "      wheel    one timer thread with a timing wheel\n");
+    fprintf(stderr, "      heap     one timer thread with a min-heap\n");
+    fprintf(stderr, "      pool     a fixed pool of workers that steal due "
+                    "alarms from each other\n");
+    fprintf(stderr, "  -s  number of alarms each display thread holds "
+                    "(%d to %d, default %d)\n",
+                    DEFAULT_ALARMS_PER_THREAD,
+                    MAX_ALARMS_PER_THREAD,
+                    DEFAULT_ALARMS_PER_THREAD);
+    fprintf(stderr, "  -w  number of pool workers (1 to %d, default the "
+                    "number of online CPUs)\n",
+                    MAX_POOL_WORKERS);
+    fprintf(stderr, "  -o  what to do with output when the writer thread "
+                    "falls behind:\n");
+    fprintf(stderr, "      block    wait for it (default)\n");
+    fprintf(stderr, "      drop     drop lines\n");
+    fprintf(stderr, "      count    drop lines and report how many\n");
+    fprintf(stderr, "  -j  keep a journal of alarm changes in journal_file, "
+                    "and restore the\n      alarms in it when starting\n");
+    fprintf(stderr, "  -g  milliseconds between two syncs of the journal to "
+                    "disk (default %d)\n",
+                    DEFAULT_JOURNAL_INTERVAL);
+    fprintf(stderr, "  -c  write checkpoints of the alarms to "
+                    "checkpoint_file, and restore the\n      alarms in it "
+                    "when starting\n");
+    fprintf(stderr, "  -i  seconds between two checkpoints (default 0: only "
+                    "on the Checkpoint\n      command)\n");
+    fprintf(stderr, "  -m  write metrics in the Prometheus text format to "
+                    "metrics_file\n");
+    fprintf(stderr, "  -r  seconds between two writes of the metrics file "
+                    "(default %d)\n",
+                    DEFAULT_METRICS_INTERVAL);
+    fprintf(stderr, "  -v  run on a virtual clock that starts at 0 and only "
+                    "moves with the Wait\n      command (wheel or heap "
+                    "engine; threads means heap)\n");
+    fprintf(stderr, "  -t  record the commands applied, and when, in "
+                    "trace_file\n");
+    fprintf(stderr, "  -p  replay the commands of trace_file at the times "
+                    "they were recorded at\n");
+    fprintf(stderr, "  -x  speed of the replay (default 1; 0 is as fast as "
+                    "possible)\n");
+    fprintf(stderr, "Commands are read in batches from each command_file at "
+                    "once, or from\nstandard input when it is not a "
+                    "terminal.\n");
+    exit(1);
+}
+
+/**
+ * Lets `duration` nanoseconds pass, for the Wait command. On a virtual
+ * clock, the clock is moved forward at once and the alarms that are due
+ * meanwhile are fired; otherwise the alarm list mutex is released while the
+ * command thread sleeps, so the alarms go on expiring.
+ *
+ * The alarm list mutex must be locked by the caller.
+ */
+void wait_for(int64_t duration)
+{
+    struct timespec t;
+
+    if (clock_virtual)
+    {
+        advance_virtual_clock(clock_now() + duration);
+        return;
+    }
+
+    t.tv_sec = duration / NSEC_PER_SEC;
+    t.tv_nsec = duration % NSEC_PER_SEC;
+    metered_mutex_unlock(&alarm_list_mutex);
+    while (nanosleep(&t, &t) != 0 && errno == EINTR)
+    {
+    }
+    metered_mutex_lock(&alarm_list_mutex);
+}
+
+/**
+ * Applies a parsed command to the alarm list: adds, changes or removes the
+ * alarm, and sends events about it to the display thread that owns it (or
+ * updates the timer engine directly).
+ *
+ * The alarm list mutex must be locked by the caller. It may be released and
+ * locked again while waiting for space in a display thread's mailbox, while
+ * View_Alarms prints its snapshot, while a checkpoint is written, and while
+ * Wait sleeps.
+ */
+void apply_command(command_t *command)
+{
+    alarm_t *alarm;            // Pointer for newly created alarms.
+
+    view_snapshot_t *snapshot; // Snapshot printed by View_Alarms.
+
+    size_t count;              // Number of alarms in a checkpoint.
+
+    char lateness[LATENESS_KINDS][160]; // Lines printed by Lateness.
+
+    char stats[STATS_LINES][256];       // Lines printed by Stats.
+
+    metrics_t metrics;                  // Metrics printed by Stats.
+
+    bool unused;               // Whether a cancelled alarm can be freed.
+
+    DEBUG_PRINT_COMMAND(command);
+
+    if (command->type == Start_Alarm)
+    {
+        /*
+         * Allocate space for alarm.
+         */
+        alarm = alloc_alarm();
+
+        /*
+         * Fill in data for alarm.
+         */
+        alarm->alarm_id = command->alarm_id;
+        alarm->time = command->time;
+        alarm->unit = command->unit;
+        strcpy(alarm->message, command->message);
+        alarm->status = true;
+        alarm->creation_time = clock_time();
+        alarm->expiration_time =
+            clock_now() + duration_nsec(alarm->time, alarm->unit);
+        alarm->time_left = 0;
+
+        /*
+         * Insert alarm into the list.
+         */
+        if (insert_alarm_into_list(alarm) == NULL)
+        {
+            /*
+             * If inserting into alarm returns NULL, then the
+             * alarm was not inserted into this list. In this
+             * case, free the alarm's memory.
+             */
+            free_alarm(alarm);
+            return;
+        }
+        journal_alarm(Start_Alarm, alarm);
+
+        output_printf(
+            "Alarm %d Inserted Into Alarm List at %ld: %d%s %s\n",
+            alarm->alarm_id,
+            clock_time(),
+            alarm->time,
+            time_unit_suffixes[alarm->unit],
+            alarm->message
+        );
+
+        DEBUG_PRINTF("threads: ");
+        DEBUG_PRINT_THREAD_LIST(thread_header);
+        DEBUG_PRINTF("alarms: ");
+        DEBUG_PRINT_ALARM_LIST(alarm_header.next);
+
+        /*
+         * Give the alarm to a display thread, creating a new thread
+         * if all the threads are full.
+         */
+        heap_node_init(&alarm->heap_node, alarm);
+        alarm->timer.pending = false;
+        assign_display_thread(alarm);
+
+        /*
+         * The timer engines schedule the first deadline of the alarm
+         * themselves.
+         */
+        if (engine != ENGINE_THREADS)
+        {
+            start_alarm_timer(alarm);
+        }
+    }
+    else if (command->type == Change_Alarm)
+    {
+        // Check if the alarm exists, if not return error
+        // message.
+        if (!doesAlarmExist(command->alarm_id))
+        {
+            output_printf(
+                "Alarm of ID %d does not exist.\n",
+                command->alarm_id
+            );
+            return;
+        }
+
+        // Go through list and find the existing alarm using the ID
+        alarm_t *existing_alarm = find_alarm_by_id(command->alarm_id);
+        
+        // Update the existing alarm time and message. Its display thread
+        // may be reading them without the mutex, so it is told with the
+        // alarm's sequence counter.
+        seqlock_write_begin(&existing_alarm->seq);
+        existing_alarm -> time = command->time;
+        existing_alarm->unit = command->unit;
+        existing_alarm->expiration_time =
+            clock_now() + duration_nsec(command->time, command->unit);
+        strcpy(existing_alarm -> message, command->message);
+
+        // A suspended alarm runs for its new time once it is reactivated.
+        if (existing_alarm->status == false)
+        {
+            existing_alarm->time_left =
+                duration_nsec(command->time, command->unit);
+        }
+
+        // Tell the alarm that its message has been recently changed
+        existing_alarm->changes++;
+        seqlock_write_end(&existing_alarm->seq);
+        view_alarm(existing_alarm);
+        journal_alarm(Change_Alarm, existing_alarm);
+
+        // The expiry time has changed, so move the alarm's deadline (or
+        // wake up its display thread to wait for the new one).
+        if (engine != ENGINE_THREADS && existing_alarm->status == true)
+        {
+            schedule_alarm_timer(existing_alarm);
+        }
+        else if (engine == ENGINE_THREADS && existing_alarm->status == true)
+        {
+            notify_owner(existing_alarm, Change_Alarm);
+        }
+
+        // Return display message showing alarm has changed.
+        output_printf(
+            "Alarm (%d) Changed at %ld: %s\n",
+            command->alarm_id,
+            clock_time(),
+            command->message
+        );
+    }
+    else if (command->type == Cancel_Alarm)
+    {
+        // Get the ID that will be cancellled
+        int cancelId = command->alarm_id;
+        int AlarmExists = doesAlarmExist(cancelId);
+
+        if (AlarmExists == 0)
+        {
+            output_printf("Not a valid ID.\n");
+        }
+        else if (engine != ENGINE_THREADS)
+        {
+            /*
+             * Remove alarm from the list and the timer engine, and
+             * take it away from its display thread.
+             */
+            alarm = remove_alarm_from_list(cancelId);
+            journal_alarm(Cancel_Alarm, alarm);
+            cancel_alarm_timer(alarm);
+            print_cancelled_alarm(alarm->owner, alarm);
+            unused = engine != ENGINE_POOL || retire_pool_alarm(alarm);
+            release_display_thread(alarm);
+            if (unused)
+            {
+                free_alarm(alarm);
+            }
+        }
+        else
+        {
+            /*
+             * Remove alarm from list
+             */
+            alarm = remove_alarm_from_list(cancelId);
+            journal_alarm(Cancel_Alarm, alarm);
+
+            /*
+             * Send cancel alarm event to the thread that owns the
+             * alarm. Posting may unlock the alarm list mutex while the
+             * mailbox is full, so the alarm is retired first, and the
+             * owner leaves it alone until it takes the event.
+             */
+            __atomic_store_n(&alarm->retired, true, __ATOMIC_RELAXED);
+            notify_owner(alarm, Cancel_Alarm);
+        }
+    }
+    else if (command->type == Reactivate_Alarm)
+    {
+        int AlarmExists = doesAlarmExist(command->alarm_id);
+        if (AlarmExists == 0)
+        {
+            output_printf("Not a valid ID.\n");
+        }
+        else
+        {
+            /*
+             * Reactivate the alarm in the list. The thread owning this
+             * alarm shares the reference to it, so it only has to be
+             * woken up to wait for the alarm's new expiry (or the timer
+             * engine has to be given the new deadline).
+             */
+            alarm = find_alarm_by_id(command->alarm_id);
+            if (reactivate_alarm_in_list(alarm))
+            {
+                journal_alarm(Reactivate_Alarm, alarm);
+
+                if (engine != ENGINE_THREADS)
+                {
+                    start_alarm_timer(alarm);
+                }
+                else
+                {
+                    notify_owner(alarm, Reactivate_Alarm);
+                }
+            }
+        }
+    }
+    else if (command->type == Suspend_Alarm)
+    {
+        // Gets the ID that will be suspended
+        int suspendId = command->alarm_id;
+
+        int AlarmExists = doesAlarmExist(suspendId);
+        if (AlarmExists == 0)
+        {
+            output_printf("Not a valid ID.\n");
+        }
+        else
+        {
+            /*
+             * Suspend the alarm directly, so that a View_Alarms that
+             * follows sees it suspended, and take its deadline out of
+             * the timer engine (or tell the display thread that owns
+             * it to stop waiting for it).
+             */
+            alarm = find_alarm_by_id(suspendId);
+            if (suspend_alarm(alarm))
+            {
+                journal_alarm(Suspend_Alarm, alarm);
+                if (engine != ENGINE_THREADS)
+                {
+                    cancel_alarm_timer(alarm);
+                }
+                else
+                {
+                    notify_owner(alarm, Suspend_Alarm);
+                }
+            }
+        }
+    }
+    else if (command->type == View_Alarms) {
+        output_printf("View Alarms at %ld: \n", clock_time());
+
+        /*
+         * The alarms are printed from a snapshot, with the alarm list
+         * mutex unlocked, so the display threads (or the timer engine)
+         * go on expiring alarms while a long list is written. No
+         * display thread is woken up.
+         */
+        snapshot = view_table_snapshot(&view_table);
+        metered_mutex_unlock(&alarm_list_mutex);
+        print_view_snapshot(snapshot);
+        snapshot_release(snapshot);
+        metered_mutex_lock(&alarm_list_mutex);
+    }
+    else if (command->type == Checkpoint) {
+        if (checkpoint_path == NULL)
+        {
+            output_printf("No checkpoint file\n");
+            return;
+        }
+
+        count = write_checkpoint();
+        output_printf(
+            "Checkpoint of %zu Alarms Written at %ld\n",
+            count,
+            clock_time());
+    }
+    else if (command->type == Stats) {
+        collect_metrics(&metrics);
+        metrics_rate(&metrics, &last_stats);
+        last_stats = metrics;
+        format_stats(&metrics, stats);
+        output_printf("Stats at %ld:\n", clock_time());
+        for (int i = 0; i < STATS_LINES; i++)
+        {
+            output_printf("%s\n", stats[i]);
+        }
+    }
+    else if (command->type == Wait) {
+        wait_for(duration_nsec(command->time, command->unit));
+    }
+    else if (command->type == Lateness) {
+        report_lateness(lateness);
+        output_printf(
+            "Lateness at %ld:\n%s\n%s\n",
+            clock_time(),
+            lateness[LATENESS_EXPIRY],
+            lateness[LATENESS_PRINT]);
+    }
+
+    DEBUG_PRINT_ALARM_LIST(alarm_header.next);
+}
+
+/**
+ * Prints the lateness of every alarm expired and printed so far, and the
+ * lock and wakeup counters, on standard error when the program exits.
+ */
+void print_exit_report()
+{
+    char lateness[LATENESS_KINDS][160];
+    char stats[STATS_LINES][256];
+    metrics_t metrics;
+
+    metered_mutex_lock(&alarm_list_mutex);
+    report_lateness(lateness);
+    collect_metrics(&metrics);
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    metrics_rate(&metrics, &last_stats);
+    format_stats(&metrics, stats);
+
+    fprintf(
+        stderr,
+        "Lateness: %s\nLateness: %s\n",
+        lateness[LATENESS_EXPIRY],
+        lateness[LATENESS_PRINT]);
+    for (int i = 0; i < STATS_LINES; i++)
+    {
+        fprintf(stderr, "Stats: %s\n", stats[i]);
+    }
+}
+
+/**
+ * Applies a batch of parsed commands with a single lock of the alarm list
+ * mutex. `parsed[i]` is false if line `i` was not a valid command.
+ */
+void apply_batch(command_t commands[], bool parsed[], int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    metered_mutex_lock(&alarm_list_mutex);
+    for (int i = 0; i < count; i++)
+    {
+        if (parsed[i])
+        {
+            commands_by_type[commands[i].type]++;
+            apply_command(&commands[i]);
+        }
+        else
+        {
+            bad_commands++;
+            output_printf("Bad command\n");
+        }
+    }
+    commands_applied += count;
+    pthread_cond_broadcast(&commands_applied_cond);
+    metered_mutex_unlock(&alarm_list_mutex);
+}
+
+/**
+ * COMMAND THREAD
+ * * * * * * * * *
+ *
+ * Takes the commands that have been read out of the command queue and
+ * applies them to the alarm list, as many at a time as are waiting (up to
+ * BATCH_MAX_COMMANDS) with a single lock of the alarm list mutex.
+ *
+ * Before the first command, it restores the alarms of the checkpoint and
+ * the journal, so the prompt does not wait for them.
+ *
+ * When a trace is recorded, each command is added to it as it is taken
+ * from the queue, with the time it was taken.
+ *
+ * This is the only thread that applies commands. The threads that read
+ * commands only parse them and add them to the queue, which takes no lock,
+ * so the prompt never waits for a display thread (or a timer engine) that
+ * holds the alarm list mutex.
+ */
+void *command_thread(void *arg)
+{
+    command_t *commands;       // Commands taken from the queue.
+    bool *parsed;              // Whether each line taken was valid.
+    int count;                 // Number of commands taken.
+    pthread_t checkpointer;    // Handle of the checkpoint thread.
+
+    (void)arg;
+    output_reserve();
+    commands = malloc(BATCH_MAX_COMMANDS * sizeof(command_t));
+    parsed = malloc(BATCH_MAX_COMMANDS * sizeof(bool));
+    if (commands == NULL || parsed == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+
+    // Commands that are read meanwhile wait in the queue.
+    restore_alarms();
+
+    /*
+     * Periodic checkpoints only start once every alarm has been restored.
+     * Restore unlocks the alarm list mutex as it goes, and a checkpoint
+     * taken meanwhile would leave out the alarms not restored yet, and
+     * rotate away the journal records not replayed yet.
+     */
+    if (checkpoint_path != NULL && checkpoint_interval > 0)
+    {
+        pthread_create(&checkpointer, NULL, checkpoint_thread, NULL);
+    }
+
+    while (1)
+    {
+        count = command_queue_wait(
+            &command_queue,
+            commands,
+            parsed,
+            BATCH_MAX_COMMANDS);
+        if (tracing)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (parsed[i])
+                {
+                    trace_append(&trace, &commands[i]);
+                }
+            }
+        }
+        apply_batch(commands, parsed, count);
+
+        // Lines printed with the alarm list mutex locked may have spilled.
+        output_throttle();
+    }
+
+    return NULL;
+}
+
+/**
+ * READER THREAD
+ * * * * * * * *
+ *
+ * Reads commands from a file descriptor (a command file, or standard input
+ * when it is not a terminal) until the end of the input, and adds them to
+ * the command queue for the command thread to apply.
+ *
+ * Input is read in large blocks, and every complete line in a block is
+ * parsed by the reader, so that the command thread only has to apply them.
+ * A pipe delivers whatever has been written so far, so commands that are
+ * written slowly are still applied as they come.
+ */
+void *reader_thread(void *arg)
+{
+    reader_t *reader = arg;
+    char *buffer;              // Input that has been read and not parsed.
+    size_t length = 0;         // Number of bytes in the buffer.
+    command_t command;         // The command being parsed.
+    bool parsed;               // Whether the line was a valid command.
+    char *line;                // Start of the line being parsed.
+    char *end;                 // End of the line being parsed.
+    ssize_t bytes;             // Number of bytes read.
+    bool eof = false;          // Whether the end of the input was reached.
+
+    buffer = malloc(BATCH_BUFFER_SIZE + 1);
+    if (buffer == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+
+    while (!eof)
+    {
+        bytes = read(reader->fd, buffer + length, BATCH_BUFFER_SIZE - length);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            errno_abort("Read commands");
+        }
+        eof = bytes == 0;
+        length += bytes;
+
+        /*
+         * Parse every complete line. The last line of the input does not
+         * need a newline, and a line that fills the whole buffer is cut.
+         */
+        line = buffer;
+        while (line < buffer + length)
+        {
+            end = memchr(line, '\n', buffer + length - line);
+            if (end == NULL)
+            {
+                if (!eof && !(line == buffer && length == BATCH_BUFFER_SIZE))
+                {
+                    break;
+                }
+                end = buffer + length;
+            }
+            *end = 0;
+
+            parsed = parse_command(line, &command);
+            command_queue_push(&command_queue, &command, parsed);
+            reader->bad += !parsed;
+            reader->total++;
+            line = end + 1;
+        }
 
-            /*
-             * Unlock event mutex so that the main thread can send
-             * another event.
-             */
-            pthread_mutex_unlock(&event_mutex);
+        // Keep the incomplete last line for the next read.
+        if (line < buffer + length)
+        {
+            length = buffer + length - line;
+            memmove(buffer, line, length);
         }
-        else if (event->type == Suspend_Alarm)
+        else
         {
-            if (alarm1 != NULL
-                && alarm1->alarm_id == event->alarmId
-                && alarm1->status == true)
-            {
-                printf(
-                    "Alarm (%d) Suspended at %ld: %s\n",
-                    alarm1->alarm_id,
-                    time(NULL),
-                    alarm1->message);
+            length = 0;
+        }
+    }
 
-                alarm1->status = false;
-                alarm1->time_left = alarm1->expiration_time - time(NULL);
+    free(buffer);
+    output_release();
+    return NULL;
+}
 
-                /*
-                 * Free the event structure because it has been handled.
-                 */
-                free(event);
-                event = NULL;
-            }
-            else if (alarm2 != NULL
-                     && alarm2->alarm_id == event->alarmId
-                     && alarm2->status == true)
-            {
-                printf(
-                    "Alarm (%d) Suspended at %ld: %s\n",
-                    alarm2->alarm_id,
-                    time(NULL),
-                    alarm2->message);
+/**
+ * Prints on standard error how long the replayed trace took to record and
+ * to replay, and how late its commands were added to the command queue.
+ */
+void report_replay(double elapsed)
+{
+    char lag[160];
+
+    fprintf(
+        stderr,
+        "Replay: %.3f seconds of trace replayed in %.3f seconds",
+        replay_span / 1e9,
+        elapsed);
+    if (clock_virtual || replay_speed == 0)
+    {
+        fprintf(
+            stderr,
+            " (%s)\n",
+            clock_virtual ? "virtual clock" : "as fast as possible");
+        return;
+    }
+    histogram_format(&replay_lag, "lag", lag, sizeof(lag));
+    fprintf(stderr, " at %gx speed, %s\n", replay_speed, lag);
+}
 
-                alarm2->status = false;
-                alarm2->time_left = alarm2->expiration_time - time(NULL);
+/**
+ * REPLAY THREAD
+ * * * * * * * *
+ *
+ * Reads the commands of a trace and adds them to the command queue at the
+ * times they were recorded at, divided by the replay speed (or as fast as
+ * the queue takes them, at speed 0). How late each command was added is
+ * recorded in `replay_lag`.
+ *
+ * On a virtual clock, the time between two commands is replayed as a Wait
+ * command instead, so a trace is replayed exactly as it was recorded, at
+ * once.
+ */
+void *replay_thread(void *arg)
+{
+    reader_t *reader = arg;
+    trace_t replay;            // The trace being replayed.
+    command_t command;         // The command being replayed.
+    command_t wait;            // Wait added between two commands on a
+                               // virtual clock.
+    int64_t offset;            // Recorded time of the command.
+    int64_t previous = 0;      // Recorded time of the previous command.
+    int64_t start;             // Time when replaying started.
+    int64_t due;               // Time the command is due to be added.
+    struct timespec t;
+
+    if (!trace_open(&replay, reader->fd))
+    {
+        fprintf(stderr, "Not a trace file: %s\n", replay_path);
+        exit(1);
+    }
 
-                /*
-                 * Free the event structure because it has been handled.
-                 */
-                free(event);
-                event = NULL;
-            } else {
-                DEBUG_PRINTF(
-                    "Suspend_Alarm command for alarm %d was not handled by"
-                    "thread &d\n",
-                    event->alarmId,
-                    thread->thread_id
-                );
-            }
+    wait.type = Wait;
+    wait.alarm_id = 0;
+    wait.message[0] = 0;
+    start = clock_monotonic();
 
-            /*
-             * Unlock event mutex
-             */
-            pthread_mutex_unlock(&event_mutex);
-        }
-        else if (event->type == Cancel_Alarm)
+    while (trace_next(&replay, &command, &offset))
+    {
+        if (clock_virtual && offset > previous)
         {
-            if (alarm1 != NULL && alarm1->alarm_id == event->alarmId)
+            // Wait takes an int, so long gaps are given in milliseconds.
+            if (offset - previous <= INT_MAX)
             {
-                printf(
-                    "Display Alarm Thread (%d) Removed Canceled Alarm(%d) at %ld: %s\n",
-                    thread->thread_id,
-                    alarm1->alarm_id,
-                    time(NULL),
-                    alarm1->message);
-
-                // Free alarm
-                free(alarm1);
-                alarm1 = NULL;
-
-                // Update thread list to show that this thread has one less
-                // alarm.
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms--;
-                pthread_mutex_unlock(&thread_list_mutex);
-
-                // Free event since it is now handled.
-                free(event);
-                event = NULL;
-                pthread_mutex_unlock(&event_mutex);
+                wait.time = offset - previous;
+                wait.unit = UNIT_NANOSECONDS;
             }
-            else if (alarm2 != NULL && alarm2->alarm_id == event->alarmId)
+            else
             {
-                printf(
-                    "Display Alarm Thread (%d) Removed Canceled Alarm(%d) at %ld: %s\n",
-                    thread->thread_id,
-                    alarm2->alarm_id,
-                    time(NULL),
-                    alarm2->message);
-
-                // Free alarm.
-                free(alarm2);
-                alarm2 = NULL;
-
-                // Update thread list to show that this thread has one less
-                // alarm.
-                pthread_mutex_lock(&thread_list_mutex);
-                thread->alarms--;
-                pthread_mutex_unlock(&thread_list_mutex);
-
-                // Free event since it is now handled.
-                free(event);
-                event = NULL;
-                pthread_mutex_unlock(&event_mutex);
-            } else {
-                DEBUG_PRINTF(
-                    "Cancel_Alarm event for alarm %d not handled by "
-                    "thread %d\n",
-                    event->alarmId,
-                    thread->thread_id
-                );
-                pthread_mutex_unlock(&event_mutex);
+                wait.time = (offset - previous) / NSEC_PER_MSEC;
+                wait.unit = UNIT_MILLISECONDS;
             }
+            command_queue_push(&command_queue, &wait, true);
+            reader->total++;
         }
-        else if (event->type == View_Alarms) {
-            printf("Display Thread %d Assigned:\n", thread->thread_id);
-
-            if(alarm1 != NULL) {
-                if (alarm1->status == true) {
-                    printf(
-                        "Alarm(%d): Created at %ld: Assigned at %d %s "
-                        "Status active\n",
-                        alarm1->alarm_id,
-                        alarm1->creation_time,
-                        alarm1->time,
-                        alarm1->message);
-                }
-                else {
-                    printf(
-                        "Alarm(%d): Created at %ld: Assigned at %d %s "
-                        "Status suspended\n",
-                        alarm1->alarm_id,
-                        alarm1->creation_time,
-                        alarm1->time,
-                        alarm1->message);
-                }
-            }
-            if(alarm2 != NULL) {
-                if (alarm2->status == true) {
-                    printf(
-                        "Alarm(%d): Created at %ld: Assigned at %d %s "
-                        "Status active\n",
-                        alarm2->alarm_id,
-                        alarm2->creation_time,
-                        alarm2->time,
-                        alarm2->message);
-                }
-                else {
-                    printf(
-                        "Alarm(%d): Created at %ld: Assigned at %d %s "
-                        "Status suspended\n",
-                        alarm2->alarm_id,
-                        alarm2->creation_time,
-                        alarm2->time,
-                        alarm2->message);
-                }
+        else if (!clock_virtual && replay_speed > 0)
+        {
+            due = start + (int64_t)(offset / replay_speed);
+            clock_timespec(due, &t);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)
+                   == EINTR)
+            {
             }
-            pthread_mutex_unlock(&event_mutex);
+            histogram_record(&replay_lag, clock_monotonic() - due);
         }
 
-        DEBUG_PRINT_ALARM_LIST(alarm_header.next);
+        command_queue_push(&command_queue, &command, true);
+        reader->total++;
+        previous = offset;
+    }
+
+    replay_span = previous;
+    fclose(replay.file);
+    return NULL;
+}
+
+/**
+ * BATCH MODE
+ * * * * * * *
+ *
+ * Starts a reader thread for each command file (or for standard input when
+ * it is not a terminal), or a replay thread for a trace, and waits until
+ * every command they read has been applied. The commands of one file are
+ * applied in order, but the commands of different files are interleaved as
+ * they are read.
+ *
+ * At the end of the input, the number of commands per second is reported on
+ * standard error. The display threads (or the timer engine) go on printing
+ * and expiring the alarms, and the program exits once every display thread
+ * is gone (or every alarm left is suspended) and all of the output has been
+ * written.
+ */
+void run_batch(reader_t readers[], int count)
+{
+    long total = 0;            // Number of lines read.
+    long bad = 0;              // Number of lines that were not commands.
+    double start;              // Time when reading started.
+    double elapsed;            // Time spent reading and applying the input.
+    int status;
+
+    start = monotonic_seconds();
+
+    for (int i = 0; i < count; i++)
+    {
+        readers[i].total = 0;
+        readers[i].bad = 0;
+        status = pthread_create(
+            &readers[i].thread,
+            NULL,
+            readers[i].trace ? replay_thread : reader_thread,
+            &readers[i]);
+        if (status != 0)
+        {
+            err_abort(status, "Create reader thread");
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        total += readers[i].total;
+        bad += readers[i].bad;
+    }
+
+    metered_mutex_lock(&alarm_list_mutex);
+    while (commands_applied < total)
+    {
+        metered_cond_wait(&commands_applied_cond, &alarm_list_mutex);
+    }
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    // Every command has been applied, so commit them to the journal now.
+    if (journaling)
+    {
+        journal_flush(&journal);
+    }
+    if (tracing)
+    {
+        trace_flush(&trace);
+    }
+
+    elapsed = monotonic_seconds() - start;
+    output_flush();
+    fprintf(
+        stderr,
+        "Batch: %ld commands (%ld bad) in %.3f seconds, "
+        "%.0f commands/sec\n",
+        total,
+        bad,
+        elapsed,
+        elapsed > 0 ? total / elapsed : 0.0);
+    if (replay_path != NULL)
+    {
+        report_replay(elapsed);
     }
 
     /*
-     * Unlock alarm list mutex.
+     * On a virtual clock, the alarms that are left are run to the end at
+     * once. Suspended alarms would never expire, so they are not waited
+     * for: once every alarm left is suspended, the program exits even
+     * though display threads still own them.
      */
-    pthread_mutex_unlock(&alarm_list_mutex);
+    metered_mutex_lock(&alarm_list_mutex);
+    if (clock_virtual)
+    {
+        advance_virtual_clock(INT64_MAX);
+    }
+    else
+    {
+        while (thread_header.next != NULL
+               && alarm_index.count != suspended_alarms)
+        {
+            metered_cond_wait(&thread_list_empty, &alarm_list_mutex);
+        }
+    }
+    metered_mutex_unlock(&alarm_list_mutex);
+
+    output_flush();
+    print_exit_report();
+    exit(0);
+}
+
+/**
+ * SIGNAL THREAD
+ * * * * * * * *
+ *
+ * SIGINT and SIGTERM are blocked in every thread, and taken by this thread
+ * instead, so that the program writes its output and its report before it
+ * exits.
+ */
+void *signal_thread(void *arg)
+{
+    sigset_t *signals = arg;
+    int signal;
+
+    sigwait(signals, &signal);
+    if (tracing)
+    {
+        trace_flush(&trace);
+    }
+    output_flush();
+    print_exit_report();
+    exit(128 + signal);
 }
 
 /**
@@ -1002,317 +3561,292 @@ void *client_thread(void *arg)
  * * * * * * *
  *
  * This is the function for the main thread (and the entry point to the
- * program). It reads commands from user input, parses the command, and performs
- * actions relating to the command.
+ * program). It reads commands from user input, parses the command, and adds
+ * it to the command queue. Commands from files or a pipe are handed to
+ * run_batch() instead.
  *
- * Commands will add, modify, and delete alarms. Each alarm is malloced by this
- * thread. Since each display thread can only hold a maximum of two alarms, this
- * thread is responsible for creating new display threads.
- *
- * When handling commands, the main thread will manipulate the alarm list and
- * create events and broadcast them to the display threads to be handled.
- * Display threads will wait on a condition variable, allowing the main thread
- * to wake up the display threads by broadcasting the condition variable.
+ * The command thread applies the commands: it adds, modifies, and deletes
+ * alarms, creates new display threads when they are needed, and sends events
+ * to the display threads that own the alarms. Display threads wait on a
+ * condition variable, allowing the command thread to wake them up.
  */
 int main(int argc, char *argv[])
 {
     char input[128];           // Buffer for user input.
 
-    command_t *command;        // Pointer for the currently entered command.
+    command_t command;         // The currently entered command. It is
+                               // filled in by the parser, so no memory is
+                               // allocated per command.
 
-    alarm_t *alarm;            // Pointer for newly created alarms.
+    pthread_t timer;           // Handle of the timer thread (wheel and heap
+                               // engines only).
 
-    thread_t *next_thread;     // Pointer for newly created threads.
+    pthread_t applier;         // Handle of the command thread.
 
-    int thread_id_counter = 0; // Counter for thread IDs. This will be
-                               // incremented every time a thread is created so
-                               // that each thread has a unique ID.
+    pthread_t signaller;       // Handle of the signal thread.
 
-    DEBUG_PRINT_START_MESSAGE();
+    sigset_t signals;          // Signals taken by the signal thread.
 
-    while (1)
-    {
-        printf("Alarm > ");
+    reader_t *readers;         // Reader threads (batch mode only).
 
-        if (fgets(input, sizeof(input), stdin) == NULL)
+    int reader_count;          // Number of reader threads.
+
+    int option;                // Command line option being read.
+
+    output_policy policy;      // What to do when the writer thread falls
+                               // behind.
+
+    const char *journal_path;  // Journal file (NULL if there is none).
+
+    int journal_interval;      // Milliseconds between two group commits.
+
+
+    pthread_t exporter;        // Handle of the metrics thread.
+
+    const char *trace_path;    // Trace file (NULL if none is recorded).
+
+    policy = OUTPUT_BLOCK;
+    journal_path = NULL;
+    trace_path = NULL;
+    journal_interval = DEFAULT_JOURNAL_INTERVAL;
+    while ((option = getopt(argc, argv, "e:s:w:o:j:g:c:i:m:r:vt:p:x:")) != -1)
+    {
+        if (option == 'e' && strcmp(optarg, "threads") == 0)
         {
-            continue;
+            engine = ENGINE_THREADS;
         }
-        // Replace newline with null terminating character
-        input[strcspn(input, "\n")] = 0;
-        command = parse_command(input);
-
-        /*
-         * If command is NULL, then the command was invalid.
-         */
-        if (command == NULL)
+        else if (option == 'e' && strcmp(optarg, "wheel") == 0)
         {
-            printf("Bad command\n");
-            continue;
+            engine = ENGINE_WHEEL;
         }
-        /*
-         * Command was  valid, so we can handle it.
-         */
-        else {
-            DEBUG_PRINT_COMMAND(command);
+        else if (option == 'e' && strcmp(optarg, "heap") == 0)
+        {
+            engine = ENGINE_HEAP;
+        }
+        else if (option == 'e' && strcmp(optarg, "pool") == 0)
+        {
+            engine = ENGINE_POOL;
+        }
+        else if (option == 'o' && strcmp(optarg, "block") == 0)
+        {
+            policy = OUTPUT_BLOCK;
+        }
+        else if (option == 'o' && strcmp(optarg, "drop") == 0)
+        {
+            policy = OUTPUT_DROP;
+        }
+        else if (option == 'o' && strcmp(optarg, "count") == 0)
+        {
+            policy = OUTPUT_COUNT;
+        }
+        else if (option == 'j')
+        {
+            journal_path = optarg;
+        }
+        else if (option == 'g' && atoi(optarg) >= 1)
+        {
+            journal_interval = atoi(optarg);
+        }
+        else if (option == 'c')
+        {
+            checkpoint_path = optarg;
+        }
+        else if (option == 'i' && atoi(optarg) >= 0)
+        {
+            checkpoint_interval = atoi(optarg);
+        }
+        else if (option == 'm')
+        {
+            metrics_path = optarg;
+        }
+        else if (option == 'r' && atoi(optarg) >= 1)
+        {
+            metrics_interval = atoi(optarg);
+        }
+        else if (option == 'v')
+        {
+            clock_virtual = true;
+        }
+        else if (option == 't')
+        {
+            trace_path = optarg;
+        }
+        else if (option == 'p')
+        {
+            replay_path = optarg;
+        }
+        else if (option == 'x' && atof(optarg) >= 0)
+        {
+            replay_speed = atof(optarg);
+        }
+        else if (option == 'w'
+                 && atoi(optarg) >= 1
+                 && atoi(optarg) <= MAX_POOL_WORKERS)
+        {
+            pool_size = atoi(optarg);
+        }
+        else if (option == 's'
+                 && atoi(optarg) >= DEFAULT_ALARMS_PER_THREAD
+                 && atoi(optarg) <= MAX_ALARMS_PER_THREAD)
+        {
+            alarms_per_thread = atoi(optarg);
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
 
-            /*
-             * Lock the mutex for the alarm list, so that no other
-             * threads can access the list until we are finished
-             * updating it.
-             */
-            pthread_mutex_lock(&alarm_list_mutex);
+    /*
+     * On a virtual clock, alarms are fired by the command thread when a
+     * Wait command moves the clock, so only the engines with a single
+     * timing wheel or heap can run on it.
+     */
+    if (clock_virtual && engine == ENGINE_THREADS)
+    {
+        engine = ENGINE_HEAP;
+    }
+    else if (clock_virtual && engine == ENGINE_POOL)
+    {
+        usage(argv[0]);
+    }
 
-            if (command->type == Start_Alarm)
-            {
-                /*
-                 * Allocate space for alarm.
-                 */
-                alarm = malloc(sizeof(alarm_t));
-                if (alarm == NULL)
-                {
-                    errno_abort("Malloc failed");
-                }
+    DEBUG_PRINT_START_MESSAGE();
 
-                /*
-                 * Fill in data for alarm.
-                 */
-                alarm->alarm_id = command->alarm_id;
-                alarm->time = command->time;
-                strcpy(alarm->message, command->message);
-                alarm->status = true;
-                alarm->creation_time = time(NULL);
-                alarm->expiration_time = time(NULL) + alarm->time;
-                alarm->change_status = false;
-                alarm->time_left = 0;
+    /*
+     * Block SIGINT and SIGTERM before any thread is created, so that every
+     * thread inherits the mask and only the signal thread takes them.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_create(&signaller, NULL, signal_thread, &signals);
 
-                /*
-                 * Insert alarm into the list.
-                 */
-                if (insert_alarm_into_list(alarm) == NULL)
-                {
-                    /*
-                     * If inserting into alarm returns NULL, then the
-                     * alarm was not inserted into this list. In this
-                     * case, unlock the alarm list mutex and free the
-                     * alarm's memory.
-                     */
-                    free(alarm);
-                    pthread_mutex_unlock(&alarm_list_mutex);
-                    continue;
-                }
+    output_start(policy);
 
-                printf(
-                    "Alarm %d Inserted Into Alarm List at %ld: %d %s\n",
-                    alarm->alarm_id,
-                    time(NULL),
-                    alarm->time,
-                    alarm->message
-                );
+    if (engine == ENGINE_POOL)
+    {
+        if (pool_size == 0)
+        {
+            pool_size = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (pool_size < 1)
+        {
+            pool_size = 1;
+        }
+        else if (pool_size > MAX_POOL_WORKERS)
+        {
+            pool_size = MAX_POOL_WORKERS;
+        }
+        start_pool_workers();
+    }
+    else if (engine != ENGINE_THREADS)
+    {
+        clock_cond_init(&timer_cond);
+        timing_wheel_init(&alarm_wheel, clock_now() / NSEC_PER_MSEC);
+        if (!clock_virtual)
+        {
+            pthread_create(&timer, NULL, timer_thread, NULL);
+        }
+    }
 
-                DEBUG_PRINTF("threads: ");
-                DEBUG_PRINT_THREAD_LIST(thread_header);
-                DEBUG_PRINTF("alarms: ");
-                DEBUG_PRINT_ALARM_LIST(alarm_header.next);
+    /*
+     * The checkpoint is only mapped here, and the journal only opened; the
+     * command thread restores their alarms before it applies the first
+     * command, so the prompt comes up at once.
+     */
+    if (checkpoint_path != NULL)
+    {
+        restoring_checkpoint =
+            checkpoint_map(&restore_checkpoint, checkpoint_path);
+    }
+    last_stats.taken_at = clock_monotonic();
+    if (metrics_path != NULL)
+    {
+        pthread_create(&exporter, NULL, metrics_thread, NULL);
+    }
 
-                /*
-                 * If all the threads are full we need to make a new thread for
-                 * the new alarm.
-                 */
-                if (thread_full_check() == true){
-                    // Allocate space for a new thread.
-                    next_thread = malloc(sizeof(thread_t));
-                    if (next_thread == NULL) {
-                        errno_abort("Malloc failed");
-                    }
-                    // Fill in data for the thread
-                    next_thread->thread_id = thread_id_counter;
-                    next_thread->alarms = 0;
-                    next_thread->next = NULL;
-                    next_thread->alarm =  alarm;
-
-                    // Increment thread ID counter
-                    thread_id_counter++;
-
-                    // Add the thread to the thread list. We need to lock the
-                    // thread list mutex first.
-                    pthread_mutex_lock(&thread_list_mutex);
-                    add_to_thread_list(next_thread);
-                    pthread_mutex_unlock(&thread_list_mutex);
-
-                    // Create the new thread.
-                    pthread_create(
-                        &next_thread->thread,
-                        NULL,
-                        client_thread,
-                        next_thread
-                    );
-
-                    DEBUG_PRINT_THREAD_LIST(thread_header);
-
-                    printf(
-                        "New Display Alarm Thread %d Created at %ld: %d %s\n",
-                        next_thread->thread_id,
-                        time(NULL),
-                        alarm->time,
-                        alarm->message
-                    );
-                    
-                    /*
-                     * Unlock the mutex now since we don't want to emit an event
-                     * here.
-                     */
-                    pthread_mutex_unlock(&alarm_list_mutex);
-                    continue;
-                }
-                else{
-                    /*
-                     * In this case, there is at least one thread with space for
-                     * the new alarm. So we just need to send the event without
-                     * creating a new thread.
-                     */
-                    pthread_mutex_lock(&event_mutex);
-                    event = malloc(sizeof(event_t));
-                    if (event == NULL) {
-                        errno_abort("Malloc failed");
-                    }
-                    event->type = Start_Alarm;
-                    event->alarm = alarm;
-                    pthread_mutex_unlock(&event_mutex);
+    if (journal_path != NULL)
+    {
+        journal_open(
+            &journal,
+            journal_path,
+            journal_interval * NSEC_PER_MSEC);
+        journaling = true;
+        journal_start(&journal);
+    }
 
-                }            
-            }
-            else if (command->type == Change_Alarm)
-            {
-                // Check if the alarm exists, if not return error
-                // message and unlock the mutex.
-                if (!doesAlarmExist(command -> alarm_id))
-                {
-                    printf(
-                        "Alarm of ID %d does not exist.\n",
-                        command->alarm_id
-                    );
-                    pthread_mutex_unlock( & alarm_list_mutex);
-                    continue;
-                }
+    if (trace_path != NULL)
+    {
+        trace_create(&trace, trace_path);
+        tracing = true;
+    }
 
-                // Go through list and find the existing alarm using the ID
-                alarm_t *existing_alarm = find_alarm_by_id(command -> alarm_id);
-                
-                // Update the existing alarm time and message.                
-                existing_alarm -> time = command -> time;
-                existing_alarm->expiration_time = time(NULL) + command->time;
-                strcpy(existing_alarm -> message, command -> message);
-
-                // Tell the alarm that its message has been recently changed
-                existing_alarm->change_status = true;
-
-                // Return display message showing alarm has changed.
-                printf(
-                    "Alarm (%d) Changed at %ld: %s\n",
-                    command->alarm_id,
-                    time(NULL),
-                    command->message
-                );
-            }
-            else if (command->type == Cancel_Alarm)
-            {
-                // Get the ID that will be cancellled
-                int cancelId = command->alarm_id;
-                int AlarmExists = doesAlarmExist(cancelId);
+    command_queue_init(&command_queue);
+    pthread_create(&applier, NULL, command_thread, NULL);
 
-                if (AlarmExists == 0)
-                {
-                    printf("Not a valid ID.\n");
-                }
-                else
-                {
-                    /*
-                     * Remove alarm from list
-                     */
-                    remove_alarm_from_list(cancelId);
-
-                    /*
-                     * Send cancel alarm event to thread.
-                     */
-                    pthread_mutex_lock(&event_mutex);
-                    event = malloc(sizeof(event_t));
-                    if (event == NULL) {
-                        errno_abort("Malloc failed");
-                    }
-                    event->type = Cancel_Alarm;
-                    event->alarmId = cancelId;
-                    pthread_mutex_unlock(&event_mutex);
-                }
-            }
-            else if (command->type == Reactivate_Alarm)
+    /*
+     * Commands from files or a pipe (or a trace) are read by reader threads
+     * and applied in batches. Otherwise, the user is prompted for one
+     * command at a time. A trace is replayed by the last reader.
+     */
+    reader_count = optind < argc ? argc - optind : !isatty(STDIN_FILENO);
+    if (replay_path != NULL)
+    {
+        reader_count = argc - optind + 1;
+    }
+    if (reader_count > 0)
+    {
+        readers = malloc(reader_count * sizeof(reader_t));
+        if (readers == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        for (int i = 0; i < reader_count; i++)
+        {
+            readers[i].trace = false;
+        }
+        readers[0].fd = STDIN_FILENO;
+        if (replay_path != NULL)
+        {
+            readers[reader_count - 1].fd = open(replay_path, O_RDONLY);
+            if (readers[reader_count - 1].fd < 0)
             {
-                int AlarmExists = doesAlarmExist(command->alarm_id);
-                if (AlarmExists == 0)
-                {
-                    printf("Not a valid ID.\n");
-                }
-                else
-                {
-                    /*
-                     * Reactivate the alarm in the list. Note that we don't use
-                     * an event because it is simpler to just reactivate it
-                     * here. Since the thread owning this alarm shares the
-                     * reference to this alarm in the list, it will "notice"
-                     * the change in status of the alarm.
-                     */
-                    reactivate_alarm_in_list(command->alarm_id);
-                }
+                errno_abort("Open trace");
             }
-            else if (command->type == Suspend_Alarm)
+            readers[reader_count - 1].trace = true;
+        }
+        for (int i = 0; optind + i < argc; i++)
+        {
+            readers[i].fd = open(argv[optind + i], O_RDONLY);
+            if (readers[i].fd < 0)
             {
-                // Gets the ID that will be suspended
-                int suspendId = command->alarm_id;
-
-                int AlarmExists = doesAlarmExist(suspendId);
-                if (AlarmExists == 0)
-                {
-                    printf("Not a valid ID.\n");
-                }
-                else
-                {
-                    /*
-                     * Send event to display threads.
-                     */
-                    pthread_mutex_lock(&event_mutex);
-                    // Allocate memory for the event structure
-                    event = malloc(sizeof(event_t));
-                    if (event == NULL) {
-                        errno_abort("Malloc failed");
-                    }
-                    event->type = Suspend_Alarm;
-                    event->alarmId = suspendId;
-                    pthread_mutex_unlock(&event_mutex);
-                }
-            }
-            else if (command->type == View_Alarms) {
-                printf("View Alarms at %ld: \n", time(NULL));
-                pthread_mutex_lock(&event_mutex);
-                event = malloc(sizeof(event_t));
-                if (event == NULL) {
-                    errno_abort("Malloc failed");
-                }
-                event->type = View_Alarms;
-                pthread_mutex_unlock(&event_mutex);
+                errno_abort("Open command file");
             }
+        }
+        run_batch(readers, reader_count);
+    }
 
-            DEBUG_PRINT_ALARM_LIST(alarm_header.next);
-
-            /*
-             * We are done updating the list, so notify the other
-             * threads by broadcasting, then unlock the mutex so that
-             * the other threads can lock it.
-             */
-            pthread_cond_broadcast(&alarm_list_cond);
-            pthread_mutex_unlock(&alarm_list_mutex);
+    while (1)
+    {
+        output_printf("Alarm > ");
 
-            free(command);
+        if (fgets(input, sizeof(input), stdin) == NULL)
+        {
+            continue;
         }
+        // Replace newline with null terminating character
+        input[strcspn(input, "\n")] = 0;
+
+        /*
+         * Hand the command to the command thread. If it could not be parsed,
+         * the command was invalid, and the command thread says so in turn.
+         */
+        command_queue_push(
+            &command_queue,
+            &command,
+            parse_command(input, &command));
     }
 
     return 0;
@@ -0,0 +1,760 @@
+/*
+ * alarm_bench.c
+ *
+ * Load generator for New_Alarm_Mutex.c. It starts the alarm program with
+ * its standard input and output connected to pipes, sends it a generated
+ * workload of commands, and watches its output for expired alarms. When the
+ * program exits, it prints one JSON object with:
+ *
+ *   - the workload that was run, so runs can be told apart,
+ *   - the command throughput (as reported by the program's "Batch:" line,
+ *     and as sent by the generator),
+ *   - percentiles of the expiry lateness: how long after its deadline the
+ *     expiry of an alarm was read from the program's output,
+ *   - the peak RSS, the peak number of threads, and the number of context
+ *     switches of the program.
+ *
+ * The workload is made of:
+ *
+ *   - "-n N" Start_Alarm commands, with IDs 1 to N.
+ *   - a mix ("-m") of Start_Alarm, Change_Alarm, Cancel_Alarm,
+ *     Suspend_Alarm, Reactivate_Alarm and View_Alarms, given as weights.
+ *     Change, Cancel and Suspend pick a random active alarm, and Reactivate
+ *     a random suspended one. Alarms still suspended at the end are
+ *     reactivated, so that every alarm expires and the program exits.
+ *   - an arrival rate ("-r", in commands per second, 0 for as fast as the
+ *     program takes them).
+ *   - a distribution of alarm durations ("-d", in milliseconds).
+ *
+ * Arguments after "--" are given to the alarm program (for example the
+ * engine). The alarm program is "./bench_server" unless "-x" says otherwise.
+ *
+ * Build and run with "make bench" (BENCH_ARGS holds extra arguments).
+ */
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "clock.h"
+#include "errors.h"
+
+/**
+ * The kinds of commands in the mix, in the order their weights are given.
+ */
+typedef enum bench_command
+{
+    BENCH_START,
+    BENCH_CHANGE,
+    BENCH_CANCEL,
+    BENCH_SUSPEND,
+    BENCH_REACTIVATE,
+    BENCH_VIEW,
+    BENCH_COMMANDS
+} bench_command;
+
+const char *bench_command_names[BENCH_COMMANDS] = {
+    "start", "change", "cancel", "suspend", "reactivate", "view"
+};
+
+/**
+ * The distributions alarm durations can be drawn from.
+ *
+ *   - "fixed:MS" gives every alarm MS milliseconds.
+ *   - "uniform:MIN:MAX" draws them uniformly between MIN and MAX.
+ *   - "exp:MEAN" draws them from an exponential distribution (capped at ten
+ *     times the mean, so a run cannot last much longer than expected).
+ */
+typedef enum duration_kind
+{
+    DURATION_FIXED,
+    DURATION_UNIFORM,
+    DURATION_EXPONENTIAL
+} duration_kind;
+
+typedef struct duration_t
+{
+    duration_kind kind;
+    double a;
+    double b;
+    const char *spec;
+} duration_t;
+
+/**
+ * What the generator knows about an alarm it started.
+ *
+ *   - `state` is ALARM_NONE before it is started and after it is cancelled
+ *     or has expired.
+ *   - `deadline` is when an active alarm should expire (monotonic ns), and
+ *     `left` is the time a suspended alarm has left.
+ *   - `position` is where the alarm is in the array of active or suspended
+ *     alarms, so that a random one can be picked and removed in O(1).
+ */
+typedef enum alarm_state
+{
+    ALARM_NONE,
+    ALARM_ACTIVE,
+    ALARM_SUSPENDED
+} alarm_state;
+
+typedef struct bench_alarm_t
+{
+    alarm_state state;
+    int64_t deadline;
+    int64_t left;
+    int position;
+} bench_alarm_t;
+
+/**
+ * A set of alarm IDs in no particular order.
+ */
+typedef struct id_set_t
+{
+    int *ids;
+    int count;
+} id_set_t;
+
+/**
+ * The alarms, indexed by ID, and the active and suspended ones. They are
+ * shared with the thread reading the program's output, and protected by
+ * `alarms_mutex`.
+ */
+bench_alarm_t *alarms;
+id_set_t active;
+id_set_t suspended;
+pthread_mutex_t alarms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Expiry lateness of every alarm whose expiry was read (in ns), and the
+ * number of expiries that arrived before their deadline was known (because
+ * the alarm was changed, suspended or reactivated in the meantime).
+ */
+int64_t *lateness;
+long lateness_count = 0;
+long unmatched_expiries = 0;
+
+/**
+ * Number of commands per second, from the program's "Batch:" line.
+ */
+double server_rate = 0;
+
+/**
+ * Peak number of threads of the program, sampled from /proc while it runs.
+ */
+int peak_threads = 0;
+bool sampling = true;
+
+/**
+ * Adds an ID to a set, recording its position.
+ */
+void id_set_add(id_set_t *set, int id)
+{
+    alarms[id].position = set->count;
+    set->ids[set->count++] = id;
+}
+
+/**
+ * Removes an ID from a set by moving the last ID into its place.
+ */
+void id_set_remove(id_set_t *set, int id)
+{
+    int last = set->ids[--set->count];
+
+    set->ids[alarms[id].position] = last;
+    alarms[last].position = alarms[id].position;
+}
+
+/**
+ * Returns a random number in [0, 1).
+ */
+double random_unit(unsigned int *seed)
+{
+    return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/**
+ * Parses a duration distribution. Returns false if it is not valid.
+ */
+bool parse_duration(const char *spec, duration_t *duration)
+{
+    duration->spec = spec;
+    if (sscanf(spec, "fixed:%lf", &duration->a) == 1)
+    {
+        duration->kind = DURATION_FIXED;
+        return duration->a >= 1;
+    }
+    if (sscanf(spec, "uniform:%lf:%lf", &duration->a, &duration->b) == 2)
+    {
+        duration->kind = DURATION_UNIFORM;
+        return duration->a >= 1 && duration->b >= duration->a;
+    }
+    if (sscanf(spec, "exp:%lf", &duration->a) == 1)
+    {
+        duration->kind = DURATION_EXPONENTIAL;
+        return duration->a >= 1;
+    }
+    return false;
+}
+
+/**
+ * Draws a duration in milliseconds (at least 1).
+ */
+int draw_duration(const duration_t *duration, unsigned int *seed)
+{
+    double ms;
+
+    switch (duration->kind)
+    {
+    case DURATION_FIXED:
+        ms = duration->a;
+        break;
+    case DURATION_UNIFORM:
+        ms = duration->a + random_unit(seed) * (duration->b - duration->a);
+        break;
+    default:
+        ms = -duration->a * log(1 - random_unit(seed));
+        if (ms > 10 * duration->a)
+        {
+            ms = 10 * duration->a;
+        }
+        break;
+    }
+    return ms < 1 ? 1 : (int)ms;
+}
+
+/**
+ * Parses a mix such as "start=70,change=10,view=0.1" into weights. Kinds of
+ * commands that are not named keep their weight. Returns false if the mix is
+ * not valid.
+ */
+bool parse_mix(const char *spec, double weights[])
+{
+    char *copy = strdup(spec);
+    char *save;
+    char *item;
+    char *value;
+    bool valid = true;
+    int i;
+
+    for (item = strtok_r(copy, ",", &save);
+         item != NULL && valid;
+         item = strtok_r(NULL, ",", &save))
+    {
+        value = strchr(item, '=');
+        valid = value != NULL;
+        if (!valid)
+        {
+            break;
+        }
+        *value++ = 0;
+        for (i = 0; i < BENCH_COMMANDS; i++)
+        {
+            if (strcmp(item, bench_command_names[i]) == 0)
+            {
+                weights[i] = atof(value);
+                break;
+            }
+        }
+        valid = i < BENCH_COMMANDS && weights[i] >= 0;
+    }
+
+    free(copy);
+    return valid && weights[BENCH_START] > 0;
+}
+
+/**
+ * Writes all of a buffer to a file descriptor.
+ */
+void write_all(int fd, const char *buffer, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0)
+    {
+        written = write(fd, buffer, length);
+        if (written < 0)
+        {
+            errno_abort("Write commands");
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+/**
+ * Thread that reads the program's standard output and records the lateness
+ * of every expired alarm.
+ */
+void *output_reader(void *arg)
+{
+    FILE *output = fdopen(*(int *)arg, "r");
+    char line[512];
+    char *expired;
+    int64_t now;
+    int id;
+
+    while (fgets(line, sizeof(line), output) != NULL)
+    {
+        expired = strstr(line, "Removed Expired Alarm(");
+        if (expired == NULL)
+        {
+            continue;
+        }
+        now = clock_now();
+        id = atoi(expired + strlen("Removed Expired Alarm("));
+
+        pthread_mutex_lock(&alarms_mutex);
+        if (alarms[id].state == ALARM_ACTIVE)
+        {
+            lateness[lateness_count++] = now - alarms[id].deadline;
+            id_set_remove(&active, id);
+        }
+        else
+        {
+            // It expired before the generator's Cancel or Suspend was applied.
+            if (alarms[id].state == ALARM_SUSPENDED)
+            {
+                id_set_remove(&suspended, id);
+            }
+            unmatched_expiries++;
+        }
+        alarms[id].state = ALARM_NONE;
+        pthread_mutex_unlock(&alarms_mutex);
+    }
+
+    fclose(output);
+    return NULL;
+}
+
+/**
+ * Thread that reads the program's standard error, takes the throughput from
+ * its "Batch:" line, and passes the other lines on.
+ */
+void *error_reader(void *arg)
+{
+    FILE *errors = fdopen(*(int *)arg, "r");
+    char line[512];
+    char *rate;
+
+    while (fgets(line, sizeof(line), errors) != NULL)
+    {
+        if (strncmp(line, "Batch:", 6) == 0)
+        {
+            rate = strrchr(line, ',');
+            if (rate != NULL)
+            {
+                server_rate = atof(rate + 1);
+            }
+        }
+        else
+        {
+            fputs(line, stderr);
+        }
+    }
+
+    fclose(errors);
+    return NULL;
+}
+
+/**
+ * Thread that samples the number of threads of the program every 10 ms.
+ */
+void *thread_sampler(void *arg)
+{
+    char path[64];
+    char line[256];
+    FILE *status;
+    int threads;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", *(pid_t *)arg);
+    while (__atomic_load_n(&sampling, __ATOMIC_RELAXED))
+    {
+        status = fopen(path, "r");
+        if (status == NULL)
+        {
+            break;
+        }
+        while (fgets(line, sizeof(line), status) != NULL)
+        {
+            if (sscanf(line, "Threads: %d", &threads) == 1
+                && threads > peak_threads)
+            {
+                peak_threads = threads;
+            }
+        }
+        fclose(status);
+        usleep(10000);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the alarm program with its standard streams connected to pipes.
+ */
+pid_t start_server(
+    const char *server,
+    char *args[],
+    int nargs,
+    int *input,
+    int *output,
+    int *errors)
+{
+    int in[2], out[2], err[2];
+    char **argv;
+    pid_t pid;
+
+    if (pipe(in) != 0 || pipe(out) != 0 || pipe(err) != 0)
+    {
+        errno_abort("Pipe");
+    }
+
+    argv = calloc(nargs + 2, sizeof(char *));
+    argv[0] = (char *)server;
+    memcpy(argv + 1, args, nargs * sizeof(char *));
+
+    pid = fork();
+    if (pid < 0)
+    {
+        errno_abort("Fork");
+    }
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+        close(err[0]); close(err[1]);
+        execv(server, argv);
+        fprintf(stderr, "Cannot run %s\n", server);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    *input = in[1];
+    *output = out[0];
+    *errors = err[0];
+    free(argv);
+    return pid;
+}
+
+/**
+ * Returns the lateness percentile `p` (between 0 and 1) in milliseconds.
+ * The lateness must be sorted.
+ */
+double percentile(double p)
+{
+    long i;
+
+    if (lateness_count == 0)
+    {
+        return 0;
+    }
+    i = (long)ceil(p * lateness_count) - 1;
+    if (i < 0)
+    {
+        i = 0;
+    }
+    return lateness[i] / 1e6;
+}
+
+int compare_lateness(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void usage(const char *program)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [-n alarms] [-m mix] [-r rate] [-d duration] [-x program]"
+        "\n       [-- program arguments]\n",
+        program);
+    fprintf(stderr, "  -n  number of alarms started (default 10000)\n");
+    fprintf(stderr, "  -m  weights of start, change, cancel, suspend, "
+                    "reactivate and view\n      (default start=70,change=10,"
+                    "cancel=10,suspend=5,reactivate=5,\n      view=0.01)\n");
+    fprintf(stderr, "  -r  commands per second (default 0: as fast as "
+                    "possible)\n");
+    fprintf(stderr, "  -d  alarm durations in ms: fixed:MS, uniform:MIN:MAX "
+                    "or exp:MEAN\n      (default uniform:100:1000)\n");
+    fprintf(stderr, "  -x  alarm program (default ./bench_server)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    double weights[BENCH_COMMANDS] = {70, 10, 10, 5, 5, 0.01};
+    const char *mix = "start=70,change=10,cancel=10,suspend=5,reactivate=5,"
+                      "view=0.01";
+    const char *server = "./bench_server";
+    duration_t duration;
+    long alarm_count = 10000;
+    double rate = 0;
+    long sent[BENCH_COMMANDS] = {0};
+    long commands = 0;
+    unsigned int seed = 1;
+    int option;
+    int input, output, errors;
+    pid_t pid;
+    pthread_t output_thread, error_thread, sampler_thread;
+    struct rusage usage_info;
+    struct timespec t;
+    char buffer[65536];
+    size_t length = 0;
+    double total_weight = 0;
+    double pick;
+    int64_t start, now, finish;
+    int next_id = 1;
+    int ms;
+    int id;
+    int kind;
+    int status;
+
+    parse_duration("uniform:100:1000", &duration);
+    while ((option = getopt(argc, argv, "n:m:r:d:x:")) != -1)
+    {
+        if (option == 'n' && atol(optarg) >= 1)
+        {
+            alarm_count = atol(optarg);
+        }
+        else if (option == 'm' && parse_mix(optarg, weights))
+        {
+            mix = optarg;
+        }
+        else if (option == 'r' && atof(optarg) >= 0)
+        {
+            rate = atof(optarg);
+        }
+        else if (option == 'd' && parse_duration(optarg, &duration))
+        {
+        }
+        else if (option == 'x')
+        {
+            server = optarg;
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    for (kind = 0; kind < BENCH_COMMANDS; kind++)
+    {
+        total_weight += weights[kind];
+    }
+
+    alarms = calloc(alarm_count + 1, sizeof(bench_alarm_t));
+    active.ids = malloc(alarm_count * sizeof(int));
+    suspended.ids = malloc(alarm_count * sizeof(int));
+    lateness = malloc(alarm_count * sizeof(int64_t));
+    if (alarms == NULL || active.ids == NULL || suspended.ids == NULL
+        || lateness == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    pid = start_server(
+        server, argv + optind, argc - optind, &input, &output, &errors);
+    pthread_create(&output_thread, NULL, output_reader, &output);
+    pthread_create(&error_thread, NULL, error_reader, &errors);
+    pthread_create(&sampler_thread, NULL, thread_sampler, &pid);
+
+    start = clock_now();
+    while (next_id <= alarm_count)
+    {
+        pick = random_unit(&seed) * total_weight;
+        for (kind = 0; kind < BENCH_COMMANDS - 1; kind++)
+        {
+            if (pick < weights[kind])
+            {
+                break;
+            }
+            pick -= weights[kind];
+        }
+
+        // Pace the commands, and send the ones waiting in the buffer first.
+        if (rate > 0)
+        {
+            write_all(input, buffer, length);
+            length = 0;
+            clock_timespec(start + (int64_t)(commands * 1e9 / rate), &t);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)
+                   != 0)
+            {
+            }
+        }
+        else if (length > sizeof(buffer) - 256)
+        {
+            write_all(input, buffer, length);
+            length = 0;
+        }
+
+        pthread_mutex_lock(&alarms_mutex);
+        now = clock_now();
+        if ((kind == BENCH_CHANGE || kind == BENCH_CANCEL
+             || kind == BENCH_SUSPEND)
+            && active.count == 0)
+        {
+            kind = BENCH_START;
+        }
+        if (kind == BENCH_REACTIVATE && suspended.count == 0)
+        {
+            kind = BENCH_START;
+        }
+
+        switch (kind)
+        {
+        case BENCH_START:
+            id = next_id++;
+            ms = draw_duration(&duration, &seed);
+            alarms[id].state = ALARM_ACTIVE;
+            alarms[id].deadline = now + ms * NSEC_PER_MSEC;
+            id_set_add(&active, id);
+            length += sprintf(
+                buffer + length, "Start_Alarm(%d): %dms bench%d\n",
+                id, ms, id);
+            break;
+        case BENCH_CHANGE:
+            id = active.ids[rand_r(&seed) % active.count];
+            ms = draw_duration(&duration, &seed);
+            alarms[id].deadline = now + ms * NSEC_PER_MSEC;
+            length += sprintf(
+                buffer + length, "Change_Alarm(%d): %dms changed%d\n",
+                id, ms, id);
+            break;
+        case BENCH_CANCEL:
+            id = active.ids[rand_r(&seed) % active.count];
+            id_set_remove(&active, id);
+            alarms[id].state = ALARM_NONE;
+            length += sprintf(buffer + length, "Cancel_Alarm(%d)\n", id);
+            break;
+        case BENCH_SUSPEND:
+            id = active.ids[rand_r(&seed) % active.count];
+            id_set_remove(&active, id);
+            alarms[id].state = ALARM_SUSPENDED;
+            alarms[id].left = alarms[id].deadline - now;
+            id_set_add(&suspended, id);
+            length += sprintf(buffer + length, "Suspend_Alarm(%d)\n", id);
+            break;
+        case BENCH_REACTIVATE:
+            id = suspended.ids[rand_r(&seed) % suspended.count];
+            id_set_remove(&suspended, id);
+            alarms[id].state = ALARM_ACTIVE;
+            alarms[id].deadline = now + alarms[id].left;
+            id_set_add(&active, id);
+            length += sprintf(buffer + length, "Reactivate_Alarm(%d)\n", id);
+            break;
+        default:
+            length += sprintf(buffer + length, "View_Alarms\n");
+            break;
+        }
+        pthread_mutex_unlock(&alarms_mutex);
+
+        sent[kind]++;
+        commands++;
+    }
+
+    // Reactivate every alarm still suspended, so that the program exits.
+    pthread_mutex_lock(&alarms_mutex);
+    while (suspended.count > 0)
+    {
+        if (length > sizeof(buffer) - 256)
+        {
+            write_all(input, buffer, length);
+            length = 0;
+        }
+        id = suspended.ids[0];
+        id_set_remove(&suspended, id);
+        alarms[id].state = ALARM_ACTIVE;
+        alarms[id].deadline = clock_now() + alarms[id].left;
+        id_set_add(&active, id);
+        length += sprintf(buffer + length, "Reactivate_Alarm(%d)\n", id);
+        sent[BENCH_REACTIVATE]++;
+        commands++;
+    }
+    pthread_mutex_unlock(&alarms_mutex);
+    write_all(input, buffer, length);
+    finish = clock_now();
+    close(input);
+
+    if (wait4(pid, &status, 0, &usage_info) < 0)
+    {
+        errno_abort("Wait for alarm program");
+    }
+    __atomic_store_n(&sampling, false, __ATOMIC_RELAXED);
+    pthread_join(output_thread, NULL);
+    pthread_join(error_thread, NULL);
+    pthread_join(sampler_thread, NULL);
+
+    qsort(lateness, lateness_count, sizeof(int64_t), compare_lateness);
+
+    printf("{\n");
+    printf("  \"workload\": {\n");
+    printf("    \"alarms\": %ld,\n", alarm_count);
+    printf("    \"mix\": \"%s\",\n", mix);
+    printf("    \"rate\": %.0f,\n", rate);
+    printf("    \"duration\": \"%s\",\n", duration.spec);
+    printf("    \"program_args\": \"");
+    for (int i = optind; i < argc; i++)
+    {
+        printf("%s%s", i > optind ? " " : "", argv[i]);
+    }
+    printf("\"\n  },\n");
+    printf("  \"commands\": {");
+    for (kind = 0; kind < BENCH_COMMANDS; kind++)
+    {
+        printf(
+            "%s\"%s\": %ld",
+            kind > 0 ? ", " : "",
+            bench_command_names[kind],
+            sent[kind]);
+    }
+    printf(", \"total\": %ld},\n", commands);
+    printf(
+        "  \"commands_per_sec\": %.0f,\n",
+        server_rate);
+    printf(
+        "  \"sent_per_sec\": %.0f,\n",
+        commands / ((finish - start) / 1e9));
+    printf("  \"wall_seconds\": %.3f,\n", (clock_now() - start) / 1e9);
+    printf("  \"expired\": %ld,\n", lateness_count);
+    printf("  \"unmatched_expiries\": %ld,\n", unmatched_expiries);
+    printf(
+        "  \"lateness_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+        "\"p999\": %.3f, \"max\": %.3f},\n",
+        percentile(0.5),
+        percentile(0.9),
+        percentile(0.99),
+        percentile(0.999),
+        percentile(1));
+    printf("  \"peak_rss_kb\": %ld,\n", usage_info.ru_maxrss);
+    printf("  \"peak_threads\": %d,\n", peak_threads);
+    printf(
+        "  \"context_switches\": {\"voluntary\": %ld, \"involuntary\": %ld},\n",
+        usage_info.ru_nvcsw,
+        usage_info.ru_nivcsw);
+    printf(
+        "  \"cpu_seconds\": {\"user\": %.3f, \"system\": %.3f},\n",
+        usage_info.ru_utime.tv_sec + usage_info.ru_utime.tv_usec / 1e6,
+        usage_info.ru_stime.tv_sec + usage_info.ru_stime.tv_usec / 1e6);
+    printf(
+        "  \"exit_status\": %d\n",
+        WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+    printf("}\n");
+
+    return 0;
+}
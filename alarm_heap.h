@@ -0,0 +1,202 @@
+#ifndef __alarm_heap_h
+#define __alarm_heap_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "errors.h"
+
+/**
+ * The index of a heap node that is not in a heap.
+ */
+#define HEAP_NOT_QUEUED SIZE_MAX
+
+/**
+ * Data type for an entry in an indexed min-heap. Nodes are intrusive: the
+ * caller embeds one in the object being ordered and points `data` back at the
+ * object.
+ *
+ *   - `key` is the value the heap is ordered on (smallest first).
+ *   - `index` is the position of the node in the heap array, or
+ *     HEAP_NOT_QUEUED if the node is not in the heap. Keeping it up to date
+ *     is what lets a node be moved or removed without searching for it.
+ *   - `data` is the object that the node belongs to.
+ */
+typedef struct heap_node_t
+{
+    int64_t key;
+    size_t index;
+    void *data;
+} heap_node_t;
+
+/**
+ * Data type for an indexed binary min-heap.
+ *
+ *   - `nodes` is the heap array. The children of `nodes[i]` are
+ *     `nodes[2i + 1]` and `nodes[2i + 2]`.
+ *   - `count` is the number of nodes in the heap.
+ *   - `capacity` is the allocated length of `nodes`.
+ *
+ * The heap is not thread safe; the caller must protect it with a mutex.
+ */
+typedef struct min_heap_t
+{
+    heap_node_t **nodes;
+    size_t count;
+    size_t capacity;
+} min_heap_t;
+
+/**
+ * Initializes a heap node that is not in any heap.
+ */
+void heap_node_init(heap_node_t *node, void *data)
+{
+    node->key = 0;
+    node->index = HEAP_NOT_QUEUED;
+    node->data = data;
+}
+
+/**
+ * Returns true if the node is in a heap.
+ */
+bool heap_node_queued(const heap_node_t *node)
+{
+    return node->index != HEAP_NOT_QUEUED;
+}
+
+/**
+ * Stores `node` at position `index` of the heap array.
+ */
+static void min_heap_set(min_heap_t *heap, size_t index, heap_node_t *node)
+{
+    heap->nodes[index] = node;
+    node->index = index;
+}
+
+/**
+ * Moves the node at `index` up until its parent is not larger (used after the
+ * key of the node decreases).
+ */
+static void min_heap_sift_up(min_heap_t *heap, size_t index)
+{
+    heap_node_t *node = heap->nodes[index];
+    size_t parent;
+
+    while (index > 0)
+    {
+        parent = (index - 1) / 2;
+        if (heap->nodes[parent]->key <= node->key)
+        {
+            break;
+        }
+        min_heap_set(heap, index, heap->nodes[parent]);
+        index = parent;
+    }
+
+    min_heap_set(heap, index, node);
+}
+
+/**
+ * Moves the node at `index` down until its children are not smaller (used
+ * after the key of the node increases).
+ */
+static void min_heap_sift_down(min_heap_t *heap, size_t index)
+{
+    heap_node_t *node = heap->nodes[index];
+    size_t child;
+
+    while ((child = 2 * index + 1) < heap->count)
+    {
+        if (child + 1 < heap->count
+            && heap->nodes[child + 1]->key < heap->nodes[child]->key)
+        {
+            child++;
+        }
+        if (node->key <= heap->nodes[child]->key)
+        {
+            break;
+        }
+        min_heap_set(heap, index, heap->nodes[child]);
+        index = child;
+    }
+
+    min_heap_set(heap, index, node);
+}
+
+/**
+ * Adds a node that is not in the heap with the given key. O(log n).
+ */
+void min_heap_insert(min_heap_t *heap, heap_node_t *node, int64_t key)
+{
+    if (heap->count == heap->capacity)
+    {
+        heap->capacity = heap->capacity == 0 ? 64 : heap->capacity * 2;
+        heap->nodes = realloc(
+            heap->nodes,
+            heap->capacity * sizeof(*heap->nodes));
+        if (heap->nodes == NULL)
+        {
+            errno_abort("Realloc failed");
+        }
+    }
+
+    node->key = key;
+    min_heap_set(heap, heap->count++, node);
+    min_heap_sift_up(heap, node->index);
+}
+
+/**
+ * Changes the key of a node in the heap and moves it to its new position
+ * (decrease-key or increase-key). O(log n).
+ */
+void min_heap_update(min_heap_t *heap, heap_node_t *node, int64_t key)
+{
+    int64_t old_key = node->key;
+
+    node->key = key;
+    if (key < old_key)
+    {
+        min_heap_sift_up(heap, node->index);
+    }
+    else
+    {
+        min_heap_sift_down(heap, node->index);
+    }
+}
+
+/**
+ * Removes a node from the heap. Does nothing if the node is not in the heap.
+ * O(log n).
+ */
+void min_heap_remove(min_heap_t *heap, heap_node_t *node)
+{
+    size_t index = node->index;
+    heap_node_t *last;
+
+    if (index == HEAP_NOT_QUEUED)
+    {
+        return;
+    }
+
+    node->index = HEAP_NOT_QUEUED;
+    last = heap->nodes[--heap->count];
+    if (last == node)
+    {
+        return;
+    }
+
+    // Fill the hole with the last node, which may need to go either way.
+    min_heap_set(heap, index, last);
+    min_heap_sift_up(heap, index);
+    min_heap_sift_down(heap, last->index);
+}
+
+/**
+ * Returns the node with the smallest key, or NULL if the heap is empty.
+ */
+heap_node_t *min_heap_top(const min_heap_t *heap)
+{
+    return heap->count == 0 ? NULL : heap->nodes[0];
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef __alarm_index_h
+#define __alarm_index_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "errors.h"
+#include "types.h"
+
+/**
+ * The number of slots the index starts with. This must be a power of two.
+ */
+#define ALARM_INDEX_INITIAL_CAPACITY 64
+
+/**
+ * Data type for a hash index of alarms keyed by `alarm_id`.
+ *
+ * The index uses open addressing with linear probing. Each slot holds a
+ * pointer to an alarm (or NULL if the slot is empty), and the key is read
+ * from the alarm itself, so the index adds one pointer per slot next to the
+ * alarm list. Removal shifts the following entries back instead of leaving
+ * tombstones, so lookups never slow down after many removals.
+ *
+ *   - `slots` is the table of alarm pointers.
+ *   - `capacity` is the number of slots (always a power of two).
+ *   - `count` is the number of alarms in the index.
+ *
+ * The index is not thread safe. It is kept next to the alarm list and is
+ * protected by the same mutex.
+ */
+typedef struct alarm_index_t
+{
+    alarm_t **slots;
+    size_t capacity;
+    size_t count;
+} alarm_index_t;
+
+/**
+ * Returns the home slot of `alarm_id` (Fibonacci hashing, so that sequential
+ * IDs are spread over the table).
+ */
+static size_t alarm_index_home(const alarm_index_t *index, int alarm_id)
+{
+    return ((uint32_t)alarm_id * 2654435769u) & (index->capacity - 1);
+}
+
+/**
+ * Returns the slot that holds `alarm_id`, or the empty slot where it would be
+ * inserted.
+ */
+static size_t alarm_index_probe(const alarm_index_t *index, int alarm_id)
+{
+    size_t slot = alarm_index_home(index, alarm_id);
+
+    while (index->slots[slot] != NULL
+           && index->slots[slot]->alarm_id != alarm_id)
+    {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+
+    return slot;
+}
+
+/**
+ * Replaces the table of `index` with an empty one of `capacity` slots and
+ * reinserts every alarm.
+ */
+static void alarm_index_resize(alarm_index_t *index, size_t capacity)
+{
+    alarm_t **old_slots = index->slots;
+    size_t old_capacity = index->capacity;
+
+    index->slots = calloc(capacity, sizeof(alarm_t *));
+    if (index->slots == NULL)
+    {
+        errno_abort("Calloc failed");
+    }
+    index->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i] != NULL)
+        {
+            index->slots[alarm_index_probe(index, old_slots[i]->alarm_id)] =
+                old_slots[i];
+        }
+    }
+
+    free(old_slots);
+}
+
+/**
+ * Finds the alarm with the given ID in the index. Returns NULL if there is no
+ * such alarm.
+ */
+alarm_t *alarm_index_find(const alarm_index_t *index, int alarm_id)
+{
+    if (index->count == 0)
+    {
+        return NULL;
+    }
+
+    return index->slots[alarm_index_probe(index, alarm_id)];
+}
+
+/**
+ * Adds an alarm to the index. Returns false (and does not add the alarm) if
+ * an alarm with the same ID is already in the index.
+ *
+ * The table is grown when it becomes more than half full.
+ */
+bool alarm_index_insert(alarm_index_t *index, alarm_t *alarm)
+{
+    size_t slot;
+
+    if (index->slots == NULL)
+    {
+        alarm_index_resize(index, ALARM_INDEX_INITIAL_CAPACITY);
+    }
+    else if ((index->count + 1) * 2 > index->capacity)
+    {
+        alarm_index_resize(index, index->capacity * 2);
+    }
+
+    slot = alarm_index_probe(index, alarm->alarm_id);
+    if (index->slots[slot] != NULL)
+    {
+        return false;
+    }
+
+    index->slots[slot] = alarm;
+    index->count++;
+    return true;
+}
+
+/**
+ * Removes the alarm with the given ID from the index and returns it. Returns
+ * NULL if there is no such alarm.
+ *
+ * The entries after the removed one in the same probe run are shifted back,
+ * so that every remaining entry can still be reached from its home slot.
+ */
+alarm_t *alarm_index_remove(alarm_index_t *index, int alarm_id)
+{
+    size_t mask;
+    size_t hole;
+    size_t slot;
+    size_t home;
+    alarm_t *alarm;
+
+    if (index->count == 0)
+    {
+        return NULL;
+    }
+
+    mask = index->capacity - 1;
+    hole = alarm_index_probe(index, alarm_id);
+    alarm = index->slots[hole];
+    if (alarm == NULL)
+    {
+        return NULL;
+    }
+
+    slot = hole;
+    while (1)
+    {
+        slot = (slot + 1) & mask;
+        if (index->slots[slot] == NULL)
+        {
+            break;
+        }
+
+        // An entry can fill the hole if its home slot is not between the
+        // hole and its current slot (going around the table).
+        home = alarm_index_home(index, index->slots[slot]->alarm_id);
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            index->slots[hole] = index->slots[slot];
+            hole = slot;
+        }
+    }
+
+    index->slots[hole] = NULL;
+    index->count--;
+    return alarm;
+}
+
+#endif
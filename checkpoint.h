@@ -0,0 +1,404 @@
+#ifndef __checkpoint_h
+#define __checkpoint_h
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "clock.h"
+#include "errors.h"
+#include "journal.h"
+
+/**
+ * The first bytes of every checkpoint file, and the version of the format
+ * described below. A file with another version is refused.
+ */
+#define CHECKPOINT_MAGIC "ALRMCKPT"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * The header at the start of a checkpoint file.
+ *
+ * The rest of the file holds one section per field of the alarms, each an
+ * array of `count` fixed-width values (alarm `i` is at index `i` of every
+ * array), and a string section with the messages. Every section starts at
+ * a multiple of 8 bytes, so the arrays can be used in place once the file
+ * is mapped into memory.
+ *
+ *   - `size` is the size of the whole file, so that a short file is
+ *     recognized.
+ *   - `written_at` is the wall clock time the checkpoint was taken at (in
+ *     nanoseconds since the epoch).
+ *   - `count` is the number of alarms, in increasing order of alarm ID.
+ *   - The `*_offset` fields are the offsets of the sections from the start
+ *     of the file.
+ *
+ * The sections are:
+ *
+ *   - `alarm_id` (int32_t), `status` and `change_status` (uint8_t).
+ *   - `expiration` (int64_t), the wall clock time an active alarm expires
+ *     at, and `time_left` (int64_t), the nanoseconds a suspended alarm has
+ *     left.
+ *   - `time` (int32_t), `unit` (uint8_t) and `creation_time` (int64_t).
+ *   - `message` (uint32_t), the offset of each message in the string
+ *     section. There is one more offset than there are alarms, so that
+ *     message `i` ends where message `i + 1` starts.
+ *   - `strings`, the messages, one after the other, without terminating
+ *     null characters.
+ */
+typedef struct checkpoint_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    int64_t written_at;
+    uint64_t count;
+    uint64_t alarm_id_offset;
+    uint64_t status_offset;
+    uint64_t change_status_offset;
+    uint64_t expiration_offset;
+    uint64_t time_left_offset;
+    uint64_t time_offset;
+    uint64_t unit_offset;
+    uint64_t creation_time_offset;
+    uint64_t message_offset;
+    uint64_t strings_offset;
+} checkpoint_header_t;
+
+/**
+ * Data type for a checkpoint, either being built in memory or mapped from a
+ * file. The pointers point into `base`, at the sections described by the
+ * header.
+ */
+typedef struct checkpoint_t
+{
+    char *base;
+    checkpoint_header_t *header;
+    int32_t *alarm_id;
+    uint8_t *status;
+    uint8_t *change_status;
+    int64_t *expiration;
+    int64_t *time_left;
+    int32_t *time;
+    uint8_t *unit;
+    int64_t *creation_time;
+    uint32_t *message;
+    char *strings;
+    bool mapped;
+} checkpoint_t;
+
+/**
+ * Returns true if a section of `count` values of `width` bytes at `offset`
+ * starts at a multiple of 8 bytes after the header and ends within the file.
+ */
+static bool checkpoint_section_valid(
+    const checkpoint_header_t *header,
+    uint64_t offset,
+    uint64_t count,
+    uint64_t width)
+{
+    return offset % 8 == 0
+        && offset >= header->header_size
+        && offset <= header->size
+        && count <= (header->size - offset) / width;
+}
+
+/**
+ * Returns true if every section of a mapped checkpoint (whose header has
+ * been checked) is within the file, the message offsets only increase and
+ * stay within the string section, and every unit is a known one, so that
+ * the alarms can be read without checking each access.
+ */
+static bool checkpoint_valid(const checkpoint_t *checkpoint)
+{
+    const checkpoint_header_t *header = checkpoint->header;
+    uint64_t count = header->count;
+    const uint32_t *message;
+    const uint8_t *unit;
+    uint64_t strings_size;
+
+    if (count == UINT64_MAX
+        || !checkpoint_section_valid(
+            header, header->alarm_id_offset, count, sizeof(int32_t))
+        || !checkpoint_section_valid(
+            header, header->status_offset, count, sizeof(uint8_t))
+        || !checkpoint_section_valid(
+            header, header->change_status_offset, count, sizeof(uint8_t))
+        || !checkpoint_section_valid(
+            header, header->expiration_offset, count, sizeof(int64_t))
+        || !checkpoint_section_valid(
+            header, header->time_left_offset, count, sizeof(int64_t))
+        || !checkpoint_section_valid(
+            header, header->time_offset, count, sizeof(int32_t))
+        || !checkpoint_section_valid(
+            header, header->unit_offset, count, sizeof(uint8_t))
+        || !checkpoint_section_valid(
+            header, header->creation_time_offset, count, sizeof(int64_t))
+        || !checkpoint_section_valid(
+            header, header->message_offset, count + 1, sizeof(uint32_t))
+        || header->strings_offset < header->header_size
+        || header->strings_offset > header->size)
+    {
+        return false;
+    }
+
+    message = (const uint32_t *)(checkpoint->base + header->message_offset);
+    unit = (const uint8_t *)(checkpoint->base + header->unit_offset);
+    strings_size = header->size - header->strings_offset;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (message[i] > message[i + 1] || unit[i] > UNIT_NANOSECONDS)
+        {
+            return false;
+        }
+    }
+    return message[count] <= strings_size;
+}
+
+/**
+ * Rounds a size up to a multiple of 8 bytes.
+ */
+static uint64_t checkpoint_align(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+/**
+ * Points the sections of a checkpoint at the offsets in its header.
+ */
+static void checkpoint_point(checkpoint_t *checkpoint)
+{
+    checkpoint_header_t *header = checkpoint->header;
+    char *base = checkpoint->base;
+
+    checkpoint->alarm_id = (int32_t *)(base + header->alarm_id_offset);
+    checkpoint->status = (uint8_t *)(base + header->status_offset);
+    checkpoint->change_status =
+        (uint8_t *)(base + header->change_status_offset);
+    checkpoint->expiration = (int64_t *)(base + header->expiration_offset);
+    checkpoint->time_left = (int64_t *)(base + header->time_left_offset);
+    checkpoint->time = (int32_t *)(base + header->time_offset);
+    checkpoint->unit = (uint8_t *)(base + header->unit_offset);
+    checkpoint->creation_time =
+        (int64_t *)(base + header->creation_time_offset);
+    checkpoint->message = (uint32_t *)(base + header->message_offset);
+    checkpoint->strings = base + header->strings_offset;
+}
+
+/**
+ * Allocates a checkpoint for `count` alarms whose messages are
+ * `strings_size` characters long in all. The caller fills in the sections
+ * (and `message[count]`, the end of the last message).
+ */
+void checkpoint_create(
+    checkpoint_t *checkpoint,
+    uint64_t count,
+    uint64_t strings_size)
+{
+    checkpoint_header_t header;
+    uint64_t size;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.header_size = sizeof(header);
+    header.written_at = clock_wall_now();
+    header.count = count;
+
+    size = checkpoint_align(sizeof(header));
+    header.alarm_id_offset = size;
+    size = checkpoint_align(size + count * sizeof(int32_t));
+    header.status_offset = size;
+    size = checkpoint_align(size + count * sizeof(uint8_t));
+    header.change_status_offset = size;
+    size = checkpoint_align(size + count * sizeof(uint8_t));
+    header.expiration_offset = size;
+    size = checkpoint_align(size + count * sizeof(int64_t));
+    header.time_left_offset = size;
+    size = checkpoint_align(size + count * sizeof(int64_t));
+    header.time_offset = size;
+    size = checkpoint_align(size + count * sizeof(int32_t));
+    header.unit_offset = size;
+    size = checkpoint_align(size + count * sizeof(uint8_t));
+    header.creation_time_offset = size;
+    size = checkpoint_align(size + count * sizeof(int64_t));
+    header.message_offset = size;
+    size = checkpoint_align(size + (count + 1) * sizeof(uint32_t));
+    header.strings_offset = size;
+    size += strings_size;
+    header.size = size;
+
+    checkpoint->base = calloc(1, size);
+    if (checkpoint->base == NULL)
+    {
+        errno_abort("Calloc failed");
+    }
+    checkpoint->header = (checkpoint_header_t *)checkpoint->base;
+    *checkpoint->header = header;
+    checkpoint->mapped = false;
+    checkpoint_point(checkpoint);
+}
+
+/**
+ * Writes a checkpoint to `path` atomically: it is written to a temporary
+ * file, synced, and renamed over the old checkpoint, so a crash leaves
+ * either the old checkpoint or the new one, never a mix.
+ */
+void checkpoint_write(checkpoint_t *checkpoint, const char *path)
+{
+    char *temporary;
+    int fd;
+
+    temporary = malloc(strlen(path) + sizeof(".tmp"));
+    if (temporary == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    strcpy(temporary, path);
+    strcat(temporary, ".tmp");
+
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        errno_abort("Open checkpoint");
+    }
+    journal_write_all(fd, checkpoint->base, checkpoint->header->size);
+    if (fdatasync(fd) != 0)
+    {
+        errno_abort("Sync checkpoint");
+    }
+    close(fd);
+
+    if (rename(temporary, path) != 0)
+    {
+        errno_abort("Rename checkpoint");
+    }
+    sync_directory(path);
+    free(temporary);
+}
+
+/**
+ * Maps the checkpoint at `path` into memory. Nothing is read or allocated
+ * per alarm: the header is checked, and the sections are used where they
+ * are. Returns false if there is no checkpoint file.
+ *
+ * A file that is not a checkpoint of this version (or is shorter than its
+ * header says, or has a section or message outside of it) ends the program,
+ * rather than starting without its alarms.
+ */
+bool checkpoint_map(checkpoint_t *checkpoint, const char *path)
+{
+    checkpoint_header_t *header;
+    struct stat stat;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return false;
+        }
+        errno_abort("Open checkpoint");
+    }
+    if (fstat(fd, &stat) != 0)
+    {
+        errno_abort("Stat checkpoint");
+    }
+    if ((size_t)stat.st_size < sizeof(checkpoint_header_t))
+    {
+        fprintf(stderr, "Checkpoint %s is too short\n", path);
+        exit(1);
+    }
+
+    checkpoint->base = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (checkpoint->base == MAP_FAILED)
+    {
+        errno_abort("Map checkpoint");
+    }
+    close(fd);
+
+    header = (checkpoint_header_t *)checkpoint->base;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHECKPOINT_VERSION
+        || header->header_size != sizeof(checkpoint_header_t)
+        || header->size != (uint64_t)stat.st_size)
+    {
+        fprintf(
+            stderr,
+            "Checkpoint %s is damaged or of another version\n",
+            path);
+        exit(1);
+    }
+
+    checkpoint->header = header;
+    checkpoint->mapped = true;
+    if (!checkpoint_valid(checkpoint))
+    {
+        fprintf(stderr, "Checkpoint %s is damaged\n", path);
+        exit(1);
+    }
+    checkpoint_point(checkpoint);
+
+    // The alarms are read once, in order.
+    madvise(checkpoint->base, header->size, MADV_SEQUENTIAL);
+    return true;
+}
+
+/**
+ * Frees (or unmaps) a checkpoint.
+ */
+void checkpoint_free(checkpoint_t *checkpoint)
+{
+    if (checkpoint->mapped)
+    {
+        munmap(checkpoint->base, checkpoint->header->size);
+    }
+    else
+    {
+        free(checkpoint->base);
+    }
+}
+
+/**
+ * Fills in a journal entry from alarm `i` of a checkpoint, so that it can be
+ * restored like the last record of an alarm in the journal.
+ */
+void checkpoint_entry(
+    const checkpoint_t *checkpoint,
+    uint64_t i,
+    journal_entry_t *entry)
+{
+    journal_record_t *record = &entry->record;
+    uint32_t length = checkpoint->message[i + 1] - checkpoint->message[i];
+
+    if (length >= sizeof(entry->message))
+    {
+        length = sizeof(entry->message) - 1;
+    }
+
+    record->type = Start_Alarm;
+    record->unit = checkpoint->unit[i];
+    record->status = (checkpoint->status[i] ? JOURNAL_ACTIVE : 0)
+        | (checkpoint->change_status[i] ? JOURNAL_CHANGED : 0);
+    record->length = length;
+    record->alarm_id = checkpoint->alarm_id[i];
+    record->time = checkpoint->time[i];
+    record->creation_time = checkpoint->creation_time[i];
+    record->deadline = checkpoint->status[i]
+        ? checkpoint->expiration[i]
+        : checkpoint->time_left[i];
+    memcpy(
+        entry->message,
+        checkpoint->strings + checkpoint->message[i],
+        length);
+    entry->message[length] = 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef __clock_h
+#define __clock_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+
+/**
+ * Number of nanoseconds in a second and in a millisecond.
+ */
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+/**
+ * The units that an alarm time can be given in. A time without a unit is in
+ * seconds.
+ */
+typedef enum time_unit
+{
+    UNIT_SECONDS,
+    UNIT_MILLISECONDS,
+    UNIT_MICROSECONDS,
+    UNIT_NANOSECONDS
+} time_unit;
+
+/**
+ * The suffix that is printed after a time in each unit (seconds are printed
+ * without a suffix, as they always were), and the length of each unit in
+ * nanoseconds.
+ */
+static const char *const time_unit_suffixes[] = {"", "ms", "us", "ns"};
+static const int64_t time_unit_nsec[] = {NSEC_PER_SEC, 1000000, 1000, 1};
+
+/**
+ * Returns the length of `time` units in nanoseconds.
+ */
+int64_t duration_nsec(int time, time_unit unit)
+{
+    return time * time_unit_nsec[unit];
+}
+
+/**
+ * Whether the program runs on a virtual clock, and the time of that clock
+ * in nanoseconds.
+ *
+ * The virtual clock starts at 0 and only moves when it is set with
+ * clock_virtual_set() (by the Wait command, which jumps from one deadline to
+ * the next), so a scenario that spans hours runs as fast as its deadlines
+ * can be fired, and prints the same times on every run. It is both the
+ * monotonic clock and the wall clock of the program.
+ */
+bool clock_virtual = false;
+int64_t clock_virtual_time = 0;
+
+/**
+ * Returns the current time of the real monotonic clock in nanoseconds, even
+ * on a virtual clock. Used to measure how long the program itself takes
+ * (lock hold times, batch throughput, journal syncs).
+ */
+int64_t clock_monotonic()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/**
+ * Returns the current time of the monotonic clock in nanoseconds (or of the
+ * virtual clock). Alarm deadlines are kept on this clock, so they do not
+ * move when the wall clock is set (for example, by NTP).
+ */
+int64_t clock_now()
+{
+    if (clock_virtual)
+    {
+        return __atomic_load_n(&clock_virtual_time, __ATOMIC_ACQUIRE);
+    }
+    return clock_monotonic();
+}
+
+/**
+ * Returns the current time of the wall clock in nanoseconds since the epoch
+ * (or of the virtual clock). Only used for times that must survive a
+ * restart of the program.
+ */
+int64_t clock_wall_now()
+{
+    struct timespec t;
+
+    if (clock_virtual)
+    {
+        return __atomic_load_n(&clock_virtual_time, __ATOMIC_ACQUIRE);
+    }
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/**
+ * Returns the current time of the wall clock in seconds since the epoch (or
+ * of the virtual clock), as printed with every output line.
+ */
+time_t clock_time()
+{
+    return clock_wall_now() / NSEC_PER_SEC;
+}
+
+/**
+ * Sets the virtual clock. It never goes back.
+ */
+void clock_virtual_set(int64_t now)
+{
+    if (now > clock_virtual_time)
+    {
+        __atomic_store_n(&clock_virtual_time, now, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Converts a time of the monotonic clock in nanoseconds to a timespec, for
+ * pthread_cond_timedwait() on a condition variable made by clock_cond_init().
+ */
+void clock_timespec(int64_t nsec, struct timespec *t)
+{
+    t->tv_sec = nsec / NSEC_PER_SEC;
+    t->tv_nsec = nsec % NSEC_PER_SEC;
+}
+
+/**
+ * Initializes a condition variable whose timed waits use the monotonic
+ * clock.
+ */
+void clock_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int status;
+
+    pthread_condattr_init(&attr);
+    status = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (status != 0)
+    {
+        err_abort(status, "Set condition variable clock");
+    }
+    status = pthread_cond_init(cond, &attr);
+    if (status != 0)
+    {
+        err_abort(status, "Init condition variable");
+    }
+    pthread_condattr_destroy(&attr);
+}
+
+#endif
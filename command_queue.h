@@ -0,0 +1,265 @@
+#ifndef __command_queue_h
+#define __command_queue_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "errors.h"
+#include "types.h"
+
+/**
+ * Number of commands that fit in the command queue (a power of two).
+ */
+#define COMMAND_QUEUE_SLOTS 8192
+
+/**
+ * A command in the command queue.
+ *
+ *   - `seq` says whose turn it is to use the slot. A slot at position `n`
+ *     of the queue may be filled by a producer when `seq` is `n`, and holds
+ *     a command for the consumer when `seq` is `n + 1`. The consumer sets it
+ *     to `n + COMMAND_QUEUE_SLOTS` when it has taken the command, handing the
+ *     slot to the producer of the next lap.
+ *   - `parsed` is false if the line that was read was not a valid command.
+ *     Such lines are queued as well, so that "Bad command" is printed in
+ *     the same order as the output of the commands around it.
+ */
+typedef struct command_slot_t
+{
+    uint64_t seq;
+    bool parsed;
+    command_t command;
+} command_slot_t;
+
+/**
+ * Data type for a queue of commands with any number of producers (the
+ * threads reading commands) and a single consumer (the thread applying them
+ * to the alarm list). Adding and taking commands takes no lock; the mutex
+ * is only used to sleep when the queue is empty or full.
+ *
+ *   - `tail` is the position of the next slot to fill. Producers claim a
+ *     slot by advancing it with a compare and swap.
+ *   - `head` is the position of the next slot to take. Only the consumer
+ *     uses it.
+ *   - `consumer_idle` is set while the consumer waits on `not_empty`, and
+ *     `waiting_producers` counts the producers waiting on `not_full`. Both
+ *     are read and written with atomic operations, so that nobody locks the
+ *     mutex unless someone is asleep.
+ *   - `slots` are the preallocated commands. Nothing is allocated per
+ *     command.
+ */
+typedef struct command_queue_t
+{
+    uint64_t tail;
+    uint64_t head;
+    int consumer_idle;
+    int waiting_producers;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    command_slot_t slots[COMMAND_QUEUE_SLOTS];
+} command_queue_t;
+
+/**
+ * Initializes an empty command queue.
+ */
+void command_queue_init(command_queue_t *queue)
+{
+    int status;
+
+    queue->tail = 0;
+    queue->head = 0;
+    queue->consumer_idle = 0;
+    queue->waiting_producers = 0;
+    for (uint64_t i = 0; i < COMMAND_QUEUE_SLOTS; i++)
+    {
+        queue->slots[i].seq = i;
+    }
+
+    status = pthread_mutex_init(&queue->mutex, NULL);
+    if (status != 0)
+    {
+        err_abort(status, "Init mutex");
+    }
+    status = pthread_cond_init(&queue->not_empty, NULL);
+    if (status != 0)
+    {
+        err_abort(status, "Init condition variable");
+    }
+    status = pthread_cond_init(&queue->not_full, NULL);
+    if (status != 0)
+    {
+        err_abort(status, "Init condition variable");
+    }
+}
+
+/**
+ * Claims the next free slot of the queue for the calling producer. Returns
+ * NULL if the queue is full.
+ */
+static command_slot_t *command_queue_claim(command_queue_t *queue)
+{
+    command_slot_t *slot;
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    uint64_t seq;
+
+    while (1)
+    {
+        slot = &queue->slots[tail & (COMMAND_QUEUE_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == tail)
+        {
+            // The slot is free; try to take it before another producer does.
+            if (__atomic_compare_exchange_n(
+                    &queue->tail, &tail, tail + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return slot;
+            }
+        }
+        else if ((int64_t)(seq - tail) < 0)
+        {
+            // The slot still holds a command from the previous lap.
+            return NULL;
+        }
+        else
+        {
+            // Another producer took the slot first.
+            tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Copies a command into the queue (with `parsed` false for a line that was
+ * not a valid command) and wakes up the consumer if it is asleep. If the
+ * queue is full, the caller waits until the consumer takes commands out, so
+ * commands are never lost.
+ *
+ * Commands added by one producer are taken in the order they were added.
+ * Safe to call from any number of threads at once.
+ */
+void command_queue_push(
+    command_queue_t *queue,
+    const command_t *command,
+    bool parsed)
+{
+    command_slot_t *slot;
+    uint64_t position;
+
+    while ((slot = command_queue_claim(queue)) == NULL)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        __atomic_add_fetch(&queue->waiting_producers, 1, __ATOMIC_SEQ_CST);
+        if ((slot = command_queue_claim(queue)) == NULL)
+        {
+            pthread_cond_wait(&queue->not_full, &queue->mutex);
+        }
+        __atomic_sub_fetch(&queue->waiting_producers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->mutex);
+        if (slot != NULL)
+        {
+            break;
+        }
+    }
+
+    // The slot is ours until its sequence number says otherwise.
+    position = slot->seq;
+    slot->parsed = parsed;
+    if (parsed)
+    {
+        slot->command = *command;
+    }
+    __atomic_store_n(&slot->seq, position + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->consumer_idle, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+}
+
+/**
+ * Takes up to `max` commands from the front of the queue, without waiting,
+ * and returns how many were taken. Only the consumer may call this.
+ *
+ * A producer that has claimed a slot but not filled it yet stops the take
+ * at that slot; its command is taken by the next call.
+ */
+int command_queue_take(
+    command_queue_t *queue,
+    command_t commands[],
+    bool parsed[],
+    int max)
+{
+    command_slot_t *slot;
+    int count = 0;
+
+    while (count < max)
+    {
+        slot = &queue->slots[queue->head & (COMMAND_QUEUE_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue->head + 1)
+        {
+            break;
+        }
+
+        parsed[count] = slot->parsed;
+        if (slot->parsed)
+        {
+            commands[count] = slot->command;
+        }
+        count++;
+
+        __atomic_store_n(
+            &slot->seq,
+            queue->head + COMMAND_QUEUE_SLOTS,
+            __ATOMIC_SEQ_CST);
+        queue->head++;
+    }
+
+    if (count > 0
+        && __atomic_load_n(&queue->waiting_producers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return count;
+}
+
+/**
+ * Takes up to `max` commands from the front of the queue like
+ * command_queue_take(), but waits for at least one command if the queue is
+ * empty. Only the consumer may call this.
+ */
+int command_queue_wait(
+    command_queue_t *queue,
+    command_t commands[],
+    bool parsed[],
+    int max)
+{
+    command_slot_t *slot;
+    int count;
+
+    while ((count = command_queue_take(queue, commands, parsed, max)) == 0)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        __atomic_store_n(&queue->consumer_idle, 1, __ATOMIC_SEQ_CST);
+
+        // A producer that filled the slot before seeing the flag did not
+        // signal, so look again before sleeping.
+        slot = &queue->slots[queue->head & (COMMAND_QUEUE_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != queue->head + 1)
+        {
+            pthread_cond_wait(&queue->not_empty, &queue->mutex);
+        }
+        __atomic_store_n(&queue->consumer_idle, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return count;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef __histogram_h
+#define __histogram_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Shape of a histogram: values below HISTOGRAM_SUB_BUCKETS have a bucket
+ * each, and every power of two above that is split into
+ * HISTOGRAM_SUB_BUCKETS buckets of equal width, so every bucket is within
+ * 1/16 (about 6%) of the values it holds, like an HDR histogram with one
+ * significant digit. Values of 2^(HISTOGRAM_MAX_EXPONENT + 1) and above
+ * (about 34 seconds, in nanoseconds) fall in the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 34
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Data type for a histogram of non-negative values (nanoseconds).
+ *
+ *   - `count` is the number of values recorded.
+ *   - `max` is the largest value recorded, exactly.
+ *   - `buckets` count the values in each bucket.
+ */
+typedef struct histogram_t
+{
+    uint64_t count;
+    int64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/**
+ * Returns the bucket that holds a value.
+ */
+static int histogram_bucket(int64_t value)
+{
+    int exponent;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return value < 0 ? 0 : (int)value;
+    }
+    exponent = 63 - __builtin_clzll((uint64_t)value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + (int)((value >> (exponent - HISTOGRAM_SUB_BITS))
+                & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the largest value that falls in a bucket.
+ */
+static int64_t histogram_bucket_limit(int bucket)
+{
+    int shift;
+    int64_t lowest;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    lowest = (int64_t)(HISTOGRAM_SUB_BUCKETS
+                       + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((int64_t)1 << shift) - 1;
+}
+
+/**
+ * Records a value (negative values are recorded as 0).
+ */
+void histogram_record(histogram_t *histogram, int64_t value)
+{
+    if (value < 0)
+    {
+        value = 0;
+    }
+    histogram->buckets[histogram_bucket(value)]++;
+    histogram->count++;
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/**
+ * Adds the values of `source` to `target`.
+ */
+void histogram_merge(histogram_t *target, const histogram_t *source)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        target->buckets[i] += source->buckets[i];
+    }
+    target->count += source->count;
+    if (source->max > target->max)
+    {
+        target->max = source->max;
+    }
+}
+
+/**
+ * Returns the value at `percentile` (between 0 and 100): the largest value
+ * of the bucket that holds it, but never more than the largest value
+ * recorded. Returns 0 for an empty histogram.
+ */
+int64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    int64_t limit;
+
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Formats the number of values, p50, p99, p99.9 and the maximum of a
+ * histogram of nanoseconds (shown in milliseconds) into `buffer`.
+ */
+void histogram_format(
+    const histogram_t *histogram,
+    const char *name,
+    char *buffer,
+    size_t size)
+{
+    snprintf(
+        buffer,
+        size,
+        "%s: %llu samples, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, "
+        "max %.3f ms",
+        name,
+        (unsigned long long)histogram->count,
+        histogram_percentile(histogram, 50) / 1e6,
+        histogram_percentile(histogram, 99) / 1e6,
+        histogram_percentile(histogram, 99.9) / 1e6,
+        histogram->max / 1e6);
+}
+
+#endif
@@ -0,0 +1,663 @@
+#ifndef __journal_h
+#define __journal_h
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "clock.h"
+#include "errors.h"
+#include "types.h"
+
+/**
+ * Size of the blocks that the journal is read in when it is replayed, and
+ * the number of bytes waiting to be written after which the journal thread
+ * is woken up before its interval is over.
+ */
+#define JOURNAL_READ_SIZE (1 << 20)
+#define JOURNAL_FLUSH_SIZE (1 << 20)
+
+/**
+ * Flags of the `status` of a journal record.
+ */
+#define JOURNAL_ACTIVE 1
+#define JOURNAL_CHANGED 2
+
+/**
+ * A record of the journal, as it is written to the file. It is followed by
+ * the `length` characters of the alarm's message (without a terminating
+ * null character).
+ *
+ * A record holds the state of the alarm after the command that it records,
+ * so that replaying the journal only has to keep the last record of each
+ * alarm.
+ *
+ *   - `checksum` is the checksum of the rest of the record and of the
+ *     message, so that a record that was only partly written when the
+ *     program stopped is recognized.
+ *   - `type` is the command (Start_Alarm, Change_Alarm, Cancel_Alarm,
+ *     Suspend_Alarm or Reactivate_Alarm).
+ *   - `unit`, `alarm_id`, `time` and `creation_time` are copied from the
+ *     alarm.
+ *   - `status` holds JOURNAL_ACTIVE if the alarm is active (not suspended),
+ *     and JOURNAL_CHANGED if its message has changed since it was last
+ *     printed, so that a restored alarm keeps its change status.
+ *   - `deadline` is the wall clock time (in nanoseconds since the epoch)
+ *     that an active alarm expires at, or the time that a suspended alarm
+ *     has left (in nanoseconds). The monotonic clock does not survive a
+ *     restart, so the wall clock is used here.
+ */
+typedef struct journal_record_t
+{
+    uint32_t checksum;
+    uint8_t type;
+    uint8_t unit;
+    uint8_t status;
+    uint8_t length;
+    int32_t alarm_id;
+    int32_t time;
+    int64_t creation_time;
+    int64_t deadline;
+} journal_record_t;
+
+/**
+ * Data type for the journal.
+ *
+ *   - `path` is the name of the journal file, and `next_path` is the name
+ *     of the file that a checkpoint starts for the records after it.
+ *   - `fd` is the journal file (or the next file, during a checkpoint),
+ *     opened for appending.
+ *   - `next_fd` is the next file started by journal_rotate() while the
+ *     records before it have not been written yet (or -1), and `rotate_at`
+ *     is the length of the buffer that goes to `fd` before switching.
+ *   - `mutex` protects `buffer`, `length`, `capacity`, `appended`,
+ *     `next_fd` and `rotate_at`.
+ *   - `buffer` holds the records that have been appended and not written
+ *     yet, and `length` is the number of bytes in it.
+ *   - `cond` wakes up the journal thread early when the buffer is large.
+ *   - `interval` is the time (in nanoseconds) between two group commits.
+ *   - `flush_mutex` is held while records are written and synced, so that
+ *     the journal thread and journal_flush() do not write at the same time.
+ *   - `appended` and `synced` count the records appended so far and the
+ *     records known to be on disk.
+ */
+typedef struct journal_t
+{
+    const char *path;
+    char *next_path;
+    int fd;
+    int next_fd;
+    size_t rotate_at;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    int64_t interval;
+    pthread_mutex_t flush_mutex;
+    uint64_t appended;
+    uint64_t synced;
+} journal_t;
+
+/**
+ * The last record of an alarm found while replaying, and its message.
+ */
+typedef struct journal_entry_t
+{
+    journal_record_t record;
+    char message[128];
+} journal_entry_t;
+
+/**
+ * Returns the checksum of a record and its message (FNV-1a, over everything
+ * after the checksum field).
+ */
+uint32_t journal_checksum(const journal_record_t *record, const char *message)
+{
+    const unsigned char *bytes = (const unsigned char *)record;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = sizeof(record->checksum); i < sizeof(*record); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < record->length; i++)
+    {
+        hash = (hash ^ (unsigned char)message[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Syncs the directory that holds `path`, so that a file created or renamed
+ * in it is still there after a crash.
+ */
+void sync_directory(const char *path)
+{
+    char *copy = strdup(path);
+    int fd;
+
+    if (copy == NULL)
+    {
+        errno_abort("Strdup failed");
+    }
+    fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0)
+    {
+        errno_abort("Sync directory");
+    }
+    close(fd);
+    free(copy);
+}
+
+/**
+ * Writes all of `length` bytes of `buffer` to `fd`.
+ */
+void journal_write_all(int fd, const char *buffer, size_t length)
+{
+    size_t written = 0;
+    ssize_t bytes;
+
+    while (written < length)
+    {
+        bytes = write(fd, buffer + written, length - written);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            errno_abort("Write journal");
+        }
+        written += bytes;
+    }
+}
+
+/**
+ * Opens (or creates) the journal file at `path`, with records synced to disk
+ * every `interval` nanoseconds.
+ *
+ * If the program stopped during a checkpoint, the records after the
+ * checkpoint are still in the next file. They are moved to the end of the
+ * journal, after the records they follow.
+ */
+void journal_open(journal_t *journal, const char *path, int64_t interval)
+{
+    char *buffer;
+    ssize_t bytes;
+    int next;
+
+    journal->path = path;
+    journal->next_path = malloc(strlen(path) + sizeof(".next"));
+    if (journal->next_path == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    strcpy(journal->next_path, path);
+    strcat(journal->next_path, ".next");
+
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal->fd < 0)
+    {
+        errno_abort("Open journal");
+    }
+
+    next = open(journal->next_path, O_RDONLY);
+    if (next >= 0)
+    {
+        buffer = malloc(JOURNAL_READ_SIZE);
+        if (buffer == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        while ((bytes = read(next, buffer, JOURNAL_READ_SIZE)) != 0)
+        {
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                errno_abort("Read next journal");
+            }
+            journal_write_all(journal->fd, buffer, bytes);
+        }
+        if (fdatasync(journal->fd) != 0)
+        {
+            errno_abort("Sync journal");
+        }
+        close(next);
+        unlink(journal->next_path);
+        free(buffer);
+    }
+
+    pthread_mutex_init(&journal->mutex, NULL);
+    clock_cond_init(&journal->cond);
+    pthread_mutex_init(&journal->flush_mutex, NULL);
+    journal->next_fd = -1;
+    journal->rotate_at = 0;
+    journal->buffer = NULL;
+    journal->length = 0;
+    journal->capacity = 0;
+    journal->interval = interval;
+    journal->appended = 0;
+    journal->synced = 0;
+}
+
+/**
+ * Adds a record to the journal. It is written and synced to disk by the next
+ * group commit, together with every other record appended before it.
+ *
+ * `record->length` must be set; the checksum is filled in here.
+ */
+void journal_append(
+    journal_t *journal,
+    journal_record_t *record,
+    const char *message)
+{
+    size_t size = sizeof(journal_record_t) + record->length;
+
+    record->checksum = journal_checksum(record, message);
+
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->length + size > journal->capacity)
+    {
+        journal->capacity = journal->capacity == 0
+            ? JOURNAL_FLUSH_SIZE
+            : journal->capacity * 2;
+        journal->buffer = realloc(journal->buffer, journal->capacity);
+        if (journal->buffer == NULL)
+        {
+            errno_abort("Realloc failed");
+        }
+    }
+    memcpy(journal->buffer + journal->length, record, sizeof(journal_record_t));
+    memcpy(
+        journal->buffer + journal->length + sizeof(journal_record_t),
+        message,
+        record->length);
+    journal->length += size;
+    journal->appended++;
+    if (journal->length >= JOURNAL_FLUSH_SIZE
+        && journal->length - size < JOURNAL_FLUSH_SIZE)
+    {
+        pthread_cond_signal(&journal->cond);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * Writes every record appended so far and syncs them to disk (a group
+ * commit). The buffer is swapped for an empty one, so appending goes on
+ * while the records are written.
+ *
+ * After journal_rotate(), the records appended before it are written and
+ * synced to the current file first, and the rest go to the next file,
+ * which becomes the current one.
+ */
+void journal_flush(journal_t *journal)
+{
+    static char *spare = NULL;
+    static size_t spare_capacity = 0;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    uint64_t appended;
+    size_t split;
+    int next_fd;
+
+    pthread_mutex_lock(&journal->flush_mutex);
+
+    pthread_mutex_lock(&journal->mutex);
+    buffer = journal->buffer;
+    length = journal->length;
+    capacity = journal->capacity;
+    appended = journal->appended;
+    next_fd = journal->next_fd;
+    split = next_fd < 0 ? length : journal->rotate_at;
+    journal->buffer = spare;
+    journal->capacity = spare_capacity;
+    journal->length = 0;
+    journal->next_fd = -1;
+    pthread_mutex_unlock(&journal->mutex);
+
+    journal_write_all(journal->fd, buffer, split);
+    if (split > 0 && fdatasync(journal->fd) != 0)
+    {
+        errno_abort("Sync journal");
+    }
+    if (next_fd >= 0)
+    {
+        close(journal->fd);
+        journal->fd = next_fd;
+    }
+    journal_write_all(journal->fd, buffer + split, length - split);
+    if (length > split && fdatasync(journal->fd) != 0)
+    {
+        errno_abort("Sync journal");
+    }
+
+    spare = buffer;
+    spare_capacity = capacity;
+    journal->synced = appended;
+
+    pthread_mutex_unlock(&journal->flush_mutex);
+}
+
+/**
+ * JOURNAL THREAD
+ * * * * * * * * *
+ *
+ * Commits the journal every `interval` nanoseconds (or sooner, when many
+ * records are waiting), so that one fdatasync() covers every command
+ * applied in between.
+ */
+void *journal_thread(void *arg)
+{
+    journal_t *journal = arg;
+    struct timespec t;
+
+    while (1)
+    {
+        pthread_mutex_lock(&journal->mutex);
+        if (journal->length < JOURNAL_FLUSH_SIZE)
+        {
+            clock_timespec(clock_monotonic() + journal->interval, &t);
+            pthread_cond_timedwait(&journal->cond, &journal->mutex, &t);
+        }
+        pthread_mutex_unlock(&journal->mutex);
+
+        journal_flush(journal);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the journal thread.
+ */
+void journal_start(journal_t *journal)
+{
+    pthread_t thread;
+    int status;
+
+    status = pthread_create(&thread, NULL, journal_thread, journal);
+    if (status != 0)
+    {
+        err_abort(status, "Create journal thread");
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Data type for the table that a journal is loaded into: the last record of
+ * each alarm in the journal.
+ *
+ *   - `entries` holds one entry per alarm, `count` is their number and
+ *     `capacity` is the allocated length of `entries`.
+ *   - `slots` is a hash table (linear probing, keyed by alarm ID) with
+ *     `slot_capacity` slots. Each slot holds the index of an entry plus one,
+ *     or zero if it is empty.
+ *   - `records` is the number of records that were read.
+ */
+typedef struct journal_replay_t
+{
+    journal_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots;
+    size_t slot_capacity;
+    long records;
+} journal_replay_t;
+
+/**
+ * Returns the slot of `alarm_id` in the table of a replay, or the empty slot
+ * where it would go.
+ */
+static size_t journal_probe(const journal_replay_t *replay, int32_t alarm_id)
+{
+    size_t mask = replay->slot_capacity - 1;
+    size_t slot = ((uint32_t)alarm_id * 2654435769u) & mask;
+
+    while (replay->slots[slot] != 0
+           && replay->entries[replay->slots[slot] - 1].record.alarm_id
+              != alarm_id)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Returns the entry for `alarm_id` in a replay, adding an empty one if there
+ * is none. The table is kept at most half full.
+ */
+static journal_entry_t *journal_entry(
+    journal_replay_t *replay,
+    int32_t alarm_id)
+{
+    size_t slot;
+
+    if ((replay->count + 1) * 2 > replay->slot_capacity)
+    {
+        free(replay->slots);
+        replay->slot_capacity =
+            replay->slot_capacity == 0 ? 1024 : replay->slot_capacity * 2;
+        replay->slots = calloc(replay->slot_capacity, sizeof(uint32_t));
+        if (replay->slots == NULL)
+        {
+            errno_abort("Calloc failed");
+        }
+        for (size_t i = 0; i < replay->count; i++)
+        {
+            replay->slots[journal_probe(
+                replay,
+                replay->entries[i].record.alarm_id)] = i + 1;
+        }
+    }
+
+    slot = journal_probe(replay, alarm_id);
+    if (replay->slots[slot] == 0)
+    {
+        if (replay->count == replay->capacity)
+        {
+            replay->capacity =
+                replay->capacity == 0 ? 512 : replay->capacity * 2;
+            replay->entries = realloc(
+                replay->entries,
+                replay->capacity * sizeof(journal_entry_t));
+            if (replay->entries == NULL)
+            {
+                errno_abort("Realloc failed");
+            }
+        }
+        replay->entries[replay->count].record.alarm_id = alarm_id;
+        replay->slots[slot] = ++replay->count;
+    }
+
+    return &replay->entries[replay->slots[slot] - 1];
+}
+
+/**
+ * Reads every record of the journal into a replay, keeping the last record
+ * of each alarm. A record that was cut short (or damaged) ends the journal;
+ * it and anything after it are cut off the file.
+ *
+ * `replay` must be zeroed before the first call.
+ */
+void journal_load(journal_t *journal, journal_replay_t *replay)
+{
+    char *buffer;                  // Block of the file being read.
+    size_t length = 0;             // Number of bytes in the buffer.
+    size_t offset;                 // Offset of the next record in the buffer.
+    off_t valid = 0;               // Length of the file up to the last good
+                                   // record.
+    ssize_t bytes;
+    bool eof = false;
+    bool damaged = false;
+    journal_record_t record;
+    journal_entry_t *entry;
+    const char *message;
+
+    buffer = malloc(JOURNAL_READ_SIZE);
+    if (buffer == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+
+    if (lseek(journal->fd, 0, SEEK_SET) < 0)
+    {
+        errno_abort("Seek journal");
+    }
+
+    while (!eof && !damaged)
+    {
+        bytes = read(journal->fd, buffer + length, JOURNAL_READ_SIZE - length);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            errno_abort("Read journal");
+        }
+        eof = bytes == 0;
+        length += bytes;
+
+        offset = 0;
+        while (length - offset >= sizeof(journal_record_t))
+        {
+            memcpy(&record, buffer + offset, sizeof(journal_record_t));
+            if (length - offset < sizeof(journal_record_t) + record.length)
+            {
+                break;
+            }
+            message = buffer + offset + sizeof(journal_record_t);
+            if (record.length >= sizeof(((journal_entry_t *)0)->message)
+                || record.checksum != journal_checksum(&record, message))
+            {
+                damaged = true;
+                break;
+            }
+
+            entry = journal_entry(replay, record.alarm_id);
+            entry->record = record;
+            memcpy(entry->message, message, record.length);
+            entry->message[record.length] = 0;
+
+            offset += sizeof(journal_record_t) + record.length;
+            valid += sizeof(journal_record_t) + record.length;
+            replay->records++;
+        }
+
+        // Keep the incomplete last record for the next read.
+        length -= offset;
+        memmove(buffer, buffer + offset, length);
+    }
+
+    if (damaged || length > 0)
+    {
+        fprintf(
+            stderr,
+            "Journal: cut off a damaged or partly written record at byte "
+            "%lld\n",
+            (long long)valid);
+        if (ftruncate(journal->fd, valid) != 0)
+        {
+            errno_abort("Truncate journal");
+        }
+    }
+
+    free(buffer);
+}
+
+/**
+ * Orders replay entries by alarm ID.
+ */
+static int journal_compare_entries(const void *a, const void *b)
+{
+    const journal_entry_t *entry_a = a;
+    const journal_entry_t *entry_b = b;
+
+    return entry_a->record.alarm_id < entry_b->record.alarm_id
+        ? -1
+        : entry_a->record.alarm_id > entry_b->record.alarm_id;
+}
+
+/**
+ * Sorts the entries of a replay by alarm ID (cancelled alarms included, with
+ * a last record of type Cancel_Alarm). The hash table is freed, since it
+ * no longer matches the entries.
+ */
+void journal_sort(journal_replay_t *replay)
+{
+    qsort(
+        replay->entries,
+        replay->count,
+        sizeof(journal_entry_t),
+        journal_compare_entries);
+
+    free(replay->slots);
+    replay->slots = NULL;
+    replay->slot_capacity = 0;
+}
+
+/**
+ * Frees the memory of a replay.
+ */
+void journal_replay_free(journal_replay_t *replay)
+{
+    free(replay->entries);
+    free(replay->slots);
+}
+
+/**
+ * Starts a new journal file for the records that come after a checkpoint.
+ * Nothing is written here: the records appended so far still go to the
+ * current file, and those appended from now on to the next file, once
+ * journal_flush() has written and synced the current one. The next file
+ * replaces the current one in journal_finish_rotation() once the
+ * checkpoint is safely on disk.
+ *
+ * No record may be appended while this runs (the caller holds the alarm
+ * list mutex), and journal_flush() must run before the checkpoint is
+ * written, so that the records it holds are on disk in the current file.
+ */
+void journal_rotate(journal_t *journal)
+{
+    int fd;
+
+    fd = open(
+        journal->next_path,
+        O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+        0644);
+    if (fd < 0)
+    {
+        errno_abort("Open next journal");
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+    journal->next_fd = fd;
+    journal->rotate_at = journal->length;
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * Replaces the journal with the file started by journal_rotate(), dropping
+ * the records that the checkpoint now holds.
+ */
+void journal_finish_rotation(journal_t *journal)
+{
+    if (rename(journal->next_path, journal->path) != 0)
+    {
+        errno_abort("Rename journal");
+    }
+    sync_directory(journal->path);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef __lock_stats_h
+#define __lock_stats_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "clock.h"
+
+/**
+ * Data type for a mutex that counts how it is used.
+ *
+ *   - `mutex` is the mutex itself.
+ *   - `acquisitions` is the number of times it was locked (including the
+ *     times a condition variable wait locked it again).
+ *   - `contended` is the number of times it was already locked by another
+ *     thread, so that the caller had to wait for it.
+ *   - `wait_time` is the total time spent waiting for it, and `hold_time`
+ *     the total time it was held (both in nanoseconds). The time a thread
+ *     spends in a condition variable wait does not count as held.
+ *   - `locked_at` is when the current holder locked it.
+ *
+ * Every field but `mutex` is only written by the holder of the mutex, so the
+ * counters need no atomic operations; they are read consistently by a
+ * thread that holds the mutex. The cost is two reads of the monotonic clock
+ * per lock and unlock.
+ */
+typedef struct metered_mutex_t
+{
+    pthread_mutex_t mutex;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_time;
+    uint64_t hold_time;
+    int64_t locked_at;
+} metered_mutex_t;
+
+#define METERED_MUTEX_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0}
+
+/**
+ * Data type for the number of times a thread woke up from a condition
+ * variable wait, by what it found:
+ *
+ *   - `useful` when it was signalled and had something to do,
+ *   - `timeout` when the wait timed out,
+ *   - `spurious` when it was woken up with nothing to do.
+ */
+typedef struct wakeup_stats_t
+{
+    uint64_t useful;
+    uint64_t timeout;
+    uint64_t spurious;
+} wakeup_stats_t;
+
+/**
+ * Locks a metered mutex. An uncontended lock costs a trylock and one read
+ * of the clock.
+ */
+void metered_mutex_lock(metered_mutex_t *mutex)
+{
+    int64_t start;
+
+    if (pthread_mutex_trylock(&mutex->mutex) == 0)
+    {
+        mutex->acquisitions++;
+        mutex->locked_at = clock_monotonic();
+        return;
+    }
+
+    start = clock_monotonic();
+    pthread_mutex_lock(&mutex->mutex);
+    mutex->locked_at = clock_monotonic();
+    mutex->acquisitions++;
+    mutex->contended++;
+    mutex->wait_time += mutex->locked_at - start;
+}
+
+/**
+ * Unlocks a metered mutex.
+ */
+void metered_mutex_unlock(metered_mutex_t *mutex)
+{
+    mutex->hold_time += clock_monotonic() - mutex->locked_at;
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+/**
+ * Waits on a condition variable with a metered mutex, like
+ * pthread_cond_wait().
+ */
+int metered_cond_wait(pthread_cond_t *cond, metered_mutex_t *mutex)
+{
+    int status;
+
+    mutex->hold_time += clock_monotonic() - mutex->locked_at;
+    status = pthread_cond_wait(cond, &mutex->mutex);
+    mutex->acquisitions++;
+    mutex->locked_at = clock_monotonic();
+    return status;
+}
+
+/**
+ * Waits on a condition variable with a metered mutex until an absolute
+ * time, like pthread_cond_timedwait().
+ */
+int metered_cond_timedwait(
+    pthread_cond_t *cond,
+    metered_mutex_t *mutex,
+    const struct timespec *time)
+{
+    int status;
+
+    mutex->hold_time += clock_monotonic() - mutex->locked_at;
+    status = pthread_cond_timedwait(cond, &mutex->mutex, time);
+    mutex->acquisitions++;
+    mutex->locked_at = clock_monotonic();
+    return status;
+}
+
+/**
+ * Adds the wakeups of `source` to `target`.
+ */
+void wakeup_stats_add(wakeup_stats_t *target, const wakeup_stats_t *source)
+{
+    target->useful += source->useful;
+    target->timeout += source->timeout;
+    target->spurious += source->spurious;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __mailbox_h
+#define __mailbox_h
+
+#include <pthread.h>
+#include "clock.h"
+#include "errors.h"
+#include "lock_stats.h"
+#include "types.h"
+
+/**
+ * Initializes an empty mailbox.
+ */
+void mailbox_init(mailbox_t *mailbox)
+{
+    int status;
+
+    mailbox->head = 0;
+    mailbox->count = 0;
+    mailbox->waiting_posters = 0;
+
+    // The owner waits on `cond` with a timeout on the monotonic clock.
+    clock_cond_init(&mailbox->cond);
+    status = pthread_cond_init(&mailbox->not_full, NULL);
+    if (status != 0)
+    {
+        err_abort(status, "Init condition variable");
+    }
+}
+
+/**
+ * Destroys a mailbox that nobody is waiting on.
+ */
+void mailbox_destroy(mailbox_t *mailbox)
+{
+    pthread_cond_destroy(&mailbox->cond);
+    pthread_cond_destroy(&mailbox->not_full);
+}
+
+/**
+ * Copies an event into a mailbox and wakes up the owner of the mailbox.
+ *
+ * `mutex` is the mutex that protects the mailbox, and it must be locked by
+ * the caller. If the mailbox is full, the caller waits (releasing the mutex)
+ * until the owner takes an event out, so events are never lost or
+ * overwritten.
+ *
+ * The owner only waits when its mailbox is empty, and takes every event out
+ * when it wakes up, so it is only signalled for the first event of a run.
+ * Events posted in a batch cost one wakeup.
+ */
+void mailbox_post(mailbox_t *mailbox, event_t event, metered_mutex_t *mutex)
+{
+    while (mailbox->count == MAILBOX_CAPACITY)
+    {
+        mailbox->waiting_posters++;
+        metered_cond_wait(&mailbox->not_full, mutex);
+        mailbox->waiting_posters--;
+    }
+
+    mailbox->events[(mailbox->head + mailbox->count) % MAILBOX_CAPACITY] =
+        event;
+    if (mailbox->count++ == 0)
+    {
+        pthread_cond_signal(&mailbox->cond);
+    }
+}
+
+/**
+ * Takes the oldest event out of a mailbox. Returns false if the mailbox is
+ * empty. The mutex that protects the mailbox must be locked by the caller.
+ */
+bool mailbox_take(mailbox_t *mailbox, event_t *event)
+{
+    if (mailbox->count == 0)
+    {
+        return false;
+    }
+
+    *event = mailbox->events[mailbox->head];
+    mailbox->head = (mailbox->head + 1) % MAILBOX_CAPACITY;
+    if (mailbox->count-- == MAILBOX_CAPACITY)
+    {
+        pthread_cond_broadcast(&mailbox->not_full);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef __metrics_h
+#define __metrics_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errors.h"
+#include "lock_stats.h"
+#include "slab.h"
+#include "types.h"
+
+/**
+ * The counters of a metered mutex, copied out of it.
+ */
+typedef struct mutex_metrics_t
+{
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_time;
+    uint64_t hold_time;
+} mutex_metrics_t;
+
+/**
+ * The mutexes whose counters are in the metrics.
+ */
+#define METRICS_MUTEXES 2
+
+/**
+ * Data type for the metrics of the program at one moment, as shown by the
+ * Stats command and written by the metrics exporter.
+ *
+ *   - `taken_at` is when they were collected (monotonic clock).
+ *   - `alarms` and `suspended` are the number of alarms in the alarm list,
+ *     and how many of them are suspended.
+ *   - `display_threads` is the number of display threads.
+ *   - `events_pending` is the number of events waiting in the mailboxes of
+ *     the display threads, and `commands_queued` the number of commands
+ *     read and not applied yet.
+ *   - `commands` counts the commands applied, by type, and `bad_commands`
+ *     the lines that were not valid commands.
+ *   - `expired` is the number of alarms that have expired, and
+ *     `expired_per_second` how many expired per second since the metrics
+ *     were last collected by the same reader.
+ *   - `pool` is the use of the alarm pool.
+ *   - `mutexes` are the counters of the alarm list and thread list mutexes.
+ *   - `wakeups` are the wakeups of the threads that wait for deadlines, and
+ *     `waiters` names those threads.
+ */
+typedef struct metrics_t
+{
+    int64_t taken_at;
+    size_t alarms;
+    size_t suspended;
+    size_t display_threads;
+    size_t events_pending;
+    size_t commands_queued;
+    uint64_t commands[COMMAND_TYPES];
+    uint64_t bad_commands;
+    uint64_t expired;
+    double expired_per_second;
+    slab_stats_t pool;
+    mutex_metrics_t mutexes[METRICS_MUTEXES];
+    wakeup_stats_t wakeups;
+    const char *waiters;
+} metrics_t;
+
+/**
+ * Copies the counters of a metered mutex. The mutex must be locked by the
+ * caller.
+ */
+void mutex_metrics_copy(
+    mutex_metrics_t *metrics,
+    const char *name,
+    const metered_mutex_t *mutex)
+{
+    metrics->name = name;
+    metrics->acquisitions = mutex->acquisitions;
+    metrics->contended = mutex->contended;
+    metrics->wait_time = mutex->wait_time;
+    metrics->hold_time = mutex->hold_time;
+}
+
+/**
+ * Sets the number of expirations per second of `metrics` from the number of
+ * alarms expired since `previous` was collected.
+ */
+void metrics_rate(metrics_t *metrics, const metrics_t *previous)
+{
+    int64_t elapsed = metrics->taken_at - previous->taken_at;
+
+    metrics->expired_per_second = elapsed > 0
+        ? (double)(metrics->expired - previous->expired)
+              * NSEC_PER_SEC / elapsed
+        : 0;
+}
+
+/**
+ * Writes one metric without labels, with its help and type lines.
+ */
+static void metrics_write_value(
+    FILE *file,
+    const char *name,
+    const char *type,
+    const char *help,
+    double value)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    fprintf(file, "%s %.17g\n", name, value);
+}
+
+/**
+ * Writes metrics to `path` in the Prometheus text format. The file is
+ * written under a temporary name and renamed over `path`, so a reader
+ * always sees a complete file.
+ */
+void metrics_write(const metrics_t *metrics, const char *path)
+{
+    static const char *const wakeup_reasons[] = {
+        "useful", "timeout", "spurious"
+    };
+    const uint64_t wakeups[] = {
+        metrics->wakeups.useful,
+        metrics->wakeups.timeout,
+        metrics->wakeups.spurious
+    };
+    const mutex_metrics_t *mutex;
+    char *temporary;
+    FILE *file;
+
+    temporary = malloc(strlen(path) + sizeof(".tmp"));
+    if (temporary == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    strcpy(temporary, path);
+    strcat(temporary, ".tmp");
+
+    file = fopen(temporary, "w");
+    if (file == NULL)
+    {
+        errno_abort("Open metrics file");
+    }
+
+    metrics_write_value(
+        file, "alarm_alarms", "gauge",
+        "Alarms in the alarm list.", metrics->alarms);
+    metrics_write_value(
+        file, "alarm_suspended_alarms", "gauge",
+        "Suspended alarms in the alarm list.", metrics->suspended);
+    metrics_write_value(
+        file, "alarm_display_threads", "gauge",
+        "Display threads.", metrics->display_threads);
+    metrics_write_value(
+        file, "alarm_events_pending", "gauge",
+        "Events waiting in the mailboxes of the display threads.",
+        metrics->events_pending);
+    metrics_write_value(
+        file, "alarm_commands_queued", "gauge",
+        "Commands read and not applied yet.", metrics->commands_queued);
+
+    fprintf(
+        file,
+        "# HELP alarm_commands_total Commands applied, by type.\n"
+        "# TYPE alarm_commands_total counter\n");
+    for (int type = 0; type < COMMAND_TYPES; type++)
+    {
+        fprintf(
+            file,
+            "alarm_commands_total{type=\"%s\"} %llu\n",
+            command_type_names[type],
+            (unsigned long long)metrics->commands[type]);
+    }
+    fprintf(
+        file,
+        "alarm_commands_total{type=\"bad\"} %llu\n",
+        (unsigned long long)metrics->bad_commands);
+
+    metrics_write_value(
+        file, "alarm_expired_total", "counter",
+        "Alarms that have expired.", metrics->expired);
+    metrics_write_value(
+        file, "alarm_expirations_per_second", "gauge",
+        "Alarms expired per second since the last export.",
+        metrics->expired_per_second);
+
+    metrics_write_value(
+        file, "alarm_pool_live", "gauge",
+        "Alarms allocated from the alarm pool.", metrics->pool.live);
+    metrics_write_value(
+        file, "alarm_pool_peak", "gauge",
+        "Most alarms allocated from the alarm pool at once.",
+        metrics->pool.peak);
+    metrics_write_value(
+        file, "alarm_pool_free", "gauge",
+        "Free alarms in the alarm pool.", metrics->pool.free);
+    metrics_write_value(
+        file, "alarm_pool_chunks", "gauge",
+        "Chunks allocated by the alarm pool.", metrics->pool.chunks);
+
+    fprintf(
+        file,
+        "# HELP alarm_mutex_acquisitions_total Times a mutex was locked.\n"
+        "# TYPE alarm_mutex_acquisitions_total counter\n");
+    for (mutex = metrics->mutexes;
+         mutex < metrics->mutexes + METRICS_MUTEXES;
+         mutex++)
+    {
+        fprintf(
+            file,
+            "alarm_mutex_acquisitions_total{mutex=\"%s\"} %llu\n",
+            mutex->name,
+            (unsigned long long)mutex->acquisitions);
+    }
+    fprintf(
+        file,
+        "# HELP alarm_mutex_contended_total Times a mutex was locked by "
+        "another thread.\n"
+        "# TYPE alarm_mutex_contended_total counter\n");
+    for (mutex = metrics->mutexes;
+         mutex < metrics->mutexes + METRICS_MUTEXES;
+         mutex++)
+    {
+        fprintf(
+            file,
+            "alarm_mutex_contended_total{mutex=\"%s\"} %llu\n",
+            mutex->name,
+            (unsigned long long)mutex->contended);
+    }
+    fprintf(
+        file,
+        "# HELP alarm_mutex_wait_seconds_total Time spent waiting for a "
+        "mutex.\n"
+        "# TYPE alarm_mutex_wait_seconds_total counter\n");
+    for (mutex = metrics->mutexes;
+         mutex < metrics->mutexes + METRICS_MUTEXES;
+         mutex++)
+    {
+        fprintf(
+            file,
+            "alarm_mutex_wait_seconds_total{mutex=\"%s\"} %.9f\n",
+            mutex->name,
+            mutex->wait_time / 1e9);
+    }
+    fprintf(
+        file,
+        "# HELP alarm_mutex_hold_seconds_total Time a mutex was held.\n"
+        "# TYPE alarm_mutex_hold_seconds_total counter\n");
+    for (mutex = metrics->mutexes;
+         mutex < metrics->mutexes + METRICS_MUTEXES;
+         mutex++)
+    {
+        fprintf(
+            file,
+            "alarm_mutex_hold_seconds_total{mutex=\"%s\"} %.9f\n",
+            mutex->name,
+            mutex->hold_time / 1e9);
+    }
+
+    fprintf(
+        file,
+        "# HELP alarm_wakeups_total Wakeups of the threads that wait for "
+        "deadlines.\n"
+        "# TYPE alarm_wakeups_total counter\n");
+    for (int i = 0; i < 3; i++)
+    {
+        fprintf(
+            file,
+            "alarm_wakeups_total{threads=\"%s\",reason=\"%s\"} %llu\n",
+            metrics->waiters,
+            wakeup_reasons[i],
+            (unsigned long long)wakeups[i]);
+    }
+
+    if (fclose(file) != 0)
+    {
+        errno_abort("Write metrics file");
+    }
+    if (rename(temporary, path) != 0)
+    {
+        errno_abort("Rename metrics file");
+    }
+    free(temporary);
+}
+
+#endif
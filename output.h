@@ -0,0 +1,709 @@
+#ifndef __output_h
+#define __output_h
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alarm_heap.h"
+#include "errors.h"
+
+/**
+ * Number of lines that fit in the output ring of a thread that prints a lot
+ * (see output_reserve()), and in the ring of any other thread (both powers
+ * of two), and the longest line that is written (longer lines are cut).
+ * Most threads (display threads) only print a few lines at a time, so their
+ * rings are kept small.
+ */
+#define OUTPUT_RING_SLOTS 128
+#define OUTPUT_RING_SLOTS_MIN 4
+#define OUTPUT_LINE_MAX 240
+
+/**
+ * Size of the buffer that the writer thread fills before calling write().
+ */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/**
+ * What a thread does when its output ring is full.
+ *
+ *   - `OUTPUT_BLOCK` keeps every line (this is the default). The line is set
+ *     aside in the ring's spill list, since the thread may be holding a
+ *     mutex that other threads wait for, and the thread waits for the writer
+ *     thread in output_throttle(), once it holds none.
+ *   - `OUTPUT_DROP` throws the line away.
+ *   - `OUTPUT_COUNT` throws the line away, and the writer thread writes a
+ *     line saying how many lines were dropped once there is space again.
+ */
+typedef enum output_policy
+{
+    OUTPUT_BLOCK,
+    OUTPUT_DROP,
+    OUTPUT_COUNT
+} output_policy;
+
+/**
+ * A line of output in a ring.
+ *
+ *   - `seq` is the position of the line in the output of the whole program.
+ *     Lines from different threads are written in `seq` order.
+ *   - `length` is the number of characters in `text`.
+ */
+typedef struct output_line_t
+{
+    uint64_t seq;
+    size_t length;
+    char text[OUTPUT_LINE_MAX];
+} output_line_t;
+
+/**
+ * A line of output that did not fit in its thread's ring.
+ */
+typedef struct output_spill_t
+{
+    struct output_spill_t *next;
+    output_line_t line;
+} output_spill_t;
+
+/**
+ * Data type for the output ring of one thread. It is a single producer,
+ * single consumer queue: only the owning thread adds lines (at `tail`), and
+ * only the thread draining the output takes them (at `head`), so neither
+ * side takes a lock.
+ *
+ *   - `head` and `tail` count the lines taken and added so far. They are
+ *     read and written with atomic operations. `slots` is the number of
+ *     lines in `lines`.
+ *   - `closed` is set when the owning thread exits. The ring is freed once
+ *     it has been drained.
+ *   - `spill_head` and `spill_tail` are the list of lines that did not fit
+ *     in the ring (OUTPUT_BLOCK only), oldest first, and `spilled` is its
+ *     length. The list is protected by `output_mutex`; `spilled` is also
+ *     read without it. No line is added to the ring while the list is not
+ *     empty, so every line in the ring is older than every spilled line.
+ *   - `queued` is true while the ring is on the stack of ready rings (with
+ *     `ready_next` the next ring on it) or in the drain heap (with `node`
+ *     its node, keyed on the sequence number of its next line). Whoever
+ *     sets it owns that step: a thread that adds a line pushes the ring on
+ *     the stack only if `queued` was false.
+ */
+typedef struct output_ring_t
+{
+    uint64_t head;
+    uint64_t tail;
+    size_t slots;
+    bool closed;
+    int queued;
+    struct output_ring_t *ready_next;
+    heap_node_t node;
+    output_spill_t *spill_head;
+    output_spill_t *spill_tail;
+    size_t spilled;
+    output_line_t lines[];
+} output_ring_t;
+
+/**
+ * The output ring of the calling thread, created on its first line, and the
+ * number of lines it is created with.
+ */
+__thread output_ring_t *output_ring = NULL;
+__thread size_t output_ring_slots = OUTPUT_RING_SLOTS_MIN;
+
+/**
+ * The rings that have had lines added since the writer last looked at them:
+ * a stack that threads push on without a lock, and that whoever drains the
+ * output takes whole.
+ */
+output_ring_t *output_ready_rings = NULL;
+
+/**
+ * The rings that have lines to write, ordered on the sequence number of
+ * their next line, so that the lines of every thread are merged in order.
+ * The heap is protected by `output_drain_mutex`, which is held by whoever
+ * is draining the rings (the writer thread, or a thread flushing the
+ * output), so there is only ever one consumer per ring.
+ */
+min_heap_t output_heap = {NULL, 0, 0};
+pthread_mutex_t output_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The sequence number of the next line, and of the next line to be written.
+ */
+uint64_t output_next_seq = 0;
+uint64_t output_written_seq = 0;
+
+/**
+ * Policy for full rings, and the number of lines dropped because of it (and
+ * not reported yet, for OUTPUT_COUNT).
+ */
+output_policy output_full_policy = OUTPUT_BLOCK;
+uint64_t output_dropped = 0;
+
+/**
+ * The writer thread waits on `output_writer_cond` while `output_writer_idle`
+ * is true, and threads waiting for their spilled lines to be written wait on
+ * `output_space_cond` (with `output_space_waiters` counting them). Both use
+ * `output_mutex`, which is locked after `output_drain_mutex`.
+ */
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t output_writer_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t output_space_cond = PTHREAD_COND_INITIALIZER;
+int output_writer_idle = 0;
+int output_space_waiters = 0;
+
+/**
+ * Buffer that lines are copied into before they are written.
+ */
+char output_buffer[OUTPUT_BUFFER_SIZE];
+size_t output_buffer_length = 0;
+
+/**
+ * Writes the output buffer to standard output and empties it.
+ */
+static void output_write_buffer()
+{
+    size_t written = 0;
+    ssize_t bytes;
+
+    while (written < output_buffer_length)
+    {
+        bytes = write(
+            STDOUT_FILENO,
+            output_buffer + written,
+            output_buffer_length - written);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Standard output is gone; there is nobody to tell.
+            break;
+        }
+        written += bytes;
+    }
+
+    output_buffer_length = 0;
+}
+
+/**
+ * Copies text into the output buffer, writing the buffer out when it fills.
+ */
+static void output_append(const char *text, size_t length)
+{
+    if (output_buffer_length + length > OUTPUT_BUFFER_SIZE)
+    {
+        output_write_buffer();
+    }
+    memcpy(output_buffer + output_buffer_length, text, length);
+    output_buffer_length += length;
+}
+
+/**
+ * Pushes a ring on the stack of ready rings. The caller must have set its
+ * `queued` flag.
+ */
+static void output_push_ready(output_ring_t *ring)
+{
+    output_ring_t *next = __atomic_load_n(&output_ready_rings, __ATOMIC_SEQ_CST);
+
+    do
+    {
+        ring->ready_next = next;
+    } while (!__atomic_compare_exchange_n(
+        &output_ready_rings,
+        &next,
+        ring,
+        true,
+        __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST));
+}
+
+/**
+ * Returns the next line of a ring to be written, or NULL if it has none, and
+ * sets `*spilled` to true if the line is in its spill list.
+ *
+ * Only the thread draining the output may call this.
+ */
+static output_line_t *output_ring_next(output_ring_t *ring, bool *spilled)
+{
+    output_line_t *line;
+
+    *spilled = false;
+    if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST))
+    {
+        return &ring->lines[ring->head & (ring->slots - 1)];
+    }
+    if (__atomic_load_n(&ring->spilled, __ATOMIC_SEQ_CST) == 0)
+    {
+        return NULL;
+    }
+
+    *spilled = true;
+    pthread_mutex_lock(&output_mutex);
+    line = &ring->spill_head->line;
+    pthread_mutex_unlock(&output_mutex);
+    return line;
+}
+
+/**
+ * Takes the line returned by output_ring_next() out of its ring, once it has
+ * been written.
+ */
+static void output_ring_advance(output_ring_t *ring, bool spilled)
+{
+    output_spill_t *spill;
+
+    if (!spilled)
+    {
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    pthread_mutex_lock(&output_mutex);
+    spill = ring->spill_head;
+    ring->spill_head = spill->next;
+    if (ring->spill_head == NULL)
+    {
+        ring->spill_tail = NULL;
+    }
+    __atomic_store_n(&ring->spilled, ring->spilled - 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&output_mutex);
+    free(spill);
+}
+
+/**
+ * Puts a ring that the drainer owns (its `queued` flag is set) in the drain
+ * heap if it has a line to write. Otherwise it is given back to its thread
+ * by clearing the flag (checking again for a line added meanwhile), or it is
+ * freed if its thread has exited.
+ */
+static void output_ring_schedule(output_ring_t *ring)
+{
+    output_line_t *line;
+    bool spilled;
+
+    while (1)
+    {
+        line = output_ring_next(ring, &spilled);
+        if (line != NULL)
+        {
+            min_heap_insert(&output_heap, &ring->node, line->seq);
+            return;
+        }
+
+        /*
+         * A thread sets `closed` after its last use of `queued`, so a closed
+         * ring that is owned here is never pushed again. Its last lines were
+         * added before it was closed, so they are seen now.
+         */
+        if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+        {
+            if (output_ring_next(ring, &spilled) == NULL)
+            {
+                free(ring);
+                return;
+            }
+            continue;
+        }
+
+        __atomic_store_n(&ring->queued, 0, __ATOMIC_SEQ_CST);
+        if (output_ring_next(ring, &spilled) == NULL
+            && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+        {
+            return;
+        }
+
+        // A line was added (or the ring closed) meanwhile; take it back.
+        if (__atomic_exchange_n(&ring->queued, 1, __ATOMIC_SEQ_CST))
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Takes the stack of ready rings and schedules each of them. Returns false
+ * if the stack was empty.
+ */
+static bool output_collect_ready()
+{
+    output_ring_t *ring;
+    output_ring_t *next;
+
+    ring = __atomic_exchange_n(&output_ready_rings, NULL, __ATOMIC_SEQ_CST);
+    if (ring == NULL)
+    {
+        return false;
+    }
+    for (; ring != NULL; ring = next)
+    {
+        next = ring->ready_next;
+        output_ring_schedule(ring);
+    }
+    return true;
+}
+
+/**
+ * Writes every line that can be written, in sequence order. A line can be
+ * written when every line before it has been written. The rings are merged
+ * through the drain heap, so each line costs a heap update rather than a
+ * look at every ring. When the next line has been given its sequence number
+ * but not added yet, this stops; its thread pushes its ring on the ready
+ * stack once it is added.
+ *
+ * Returns the number of lines written.
+ *
+ * `output_drain_mutex` must be locked by the caller.
+ */
+static size_t output_drain()
+{
+    size_t written = 0;
+    uint64_t dropped;
+    output_ring_t *ring;
+    output_line_t *line;
+    heap_node_t *top;
+    bool spilled;
+    char note[64];
+    int length;
+
+    while (1)
+    {
+        top = min_heap_top(&output_heap);
+        if (top == NULL || (uint64_t)top->key != output_written_seq)
+        {
+            if (!output_collect_ready())
+            {
+                break;
+            }
+            continue;
+        }
+
+        ring = top->data;
+        line = output_ring_next(ring, &spilled);
+        output_append(line->text, line->length);
+        __atomic_store_n(
+            &output_written_seq, output_written_seq + 1, __ATOMIC_SEQ_CST);
+        written++;
+        output_ring_advance(ring, spilled);
+
+        line = output_ring_next(ring, &spilled);
+        if (line != NULL)
+        {
+            min_heap_update(&output_heap, &ring->node, line->seq);
+        }
+        else
+        {
+            min_heap_remove(&output_heap, &ring->node);
+            output_ring_schedule(ring);
+        }
+    }
+
+    if (output_full_policy == OUTPUT_COUNT
+        && (dropped = __atomic_exchange_n(
+                &output_dropped, 0, __ATOMIC_RELAXED)) != 0)
+    {
+        length = snprintf(
+            note,
+            sizeof(note),
+            "Output: %llu lines dropped\n",
+            (unsigned long long)dropped);
+        output_append(note, length);
+    }
+
+    output_write_buffer();
+
+    // Wake up threads waiting for their spilled lines.
+    if (written > 0 && __atomic_load_n(&output_space_waiters, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&output_mutex);
+        pthread_cond_broadcast(&output_space_cond);
+        pthread_mutex_unlock(&output_mutex);
+    }
+
+    return written;
+}
+
+/**
+ * Returns true if any line has been added (or is being added) that has not
+ * been written. No lock is needed.
+ */
+static bool output_pending()
+{
+    return __atomic_load_n(&output_next_seq, __ATOMIC_SEQ_CST)
+        != __atomic_load_n(&output_written_seq, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * OUTPUT WRITER THREAD
+ * * * * * * * * * * * *
+ *
+ * Drains the output rings of every thread and writes the lines to standard
+ * output with as few write() calls as possible. When there is nothing to
+ * write, or the next line is still being added, it sleeps until a thread
+ * pushes a ring on the ready stack.
+ *
+ * A thread that adds a line pushes its ring (if it is not queued already)
+ * before it checks whether the writer is idle, and the writer sets itself
+ * idle before it checks the stack, so one of them always sees the other.
+ */
+void *output_writer_thread(void *arg)
+{
+    struct timespec t;
+
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&output_drain_mutex);
+        output_drain();
+        pthread_mutex_unlock(&output_drain_mutex);
+
+        pthread_mutex_lock(&output_mutex);
+        __atomic_store_n(&output_writer_idle, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&output_ready_rings, __ATOMIC_SEQ_CST) == NULL)
+        {
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += 1;
+            pthread_cond_timedwait(&output_writer_cond, &output_mutex, &t);
+        }
+        __atomic_store_n(&output_writer_idle, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&output_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the writer thread, with the given policy for full rings.
+ */
+void output_start(output_policy policy)
+{
+    pthread_t thread;
+    int status;
+
+    output_full_policy = policy;
+    status = pthread_create(&thread, NULL, output_writer_thread, NULL);
+    if (status != 0)
+    {
+        err_abort(status, "Create writer thread");
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Gives the calling thread a ring of OUTPUT_RING_SLOTS lines instead of
+ * OUTPUT_RING_SLOTS_MIN, for a thread that prints many lines at a time. It
+ * must be called before the thread prints its first line.
+ */
+void output_reserve()
+{
+    output_ring_slots = OUTPUT_RING_SLOTS;
+}
+
+/**
+ * Returns the output ring of the calling thread, creating it on first use.
+ */
+static output_ring_t *output_thread_ring()
+{
+    if (output_ring != NULL)
+    {
+        return output_ring;
+    }
+
+    output_ring = calloc(
+        1,
+        sizeof(output_ring_t) + output_ring_slots * sizeof(output_line_t));
+    if (output_ring == NULL)
+    {
+        errno_abort("Calloc failed");
+    }
+    output_ring->slots = output_ring_slots;
+    heap_node_init(&output_ring->node, output_ring);
+
+    return output_ring;
+}
+
+/**
+ * Formats a line of output (like printf) and adds it to the calling thread's
+ * ring for the writer thread to write. This never writes to standard output
+ * and never waits, so it is safe to call with mutexes locked. If the ring is
+ * full, the output policy decides whether to spill the line or to drop it;
+ * the thread waits for its spilled lines in output_throttle().
+ *
+ * Lines are written in the order of the calls to output_printf(), across
+ * all threads.
+ */
+void output_printf(const char *format, ...)
+{
+    output_ring_t *ring = output_thread_ring();
+    output_spill_t *spill = NULL;
+    output_line_t *line;
+    va_list args;
+    int length;
+
+    if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+            == ring->slots
+        || __atomic_load_n(&ring->spilled, __ATOMIC_SEQ_CST) > 0)
+    {
+        if (output_full_policy != OUTPUT_BLOCK)
+        {
+            __atomic_add_fetch(&output_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        spill = malloc(sizeof(output_spill_t));
+        if (spill == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        spill->next = NULL;
+        line = &spill->line;
+    }
+    else
+    {
+        line = &ring->lines[ring->tail & (ring->slots - 1)];
+    }
+
+    va_start(args, format);
+    length = vsnprintf(line->text, OUTPUT_LINE_MAX, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        length = 0;
+    }
+    else if (length >= OUTPUT_LINE_MAX)
+    {
+        // Cut the line, but keep its newline.
+        length = OUTPUT_LINE_MAX - 1;
+        if (format[strlen(format) - 1] == '\n')
+        {
+            line->text[length - 1] = '\n';
+        }
+    }
+    line->length = length;
+    line->seq = __atomic_fetch_add(&output_next_seq, 1, __ATOMIC_SEQ_CST);
+
+    if (spill != NULL)
+    {
+        pthread_mutex_lock(&output_mutex);
+        if (ring->spill_tail == NULL)
+        {
+            ring->spill_head = spill;
+        }
+        else
+        {
+            ring->spill_tail->next = spill;
+        }
+        ring->spill_tail = spill;
+        __atomic_store_n(&ring->spilled, ring->spilled + 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&output_mutex);
+    }
+    else
+    {
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (!__atomic_exchange_n(&ring->queued, 1, __ATOMIC_SEQ_CST))
+    {
+        output_push_ready(ring);
+    }
+    if (__atomic_load_n(&output_writer_idle, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&output_mutex);
+        pthread_cond_signal(&output_writer_cond);
+        pthread_mutex_unlock(&output_mutex);
+    }
+}
+
+/**
+ * Returns true if the calling thread has spilled lines that have not been
+ * written yet. No lock is needed.
+ */
+bool output_spilled()
+{
+    return output_ring != NULL
+        && __atomic_load_n(&output_ring->spilled, __ATOMIC_SEQ_CST) > 0;
+}
+
+/**
+ * Waits until the lines that the calling thread has spilled have been
+ * written, so that a thread producing output faster than it can be written
+ * is slowed down to the writer's pace. It returns at once if nothing was
+ * spilled.
+ *
+ * The caller must not hold any mutex that another thread producing output
+ * may wait for; threads call this at points where they hold none.
+ */
+void output_throttle()
+{
+    output_ring_t *ring = output_ring;
+
+    if (!output_spilled())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&output_mutex);
+    __atomic_add_fetch(&output_space_waiters, 1, __ATOMIC_SEQ_CST);
+    while (ring->spilled > 0)
+    {
+        pthread_cond_signal(&output_writer_cond);
+        pthread_cond_wait(&output_space_cond, &output_mutex);
+    }
+    __atomic_sub_fetch(&output_space_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+/**
+ * Gives up the output ring of the calling thread when it exits. The lines in
+ * it are still written, and the writer frees it once it is empty.
+ */
+void output_release()
+{
+    output_ring_t *ring = output_ring;
+    int queued;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+    output_ring = NULL;
+
+    /*
+     * The ring is handed to the writer (unless it already has it) so that
+     * it sees it closed. After `closed` is set, the ring may be freed at
+     * any time if the writer had it.
+     */
+    queued = __atomic_exchange_n(&ring->queued, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->closed, true, __ATOMIC_SEQ_CST);
+    if (!queued)
+    {
+        output_push_ready(ring);
+    }
+}
+
+/**
+ * Writes every line that has been added so far, before returning. Used
+ * before the program exits.
+ */
+void output_flush()
+{
+    pthread_mutex_lock(&output_drain_mutex);
+    while (output_pending())
+    {
+        if (output_drain() == 0)
+        {
+            // Another thread is in the middle of adding the next line.
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&output_drain_mutex);
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef __parser_h
+#define __parser_h
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+#include "types.h"
+
+/**
+ * Data type describing one of the command forms the parser recognizes.
+ *
+ *   - `type` is the type of command produced when the form matches.
+ *   - `keyword` is the literal command name, including the opening
+ *     parenthesis if the command takes an alarm ID or a time.
+ *   - `has_id` is true if the keyword is followed by "<digits>)".
+ *   - `has_body` is true if the ID is followed by ": <time> <message>".
+ *   - `has_time` is true if the keyword is followed by "<time>[<unit>])"
+ *     instead of an ID.
+ */
+typedef struct command_form
+{
+    command_type type;
+    const char *keyword;
+    size_t keyword_length;
+    bool has_id;
+    bool has_body;
+    bool has_time;
+} command_form;
+
+/**
+ * These are the command forms that we must look for, in the order they are
+ * tested. The grammar is the one of the regular expressions the parser used
+ * to compile for every line, with an optional unit after the time:
+ *
+ *   Start_Alarm(<id>):<space><time>[<unit>]<space><message>
+ *   Change_Alarm(<id>):<space><time>[<unit>]<space><message>
+ *   Cancel_Alarm(<id>)
+ *   Suspend_Alarm(<id>)
+ *   Reactivate_Alarm(<id>)
+ *   View_Alarms
+ *   Checkpoint
+ *   Lateness
+ *   Stats
+ *   Wait(<time>[<unit>])
+ *
+ * where <unit> is one of "s", "ms", "us" or "ns" (seconds if it is left
+ * out). The table is constant, so there is nothing to build or free at
+ * runtime.
+ */
+static const command_form command_forms[] = {
+    {Start_Alarm,      "Start_Alarm(",      12, true,  true,  false},
+    {Change_Alarm,     "Change_Alarm(",     13, true,  true,  false},
+    {Cancel_Alarm,     "Cancel_Alarm(",     13, true,  false, false},
+    {Suspend_Alarm,    "Suspend_Alarm(",    14, true,  false, false},
+    {Reactivate_Alarm, "Reactivate_Alarm(", 17, true,  false, false},
+    {View_Alarms,      "View_Alarms",       11, false, false, false},
+    {Checkpoint,       "Checkpoint",        10, false, false, false},
+    {Lateness,         "Lateness",           8, false, false, false},
+    {Stats,            "Stats",              5, false, false, false},
+    {Wait,             "Wait(",              5, false, false, true}
+};
+
+#define NUMBER_OF_COMMAND_FORMS \
+    (sizeof(command_forms) / sizeof(command_forms[0]))
+
+/**
+ * Reads a run of one or more decimal digits starting at `*cursor` into
+ * `*value`, and advances `*cursor` past them. Returns false (without moving
+ * the cursor) if there is no digit at the cursor, or if the number is larger
+ * than INT_MAX.
+ */
+static bool lex_number(const char **cursor, int *value)
+{
+    const char *c = *cursor;
+    int result = 0;
+
+    if (*c < '0' || *c > '9')
+    {
+        return false;
+    }
+
+    while (*c >= '0' && *c <= '9')
+    {
+        if (result > (INT_MAX - (*c - '0')) / 10)
+        {
+            return false;
+        }
+        result = result * 10 + (*c - '0');
+        c++;
+    }
+
+    *value = result;
+    *cursor = c;
+    return true;
+}
+
+/**
+ * Reads an optional unit suffix ("s", "ms", "us" or "ns") at `*cursor` into
+ * `*unit`, and advances `*cursor` past it. A time without a suffix is in
+ * seconds.
+ */
+static void lex_unit(const char **cursor, time_unit *unit)
+{
+    const char *c = *cursor;
+
+    *unit = UNIT_SECONDS;
+    if (c[0] == 's')
+    {
+        *cursor = c + 1;
+    }
+    // c[1] is only read once c[0] is known not to end the string.
+    else if ((c[0] == 'm' || c[0] == 'u' || c[0] == 'n') && c[1] == 's')
+    {
+        *unit = c[0] == 'm' ? UNIT_MILLISECONDS
+              : c[0] == 'u' ? UNIT_MICROSECONDS
+              : UNIT_NANOSECONDS;
+        *cursor = c + 2;
+    }
+}
+
+/**
+ * Tries to match the command form `form` at exactly `start`. If it matches,
+ * the command is filled in and true is returned. Otherwise the command is
+ * left in an unspecified state and false is returned.
+ */
+static bool lex_command_at(
+    const command_form *form,
+    const char *start,
+    command_t *command)
+{
+    const char *c = start + form->keyword_length;
+    size_t message_length;
+
+    command->type = form->type;
+    command->alarm_id = 0;
+    command->time = 0;
+    command->unit = UNIT_SECONDS;
+    command->message[0] = 0;
+
+    // "<digits>[<unit>])"
+    if (form->has_time)
+    {
+        if (!lex_number(&c, &command->time))
+        {
+            return false;
+        }
+        lex_unit(&c, &command->unit);
+        return *c == ')';
+    }
+
+    if (!form->has_id)
+    {
+        return true;
+    }
+
+    // "<digits>)"
+    if (!lex_number(&c, &command->alarm_id) || *c++ != ')')
+    {
+        return false;
+    }
+
+    if (!form->has_body)
+    {
+        return true;
+    }
+
+    // ":<space><digits>[<unit>]<space>"
+    if (*c++ != ':' || !isspace((unsigned char)*c++))
+    {
+        return false;
+    }
+    if (!lex_number(&c, &command->time))
+    {
+        return false;
+    }
+    lex_unit(&c, &command->unit);
+    if (!isspace((unsigned char)*c++))
+    {
+        return false;
+    }
+
+    // The rest of the line is the message.
+    message_length = strlen(c);
+    if (message_length >= sizeof(command->message))
+    {
+        message_length = sizeof(command->message) - 1;
+    }
+    memcpy(command->message, c, message_length);
+    command->message[message_length] = 0;
+
+    return true;
+}
+
+/**
+ * This method takes a string and checks if it matches any of the
+ * command formats. If there is no match, false is returned. If there
+ * is a match, it parses the string into the caller's command and
+ * returns true.
+ *
+ * The line is scanned once per command form with strstr, and every
+ * occurrence of the keyword is tried in order, so a command is found
+ * anywhere in the line (the leftmost match wins), just like an
+ * unanchored regular expression. Nothing is allocated.
+ */
+bool parse_command(const char *input, command_t *command)
+{
+    const char *start;
+
+    for (size_t i = 0; i < NUMBER_OF_COMMAND_FORMS; i++)
+    {
+        start = strstr(input, command_forms[i].keyword);
+
+        while (start != NULL)
+        {
+            if (lex_command_at(&command_forms[i], start, command))
+            {
+                return true;
+            }
+            start = strstr(start + 1, command_forms[i].keyword);
+        }
+    }
+
+    return false;
+}
+
+#endif
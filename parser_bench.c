@@ -0,0 +1,312 @@
+/*
+ * parser_bench.c
+ *
+ * Microbenchmark for parse_command(). It parses the same mix of command
+ * lines with three parsers and reports how many commands each one parses per
+ * second:
+ *
+ *   - "regcomp per call" is the original parser, which compiled, ran and
+ *     freed up to six regular expressions for every line and malloced the
+ *     resulting command.
+ *   - "precompiled regex" compiles the same regular expressions once and
+ *     only runs regexec per line.
+ *   - "lexer" is the single pass parser in parser.h.
+ *
+ * Build and run with "make bench_parser".
+ */
+#include <pthread.h>
+#include <regex.h>
+#include <time.h>
+#include "errors.h"
+#include "parser.h"
+
+/**
+ * This is the data type that holds information about parsing a
+ * command with a regular expression. It contains the type of the
+ * command, the regular expression for the command, and the number of
+ * matches within the command (that must be parsed out).
+ */
+typedef struct regex_parser
+{
+    command_type type;
+    const char *regex_string;
+    int expected_matches;
+} regex_parser;
+
+/**
+ * These are the regexes for the commands that the original parser looked
+ * for.
+ */
+regex_parser regexes[] = {
+    {Start_Alarm,
+     "Start_Alarm\\(([0-9]+)\\):[[:space:]]([0-9]+)[[:space:]](.*)",
+     4},
+    {Change_Alarm,
+     "Change_Alarm\\(([0-9]+)\\):[[:space:]]([0-9]+)[[:space:]](.*)",
+     4},
+    {Cancel_Alarm,
+     "Cancel_Alarm\\(([0-9]+)\\)",
+     2},
+    {Suspend_Alarm,
+     "Suspend_Alarm\\(([0-9]+)\\)",
+     2},
+    {Reactivate_Alarm,
+     "Reactivate_Alarm\\(([0-9]+)\\)",
+     2},
+    {View_Alarms,
+     "View_Alarms",
+     1}
+};
+
+#define NUMBER_OF_REGEXES (sizeof(regexes) / sizeof(regexes[0]))
+
+/**
+ * The regexes above, compiled once by compile_regexes().
+ */
+regex_t compiled_regexes[NUMBER_OF_REGEXES];
+
+/**
+ * The lines that are parsed. Each parser runs over this mix repeatedly.
+ */
+const char *bench_lines[] = {
+    "Start_Alarm(1): 50 test1",
+    "Start_Alarm(23): 90 a longer message for the second alarm",
+    "Change_Alarm(1): 60 test2",
+    "Cancel_Alarm(23)",
+    "Suspend_Alarm(1)",
+    "Reactivate_Alarm(1)",
+    "View_Alarms",
+    "Start_Alarm(abc): 10 bad",
+};
+
+#define NUMBER_OF_LINES (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+/**
+ * Fills `command` from the matches of regex `i` against `input`.
+ */
+void fill_command_from_matches(
+    int i,
+    const char *input,
+    regmatch_t matches[],
+    command_t *command)
+{
+    char buffer[64];
+    int length;
+
+    command->type = regexes[i].type;
+    command->alarm_id = 0;
+    command->time = 0;
+    command->message[0] = 0;
+
+    if (regexes[i].expected_matches > 1)
+    {
+        length = matches[1].rm_eo - matches[1].rm_so;
+        memcpy(buffer, input + matches[1].rm_so, length);
+        buffer[length] = 0;
+        command->alarm_id = atoi(buffer);
+    }
+    if (regexes[i].expected_matches > 2)
+    {
+        length = matches[2].rm_eo - matches[2].rm_so;
+        memcpy(buffer, input + matches[2].rm_so, length);
+        buffer[length] = 0;
+        command->time = atoi(buffer);
+    }
+    if (regexes[i].expected_matches > 3)
+    {
+        length = matches[3].rm_eo - matches[3].rm_so;
+        memcpy(command->message, input + matches[3].rm_so, length);
+        command->message[length] = 0;
+    }
+}
+
+/**
+ * The original parser: every call compiles, runs and frees the regexes and
+ * mallocs the command that it returns. The caller must free the command.
+ */
+command_t *parse_command_regcomp(const char *input)
+{
+    regex_t regex;
+    regmatch_t matches[4];
+    command_t *command;
+    int re_status;
+
+    for (size_t i = 0; i < NUMBER_OF_REGEXES; i++)
+    {
+        re_status = regcomp(&regex, regexes[i].regex_string, REG_EXTENDED);
+        if (re_status != 0)
+        {
+            fprintf(stderr, "Regex %zu did not compile\n", i);
+            exit(1);
+        }
+
+        re_status = regexec(
+            &regex,
+            input,
+            regexes[i].expected_matches,
+            matches,
+            0);
+        regfree(&regex);
+
+        if (re_status == REG_NOMATCH)
+        {
+            continue;
+        }
+
+        command = malloc(sizeof(command_t));
+        if (command == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        fill_command_from_matches(i, input, matches, command);
+        return command;
+    }
+
+    return NULL;
+}
+
+/**
+ * Compiles the regexes once for parse_command_precompiled().
+ */
+void compile_regexes()
+{
+    for (size_t i = 0; i < NUMBER_OF_REGEXES; i++)
+    {
+        if (regcomp(
+                &compiled_regexes[i],
+                regexes[i].regex_string,
+                REG_EXTENDED) != 0)
+        {
+            fprintf(stderr, "Regex %zu did not compile\n", i);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Same grammar as parse_command_regcomp(), but with the regexes compiled
+ * once and the command filled in by the caller.
+ */
+bool parse_command_precompiled(const char *input, command_t *command)
+{
+    regmatch_t matches[4];
+
+    for (size_t i = 0; i < NUMBER_OF_REGEXES; i++)
+    {
+        if (regexec(
+                &compiled_regexes[i],
+                input,
+                regexes[i].expected_matches,
+                matches,
+                0) == 0)
+        {
+            fill_command_from_matches(i, input, matches, command);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+double now_seconds()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Checks that the three parsers agree on every bench line, so that the
+ * numbers below compare parsers that do the same work.
+ */
+void check_parsers_agree()
+{
+    command_t expected;
+    command_t *original;
+    command_t actual;
+    bool matched;
+
+    for (size_t i = 0; i < NUMBER_OF_LINES; i++)
+    {
+        original = parse_command_regcomp(bench_lines[i]);
+        matched = parse_command(bench_lines[i], &actual);
+
+        if ((original != NULL) != matched
+            || parse_command_precompiled(bench_lines[i], &expected) != matched)
+        {
+            fprintf(stderr, "Parsers disagree on \"%s\"\n", bench_lines[i]);
+            exit(1);
+        }
+        if (original != NULL
+            && (original->type != actual.type
+                || original->alarm_id != actual.alarm_id
+                || original->time != actual.time
+                || strcmp(original->message, actual.message) != 0))
+        {
+            fprintf(stderr, "Parsers disagree on \"%s\"\n", bench_lines[i]);
+            exit(1);
+        }
+        free(original);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    long matched = 0;
+    command_t command;
+    command_t *original;
+    double start;
+    double regcomp_rate;
+    double precompiled_rate;
+    double lexer_rate;
+
+    compile_regexes();
+    check_parsers_agree();
+
+    // The original parser is far slower, so it runs a tenth of the lines.
+    start = now_seconds();
+    for (long i = 0; i < iterations / 10; i++)
+    {
+        original = parse_command_regcomp(bench_lines[i % NUMBER_OF_LINES]);
+        matched += original != NULL;
+        free(original);
+    }
+    regcomp_rate = (iterations / 10) / (now_seconds() - start);
+
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++)
+    {
+        matched += parse_command_precompiled(
+            bench_lines[i % NUMBER_OF_LINES],
+            &command);
+    }
+    precompiled_rate = iterations / (now_seconds() - start);
+
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++)
+    {
+        matched += parse_command(bench_lines[i % NUMBER_OF_LINES], &command);
+    }
+    lexer_rate = iterations / (now_seconds() - start);
+
+    printf("%-20s %15s %10s\n", "parser", "commands/sec", "speedup");
+    printf("%-20s %15.0f %10.1f\n", "regcomp per call", regcomp_rate, 1.0);
+    printf(
+        "%-20s %15.0f %10.1f\n",
+        "precompiled regex",
+        precompiled_rate,
+        precompiled_rate / regcomp_rate);
+    printf(
+        "%-20s %15.0f %10.1f\n",
+        "lexer",
+        lexer_rate,
+        lexer_rate / regcomp_rate);
+
+    // Use the match count so the loops cannot be optimized away.
+    return matched == 0;
+}
@@ -0,0 +1,62 @@
+#ifndef __seqlock_h
+#define __seqlock_h
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Data type for a sequence counter that guards some data written by one
+ * writer at a time (the writers must hold a mutex) and read without any
+ * lock. It is even while no writer is active, and odd while one is.
+ *
+ * A reader copies the data between seqlock_read_begin() and
+ * seqlock_read_retry(), and copies it again if a writer was active
+ * meanwhile. A writer never waits for readers.
+ */
+typedef uint32_t seqlock_t;
+
+/**
+ * Marks the start of a write. The fence keeps the data stores that follow
+ * from becoming visible before the counter is odd.
+ */
+void seqlock_write_begin(seqlock_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Marks the end of a write, publishing the data stores before it.
+ */
+void seqlock_write_end(seqlock_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the counter at the start of a read, once no writer is active.
+ * Writes are a few stores long, so a reader that finds one only yields.
+ */
+seqlock_t seqlock_read_begin(const seqlock_t *seq)
+{
+    seqlock_t start;
+
+    while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        sched_yield();
+    }
+    return start;
+}
+
+/**
+ * Returns true if the data read since seqlock_read_begin() returned
+ * `start` may be torn, because a writer was active meanwhile.
+ */
+bool seqlock_read_retry(const seqlock_t *seq, seqlock_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef __slab_h
+#define __slab_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "errors.h"
+
+/**
+ * Number of objects carved out of each chunk that a pool mallocs.
+ */
+#define SLAB_OBJECTS_PER_CHUNK 256
+
+/**
+ * Number of objects moved between a thread's cache and its pool at once, and
+ * the number of free objects a cache may hold before it gives a batch back.
+ */
+#define SLAB_CACHE_BATCH 32
+#define SLAB_CACHE_LIMIT (2 * SLAB_CACHE_BATCH)
+
+/**
+ * A free object. The link is stored in the object itself, so free objects
+ * cost no extra memory.
+ */
+typedef struct slab_object_t
+{
+    struct slab_object_t *next;
+} slab_object_t;
+
+/**
+ * Data type for a pool of fixed size objects of one type.
+ *
+ *   - `object_size` is the size of each object, rounded up so that every
+ *     object is suitably aligned.
+ *   - `mutex` protects `free`, `free_count` and `chunks`.
+ *   - `free` is the list of free objects that are not in any thread's cache,
+ *     and `free_count` is its length.
+ *   - `chunks` is the number of chunks malloced so far. Chunks are never
+ *     given back to malloc.
+ *   - `live` is the number of objects allocated and not freed, and `peak` is
+ *     the largest `live` has been. They are updated with atomic operations,
+ *     so they can be read at any time without the mutex.
+ *
+ * Threads do not allocate from the pool directly, but through their own
+ * slab_cache_t, which only locks the pool mutex once per SLAB_CACHE_BATCH
+ * objects. An object may be freed by a different thread than the one that
+ * allocated it; it goes into the freeing thread's cache, and from there back
+ * to the pool in a batch.
+ */
+typedef struct slab_pool_t
+{
+    size_t object_size;
+    pthread_mutex_t mutex;
+    slab_object_t *free;
+    size_t free_count;
+    size_t chunks;
+    size_t live;
+    size_t peak;
+} slab_pool_t;
+
+/**
+ * Data type for one thread's cache of free objects of a pool. Each thread
+ * declares its own (with __thread), so the cache needs no locking.
+ */
+typedef struct slab_cache_t
+{
+    slab_object_t *free;
+    size_t count;
+} slab_cache_t;
+
+/**
+ * Statistics of a pool, as returned by slab_stats().
+ *
+ *   - `live` is the number of objects in use.
+ *   - `peak` is the largest number of objects that were in use at once.
+ *   - `free` is the number of objects that have been malloced but are not in
+ *     use (in the pool or in a thread's cache).
+ *   - `chunks` is the number of times the pool has called malloc.
+ */
+typedef struct slab_stats_t
+{
+    size_t live;
+    size_t peak;
+    size_t free;
+    size_t chunks;
+} slab_stats_t;
+
+/**
+ * Rounds the size of a type up to a multiple of the largest alignment, so that
+ * objects carved out of a chunk one after the other are all aligned.
+ */
+#define SLAB_OBJECT_SIZE(type) \
+    ((sizeof(type) + _Alignof(max_align_t) - 1) \
+     & ~(_Alignof(max_align_t) - 1))
+
+/**
+ * Static initializer for a pool of objects of type `type`.
+ */
+#define SLAB_POOL_INITIALIZER(type) \
+    {SLAB_OBJECT_SIZE(type), PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0}
+
+/**
+ * Mallocs a new chunk of objects and adds them to the free list of the pool.
+ *
+ * The pool mutex must be locked by the caller.
+ */
+static void slab_grow(slab_pool_t *pool)
+{
+    char *chunk = malloc(pool->object_size * SLAB_OBJECTS_PER_CHUNK);
+    slab_object_t *object;
+
+    if (chunk == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+
+    for (size_t i = 0; i < SLAB_OBJECTS_PER_CHUNK; i++)
+    {
+        object = (slab_object_t *)(chunk + i * pool->object_size);
+        object->next = pool->free;
+        pool->free = object;
+    }
+    pool->free_count += SLAB_OBJECTS_PER_CHUNK;
+    pool->chunks++;
+}
+
+/**
+ * Moves up to `count` objects from the front of the list `*from` to the front
+ * of the list `*to`, and returns how many were moved.
+ */
+static size_t slab_move(slab_object_t **from, slab_object_t **to, size_t count)
+{
+    slab_object_t *object;
+    size_t moved = 0;
+
+    while (moved < count && *from != NULL)
+    {
+        object = *from;
+        *from = object->next;
+        object->next = *to;
+        *to = object;
+        moved++;
+    }
+
+    return moved;
+}
+
+/**
+ * Allocates an object from a pool, through the calling thread's cache. When
+ * the cache is empty, it is refilled with a batch of objects from the pool,
+ * and the pool mallocs a new chunk only if it has no free objects left.
+ *
+ * The contents of the object are undefined.
+ */
+void *slab_alloc(slab_pool_t *pool, slab_cache_t *cache)
+{
+    slab_object_t *object;
+    size_t moved;
+    size_t live;
+    size_t peak;
+
+    if (cache->free == NULL)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->free == NULL)
+        {
+            slab_grow(pool);
+        }
+        moved = slab_move(&pool->free, &cache->free, SLAB_CACHE_BATCH);
+        pool->free_count -= moved;
+        cache->count += moved;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    object = cache->free;
+    cache->free = object->next;
+    cache->count--;
+
+    live = __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+    while (live > peak
+           && !__atomic_compare_exchange_n(
+               &pool->peak, &peak, live, true,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    return object;
+}
+
+/**
+ * Gives back a batch of objects from a thread's cache to its pool (or all of
+ * them, if `all` is true).
+ */
+static void slab_return(slab_pool_t *pool, slab_cache_t *cache, bool all)
+{
+    size_t moved;
+
+    pthread_mutex_lock(&pool->mutex);
+    moved = slab_move(
+        &cache->free,
+        &pool->free,
+        all ? cache->count : SLAB_CACHE_BATCH);
+    pool->free_count += moved;
+    cache->count -= moved;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Frees an object of a pool into the calling thread's cache. When the cache
+ * holds more than SLAB_CACHE_LIMIT objects, a batch is given back to the
+ * pool, so that objects freed on one thread can be reused by another.
+ */
+void slab_free(slab_pool_t *pool, slab_cache_t *cache, void *object)
+{
+    slab_object_t *free_object = object;
+
+    free_object->next = cache->free;
+    cache->free = free_object;
+    cache->count++;
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+
+    if (cache->count > SLAB_CACHE_LIMIT)
+    {
+        slab_return(pool, cache, false);
+    }
+}
+
+/**
+ * Gives every object in a thread's cache back to the pool. A thread must do
+ * this before it exits, or the objects in its cache are lost.
+ */
+void slab_cache_flush(slab_pool_t *pool, slab_cache_t *cache)
+{
+    if (cache->count > 0)
+    {
+        slab_return(pool, cache, true);
+    }
+}
+
+/**
+ * Fills in the statistics of a pool.
+ */
+void slab_stats(slab_pool_t *pool, slab_stats_t *stats)
+{
+    // Read `live` before `chunks`, so that it is never more than the number
+    // of objects in the chunks.
+    stats->live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->mutex);
+    stats->chunks = pool->chunks;
+    pthread_mutex_unlock(&pool->mutex);
+
+    stats->free = stats->chunks * SLAB_OBJECTS_PER_CHUNK - stats->live;
+}
+
+#endif
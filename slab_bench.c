@@ -0,0 +1,294 @@
+/*
+ * slab_bench.c
+ *
+ * Microbenchmark for the alarm pool in slab.h. It allocates and frees
+ * alarm_t objects with malloc/free and with the slab pool, in two patterns:
+ *
+ *   - "churn" keeps a fixed number of alarms live on one thread and replaces
+ *     a random one at every step, like Start_Alarm and Cancel_Alarm in a
+ *     steady state.
+ *   - "cross-thread" allocates alarms on one thread and frees them on
+ *     another, like the main thread creating alarms that display threads
+ *     expire.
+ *
+ * For each run, it reports the number of operations per second and the
+ * number of malloc calls made after warming up (the steady state).
+ *
+ * Build and run with "make bench_slab".
+ */
+#include <pthread.h>
+#include <time.h>
+#include "errors.h"
+#include "types.h"
+#include "slab.h"
+
+/**
+ * Number of alarms that are live at the same time in the churn run, and
+ * number of alarms handed from one thread to the other at once in the
+ * cross-thread run.
+ */
+#define LIVE_ALARMS 4096
+#define HANDOFF_BATCH 64
+
+slab_pool_t bench_pool = SLAB_POOL_INITIALIZER(alarm_t);
+__thread slab_cache_t bench_cache = {NULL, 0};
+
+/**
+ * Whether the runs use the slab pool (true) or malloc and free (false), and
+ * the number of times malloc was called on their behalf.
+ */
+bool use_slab;
+size_t malloc_calls;
+
+/**
+ * Allocates an alarm with the allocator being measured.
+ */
+alarm_t *bench_alloc()
+{
+    alarm_t *alarm;
+
+    if (use_slab)
+    {
+        return slab_alloc(&bench_pool, &bench_cache);
+    }
+
+    __atomic_add_fetch(&malloc_calls, 1, __ATOMIC_RELAXED);
+    alarm = malloc(sizeof(alarm_t));
+    if (alarm == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    return alarm;
+}
+
+/**
+ * Frees an alarm with the allocator being measured.
+ */
+void bench_free(alarm_t *alarm)
+{
+    if (use_slab)
+    {
+        slab_free(&bench_pool, &bench_cache, alarm);
+    }
+    else
+    {
+        free(alarm);
+    }
+}
+
+/**
+ * Returns the number of malloc calls made so far by the allocator being
+ * measured.
+ */
+size_t bench_malloc_calls()
+{
+    slab_stats_t stats;
+
+    if (use_slab)
+    {
+        slab_stats(&bench_pool, &stats);
+        return stats.chunks;
+    }
+    return __atomic_load_n(&malloc_calls, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+double now_seconds()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Runs the churn pattern for `iterations` steps, after one warm up pass, and
+ * returns the number of steps per second. `*steady_mallocs` is set to the
+ * number of malloc calls made after warming up.
+ */
+double run_churn(long iterations, size_t *steady_mallocs)
+{
+    alarm_t *live[LIVE_ALARMS];
+    unsigned int seed = 1;
+    size_t mallocs;
+    double start;
+    double rate;
+    int i;
+
+    for (i = 0; i < LIVE_ALARMS; i++)
+    {
+        live[i] = bench_alloc();
+        live[i]->alarm_id = i;
+    }
+
+    mallocs = bench_malloc_calls();
+    start = now_seconds();
+    for (long n = 0; n < iterations; n++)
+    {
+        i = rand_r(&seed) % LIVE_ALARMS;
+        bench_free(live[i]);
+        live[i] = bench_alloc();
+        live[i]->alarm_id = n;
+    }
+    rate = iterations / (now_seconds() - start);
+    *steady_mallocs = bench_malloc_calls() - mallocs;
+
+    for (i = 0; i < LIVE_ALARMS; i++)
+    {
+        bench_free(live[i]);
+    }
+    return rate;
+}
+
+/**
+ * Handoff between the allocating and the freeing thread of the cross-thread
+ * run: a batch of alarms, protected by `handoff_mutex`.
+ */
+pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+alarm_t *handoff[HANDOFF_BATCH];
+bool handoff_full = false;
+bool handoff_done = false;
+
+/**
+ * Thread that frees every alarm handed off to it, like a display thread.
+ */
+void *free_thread(void *arg)
+{
+    alarm_t *batch[HANDOFF_BATCH];
+
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&handoff_mutex);
+        while (!handoff_full && !handoff_done)
+        {
+            pthread_cond_wait(&handoff_cond, &handoff_mutex);
+        }
+        if (!handoff_full)
+        {
+            pthread_mutex_unlock(&handoff_mutex);
+            break;
+        }
+        memcpy(batch, handoff, sizeof(batch));
+        handoff_full = false;
+        pthread_cond_broadcast(&handoff_cond);
+        pthread_mutex_unlock(&handoff_mutex);
+
+        for (int i = 0; i < HANDOFF_BATCH; i++)
+        {
+            bench_free(batch[i]);
+        }
+    }
+
+    if (use_slab)
+    {
+        slab_cache_flush(&bench_pool, &bench_cache);
+    }
+    return NULL;
+}
+
+/**
+ * Hands `batches` batches of new alarms to the freeing thread.
+ */
+void hand_off(long batches)
+{
+    alarm_t *batch[HANDOFF_BATCH];
+
+    for (long n = 0; n < batches; n++)
+    {
+        for (int i = 0; i < HANDOFF_BATCH; i++)
+        {
+            batch[i] = bench_alloc();
+            batch[i]->alarm_id = i;
+        }
+
+        pthread_mutex_lock(&handoff_mutex);
+        while (handoff_full)
+        {
+            pthread_cond_wait(&handoff_cond, &handoff_mutex);
+        }
+        memcpy(handoff, batch, sizeof(batch));
+        handoff_full = true;
+        pthread_cond_broadcast(&handoff_cond);
+        pthread_mutex_unlock(&handoff_mutex);
+    }
+}
+
+/**
+ * Runs the cross-thread pattern for about `iterations` alarms, after a warm
+ * up of LIVE_ALARMS alarms, and returns the number of alarms per second.
+ * `*steady_mallocs` is set to the number of malloc calls made after warming
+ * up.
+ */
+double run_cross_thread(long iterations, size_t *steady_mallocs)
+{
+    pthread_t thread;
+    long batches = iterations / HANDOFF_BATCH;
+    size_t mallocs;
+    double start;
+    double rate;
+
+    handoff_done = false;
+    pthread_create(&thread, NULL, free_thread, NULL);
+
+    hand_off(LIVE_ALARMS / HANDOFF_BATCH);
+
+    mallocs = bench_malloc_calls();
+    start = now_seconds();
+    hand_off(batches);
+    rate = batches * HANDOFF_BATCH / (now_seconds() - start);
+    *steady_mallocs = bench_malloc_calls() - mallocs;
+
+    pthread_mutex_lock(&handoff_mutex);
+    handoff_done = true;
+    pthread_cond_broadcast(&handoff_cond);
+    pthread_mutex_unlock(&handoff_mutex);
+    pthread_join(thread, NULL);
+
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 4000000;
+    double rates[2][2];
+    size_t mallocs[2][2];
+    slab_stats_t stats;
+
+    for (int slab = 0; slab < 2; slab++)
+    {
+        use_slab = slab;
+        rates[slab][0] = run_churn(iterations, &mallocs[slab][0]);
+        rates[slab][1] = run_cross_thread(iterations, &mallocs[slab][1]);
+    }
+
+    printf(
+        "%-14s %-12s %15s %10s %15s\n",
+        "pattern", "allocator", "ops/sec", "speedup", "steady mallocs");
+    for (int run = 0; run < 2; run++)
+    {
+        for (int slab = 0; slab < 2; slab++)
+        {
+            printf(
+                "%-14s %-12s %15.0f %10.1f %15zu\n",
+                run == 0 ? "churn" : "cross-thread",
+                slab ? "slab" : "malloc",
+                rates[slab][run],
+                rates[slab][run] / rates[0][run],
+                mallocs[slab][run]);
+        }
+    }
+
+    slab_stats(&bench_pool, &stats);
+    printf(
+        "\nslab pool: live %zu, peak %zu, free %zu, chunks %zu\n",
+        stats.live,
+        stats.peak,
+        stats.free,
+        stats.chunks);
+
+    return 0;
+}
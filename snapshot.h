@@ -0,0 +1,290 @@
+#ifndef __snapshot_h
+#define __snapshot_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "clock.h"
+#include "errors.h"
+
+/**
+ * Number of records in a chunk of the view table (at most 64, the bits of
+ * `used`).
+ */
+#define VIEW_CHUNK_RECORDS 64
+
+/**
+ * A copy of what View_Alarms shows of one alarm.
+ *
+ *   - `alarm_id`, `creation_time`, `time`, `unit`, `status` and `message` are
+ *     copied from the alarm.
+ *   - `thread_id` is the ID of the display thread the alarm is assigned to.
+ */
+typedef struct view_record_t
+{
+    int alarm_id;
+    int thread_id;
+    time_t creation_time;
+    int time;
+    time_unit unit;
+    bool status;
+    char message[128];
+} view_record_t;
+
+/**
+ * Data type for a chunk of view records. Bit i of `used` is set while
+ * `records[i]` holds an alarm. `refs` counts the view table and the
+ * snapshots that hold the chunk; once a snapshot holds it, it is never
+ * changed again, and the table changes a copy instead.
+ */
+typedef struct view_chunk_t
+{
+    int refs;
+    uint64_t used;
+    view_record_t records[VIEW_CHUNK_RECORDS];
+} view_chunk_t;
+
+/**
+ * Data type for a snapshot of the view table: the chunks it had when the
+ * snapshot was taken. `count` is the number of alarms in them. A snapshot
+ * is read without any lock, and freed by snapshot_release().
+ */
+typedef struct view_snapshot_t
+{
+    size_t count;
+    size_t chunk_count;
+    view_chunk_t *chunks[];
+} view_snapshot_t;
+
+/**
+ * Data type for the view table, which holds a view record for every alarm,
+ * updated whenever the alarm is added, changed, suspended, reactivated or
+ * removed. It is not thread safe; the alarm list mutex protects it.
+ *
+ *   - `chunks` holds `chunk_count` chunks (with room for `capacity`).
+ *   - `free_slots` is a stack of the `free_count` record indexes (chunk
+ *     index times VIEW_CHUNK_RECORDS, plus the record index) that are not
+ *     used. It has room for every record.
+ *   - `count` is the number of records in use.
+ *
+ * Taking a snapshot only copies the chunk pointers, so a long list of alarms
+ * is never copied under the alarm list mutex. A record is written in place
+ * unless a snapshot still holds its chunk, in which case that chunk alone is
+ * copied first.
+ */
+typedef struct view_table_t
+{
+    view_chunk_t **chunks;
+    size_t chunk_count;
+    size_t capacity;
+    int *free_slots;
+    size_t free_count;
+    size_t count;
+} view_table_t;
+
+#define VIEW_TABLE_INITIALIZER {NULL, 0, 0, NULL, 0, 0}
+
+/**
+ * Gives back a reference to a chunk, freeing it if it was the last one.
+ */
+void view_chunk_release(view_chunk_t *chunk)
+{
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(chunk);
+    }
+}
+
+/**
+ * Adds an empty chunk to the table and pushes its records on the stack of
+ * free slots, lowest index on top.
+ */
+void view_table_grow(view_table_t *table)
+{
+    view_chunk_t *chunk;
+    int first;
+
+    if (table->chunk_count == table->capacity)
+    {
+        table->capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+        table->chunks = realloc(
+            table->chunks,
+            table->capacity * sizeof(view_chunk_t *));
+        table->free_slots = realloc(
+            table->free_slots,
+            table->capacity * VIEW_CHUNK_RECORDS * sizeof(int));
+        if (table->chunks == NULL || table->free_slots == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+    }
+
+    chunk = malloc(sizeof(view_chunk_t));
+    if (chunk == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    chunk->refs = 1;
+    chunk->used = 0;
+
+    first = table->chunk_count * VIEW_CHUNK_RECORDS;
+    table->chunks[table->chunk_count++] = chunk;
+    for (int i = VIEW_CHUNK_RECORDS - 1; i >= 0; i--)
+    {
+        table->free_slots[table->free_count++] = first + i;
+    }
+}
+
+/**
+ * Returns the chunk that holds record `slot`, copying it first if a
+ * snapshot still holds it, so that it can be changed.
+ */
+view_chunk_t *view_table_chunk(view_table_t *table, int slot)
+{
+    view_chunk_t **chunk = &table->chunks[slot / VIEW_CHUNK_RECORDS];
+    view_chunk_t *copy;
+
+    // Snapshots only let go of the chunk meanwhile, never take it.
+    if (__atomic_load_n(&(*chunk)->refs, __ATOMIC_ACQUIRE) > 1)
+    {
+        copy = malloc(sizeof(view_chunk_t));
+        if (copy == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+        memcpy(copy, *chunk, sizeof(view_chunk_t));
+        copy->refs = 1;
+        view_chunk_release(*chunk);
+        *chunk = copy;
+    }
+    return *chunk;
+}
+
+/**
+ * Takes a free record of the table for a new alarm and returns its slot.
+ * The record is not shown until it is written with view_table_write().
+ */
+int view_table_add(view_table_t *table)
+{
+    if (table->free_count == 0)
+    {
+        view_table_grow(table);
+    }
+    return table->free_slots[--table->free_count];
+}
+
+/**
+ * Returns the record in `slot`, to be filled in by the caller, and shows it
+ * from the next snapshot on.
+ */
+view_record_t *view_table_write(view_table_t *table, int slot)
+{
+    view_chunk_t *chunk = view_table_chunk(table, slot);
+    uint64_t bit = (uint64_t)1 << (slot % VIEW_CHUNK_RECORDS);
+
+    if (!(chunk->used & bit))
+    {
+        chunk->used |= bit;
+        table->count++;
+    }
+    return &chunk->records[slot % VIEW_CHUNK_RECORDS];
+}
+
+/**
+ * Removes the record in `slot` (if it was written) and gives the slot back.
+ */
+void view_table_remove(view_table_t *table, int slot)
+{
+    view_chunk_t *chunk = table->chunks[slot / VIEW_CHUNK_RECORDS];
+    uint64_t bit = (uint64_t)1 << (slot % VIEW_CHUNK_RECORDS);
+
+    if (chunk->used & bit)
+    {
+        chunk = view_table_chunk(table, slot);
+        chunk->used &= ~bit;
+        table->count--;
+    }
+    table->free_slots[table->free_count++] = slot;
+}
+
+/**
+ * Returns a snapshot of the records in the table, which the caller must give
+ * back with snapshot_release(). Only the chunk pointers are copied.
+ */
+view_snapshot_t *view_table_snapshot(view_table_t *table)
+{
+    view_snapshot_t *snapshot;
+
+    snapshot = malloc(
+        sizeof(view_snapshot_t) + table->chunk_count * sizeof(view_chunk_t *));
+    if (snapshot == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    snapshot->count = table->count;
+    snapshot->chunk_count = table->chunk_count;
+    for (size_t i = 0; i < table->chunk_count; i++)
+    {
+        snapshot->chunks[i] = table->chunks[i];
+        __atomic_add_fetch(&table->chunks[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    return snapshot;
+}
+
+/**
+ * Frees a snapshot, giving back its chunks.
+ */
+void snapshot_release(view_snapshot_t *snapshot)
+{
+    for (size_t i = 0; i < snapshot->chunk_count; i++)
+    {
+        view_chunk_release(snapshot->chunks[i]);
+    }
+    free(snapshot);
+}
+
+/**
+ * Orders pointers to view records by display thread, then by alarm ID.
+ */
+int compare_view_records(const void *a, const void *b)
+{
+    const view_record_t *record_a = *(view_record_t *const *)a;
+    const view_record_t *record_b = *(view_record_t *const *)b;
+
+    if (record_a->thread_id != record_b->thread_id)
+    {
+        return record_a->thread_id < record_b->thread_id ? -1 : 1;
+    }
+    return record_a->alarm_id < record_b->alarm_id ? -1 : 1;
+}
+
+/**
+ * Returns the records of a snapshot, sorted by display thread, then by alarm
+ * ID, in an array of `snapshot->count` pointers that the caller must free.
+ */
+view_record_t **snapshot_sorted(view_snapshot_t *snapshot)
+{
+    view_record_t **records;
+    size_t count = 0;
+    uint64_t used;
+
+    records = malloc((snapshot->count + 1) * sizeof(view_record_t *));
+    if (records == NULL)
+    {
+        errno_abort("Malloc failed");
+    }
+    for (size_t i = 0; i < snapshot->chunk_count; i++)
+    {
+        for (used = snapshot->chunks[i]->used; used != 0; used &= used - 1)
+        {
+            records[count++] =
+                &snapshot->chunks[i]->records[__builtin_ctzll(used)];
+        }
+    }
+    qsort(records, count, sizeof(view_record_t *), compare_view_records);
+    return records;
+}
+
+#endif
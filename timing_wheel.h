@@ -0,0 +1,314 @@
+#ifndef __timing_wheel_h
+#define __timing_wheel_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of bits of the tick used by each level of the wheel, and the number
+ * of slots in each level (2 ^ WHEEL_BITS).
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+/**
+ * Number of levels of the wheel. Level `l` holds timers that are between
+ * 64^l and 64^(l + 1) ticks away, so six levels cover 64^6 ticks. Timers that
+ * are further away than that are parked in the last slot of the top level and
+ * placed again when it comes around.
+ */
+#define WHEEL_LEVELS 6
+
+/**
+ * Data type for a timer in a timing wheel. Timers are intrusive: the caller
+ * embeds one in the object being timed and points `data` back at the object.
+ *
+ *   - `next` and `prev` link the timer into the list of its slot.
+ *   - `expires` is the tick at which the timer fires.
+ *   - `level` and `slot` are where the timer is stored.
+ *   - `pending` is true while the timer is in the wheel.
+ *   - `data` is the object that the timer belongs to.
+ */
+typedef struct wheel_timer_t
+{
+    struct wheel_timer_t *next;
+    struct wheel_timer_t *prev;
+    uint64_t expires;
+    int level;
+    int slot;
+    bool pending;
+    void *data;
+} wheel_timer_t;
+
+/**
+ * Data type for a hierarchical timing wheel.
+ *
+ *   - `now` is the next tick to be processed. Every tick before it has been
+ *     processed already.
+ *   - `count` is the number of pending timers.
+ *   - `occupied` has one bit per slot of each level, set if the slot has
+ *     timers, so that the next tick with work can be found without looking
+ *     at empty slots.
+ *   - `slots` are the heads of the (circular, doubly linked) slot lists.
+ *
+ * The wheel is not thread safe; the caller must protect it with a mutex.
+ */
+typedef struct timing_wheel_t
+{
+    uint64_t now;
+    size_t count;
+    uint64_t occupied[WHEEL_LEVELS];
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timing_wheel_t;
+
+/**
+ * Function called for every timer that fires. The timer has already been
+ * removed from the wheel, so the function may schedule it again.
+ */
+typedef void (*wheel_fire_fn)(wheel_timer_t *timer);
+
+/**
+ * Initializes an empty wheel whose first tick to process is `now`.
+ */
+void timing_wheel_init(timing_wheel_t *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        wheel->occupied[level] = 0;
+        for (int slot = 0; slot < WHEEL_SIZE; slot++)
+        {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+/**
+ * Links `timer` into the slot that matches its expiry relative to the
+ * current tick of the wheel.
+ */
+static void timing_wheel_place(timing_wheel_t *wheel, wheel_timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level = 0;
+    int slot;
+    wheel_timer_t *head;
+
+    // Timers that are already due fire on the next processed tick.
+    if (expires < wheel->now)
+    {
+        expires = wheel->now;
+    }
+    delta = expires - wheel->now;
+
+    while (level < WHEEL_LEVELS - 1
+           && delta >> (WHEEL_BITS * (level + 1)) != 0)
+    {
+        level++;
+    }
+
+    if (delta >> (WHEEL_BITS * (level + 1)) != 0)
+    {
+        // Too far away for the wheel: park it in the top level slot that
+        // comes around last.
+        slot = ((wheel->now >> (WHEEL_BITS * level)) - 1) & WHEEL_MASK;
+    }
+    else
+    {
+        slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    }
+
+    head = &wheel->slots[level][slot];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->level = level;
+    timer->slot = slot;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/**
+ * Unlinks `timer` from its slot list, clearing the occupied bit if the slot
+ * becomes empty.
+ */
+static void timing_wheel_unlink(timing_wheel_t *wheel, wheel_timer_t *timer)
+{
+    wheel_timer_t *head = &wheel->slots[timer->level][timer->slot];
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    if (head->next == head)
+    {
+        wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    }
+}
+
+/**
+ * Removes a timer from the wheel. Does nothing if the timer is not pending.
+ * This takes constant time.
+ */
+void timing_wheel_cancel(timing_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer->pending)
+    {
+        return;
+    }
+
+    timing_wheel_unlink(wheel, timer);
+    timer->pending = false;
+    wheel->count--;
+}
+
+/**
+ * Schedules `timer` to fire at tick `expires`. If the timer is already
+ * pending, it is moved. This takes constant time.
+ */
+void timing_wheel_schedule(
+    timing_wheel_t *wheel,
+    wheel_timer_t *timer,
+    uint64_t expires)
+{
+    timing_wheel_cancel(wheel, timer);
+
+    timer->expires = expires;
+    timer->pending = true;
+    timing_wheel_place(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * Returns the first tick at or after the current tick of the wheel at which
+ * there is work to do, either a level 0 slot to fire or a higher level slot to
+ * cascade. Returns UINT64_MAX if the wheel is empty.
+ */
+uint64_t timing_wheel_next_tick(const timing_wheel_t *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t occupied;
+    uint64_t period;
+    uint64_t tick;
+    int shift;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        shift = WHEEL_BITS * level;
+        occupied = wheel->occupied[level];
+
+        while (occupied != 0)
+        {
+            int slot = __builtin_ctzll(occupied);
+            occupied &= occupied - 1;
+
+            // The next period of this level that maps to the slot.
+            period = wheel->now >> shift;
+            period += (slot - period) & WHEEL_MASK;
+            tick = period << shift;
+            if (tick < wheel->now)
+            {
+                tick += (uint64_t)WHEEL_SIZE << shift;
+            }
+
+            if (tick < next)
+            {
+                next = tick;
+            }
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Processes the current tick of the wheel: slots of higher levels that start
+ * at this tick are cascaded into lower levels, then every timer in the level 0
+ * slot of the tick is fired.
+ */
+static void timing_wheel_process_tick(timing_wheel_t *wheel, wheel_fire_fn fire)
+{
+    wheel_timer_t due;
+    wheel_timer_t *head;
+    wheel_timer_t *timer;
+    int slot;
+
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        if ((wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0)
+        {
+            continue;
+        }
+
+        slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        head = &wheel->slots[level][slot];
+        while (head->next != head)
+        {
+            timer = head->next;
+            timing_wheel_unlink(wheel, timer);
+            timing_wheel_place(wheel, timer);
+        }
+    }
+
+    /*
+     * Move the due timers to a local list before firing them, so that fire()
+     * can cancel or schedule timers while the list is walked. A timer that
+     * fire() schedules for the current tick (or earlier) lands in the current
+     * slot again, so keep going until the slot stays empty.
+     */
+    slot = wheel->now & WHEEL_MASK;
+    head = &wheel->slots[0][slot];
+    while (head->next != head)
+    {
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head;
+        head->prev = head;
+        wheel->occupied[0] &= ~((uint64_t)1 << slot);
+
+        while (due.next != &due)
+        {
+            timer = due.next;
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            timer->pending = false;
+            wheel->count--;
+            fire(timer);
+        }
+    }
+}
+
+/**
+ * Processes every tick up to and including `now`, calling `fire` for each
+ * timer that expires. Ticks with no work are skipped, so the cost depends on
+ * the number of timers fired, not on how far the wheel moves.
+ */
+void timing_wheel_advance(
+    timing_wheel_t *wheel,
+    uint64_t now,
+    wheel_fire_fn fire)
+{
+    uint64_t next;
+
+    while (wheel->now <= now)
+    {
+        next = timing_wheel_next_tick(wheel);
+        if (next > now)
+        {
+            wheel->now = now + 1;
+            break;
+        }
+
+        wheel->now = next;
+        timing_wheel_process_tick(wheel, fire);
+        wheel->now++;
+    }
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clock.h"
+#include "errors.h"
+#include "types.h"
+
+/**
+ * The first bytes of every trace file, and the version of the format
+ * described below. A file with another version is refused.
+ */
+#define TRACE_MAGIC "ALRMTRCE"
+#define TRACE_VERSION 1
+
+/**
+ * Size of the stdio buffer of a trace file, so that a trace is written and
+ * read in large blocks.
+ */
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+/**
+ * The header at the start of a trace file. It is followed by one record
+ * per command, in the order they were applied.
+ *
+ *   - `header_size` is the size of this header, so that fields can be
+ *     added at the end of it.
+ *   - `started_at` is the wall clock time the recording started at (in
+ *     nanoseconds since the epoch), for reference only.
+ */
+typedef struct trace_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t started_at;
+} trace_header_t;
+
+/**
+ * A record of a trace, as it is written to the file. It is followed by the
+ * `length` characters of the command's message (without a terminating null
+ * character).
+ *
+ *   - `offset` is the time (monotonic clock, in nanoseconds) from the start
+ *     of the recording to when the command thread took the command.
+ *   - `type`, `unit`, `alarm_id` and `time` are copied from the command.
+ */
+typedef struct trace_record_t
+{
+    int64_t offset;
+    int32_t alarm_id;
+    int32_t time;
+    uint8_t type;
+    uint8_t unit;
+    uint8_t length;
+    uint8_t reserved;
+} trace_record_t;
+
+/**
+ * Data type for a trace being recorded or replayed.
+ *
+ *   - `file` is the trace file, with a buffer of TRACE_BUFFER_SIZE bytes.
+ *   - `started` is when the recording started (monotonic clock), so that
+ *     the offsets of the records are measured from it.
+ *   - `count` is the number of records written or read so far.
+ */
+typedef struct trace_t
+{
+    FILE *file;
+    int64_t started;
+    uint64_t count;
+} trace_t;
+
+/**
+ * Creates (or truncates) the trace file at `path` and writes its header.
+ * Offsets are measured from now.
+ */
+void trace_create(trace_t *trace, const char *path)
+{
+    trace_header_t header;
+
+    trace->file = fopen(path, "w");
+    if (trace->file == NULL)
+    {
+        errno_abort("Open trace");
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.header_size = sizeof(header);
+    header.started_at = clock_wall_now();
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1)
+    {
+        errno_abort("Write trace");
+    }
+
+    trace->started = clock_monotonic();
+    trace->count = 0;
+}
+
+/**
+ * Adds a command to the trace, with the time since the recording started.
+ * Records are buffered; trace_flush() writes them out.
+ *
+ * Only one thread may append to a trace.
+ */
+void trace_append(trace_t *trace, const command_t *command)
+{
+    trace_record_t record;
+
+    record.offset = clock_monotonic() - trace->started;
+    record.alarm_id = command->alarm_id;
+    record.time = command->time;
+    record.type = command->type;
+    record.unit = command->unit;
+    record.length = strlen(command->message);
+    record.reserved = 0;
+
+    if (fwrite(&record, sizeof(record), 1, trace->file) != 1
+        || fwrite(command->message, 1, record.length, trace->file)
+               != record.length)
+    {
+        errno_abort("Write trace");
+    }
+    trace->count++;
+}
+
+/**
+ * Writes the records appended so far to the trace file. Safe to call from
+ * another thread than the one appending, since stdio locks the file.
+ */
+void trace_flush(trace_t *trace)
+{
+    if (fflush(trace->file) != 0)
+    {
+        errno_abort("Write trace");
+    }
+}
+
+/**
+ * Opens a trace for replaying from a file descriptor, and checks its
+ * header. Returns false if it is not a trace of this version.
+ */
+bool trace_open(trace_t *trace, int fd)
+{
+    trace_header_t header;
+
+    trace->file = fdopen(fd, "r");
+    if (trace->file == NULL)
+    {
+        errno_abort("Open trace");
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    trace->started = 0;
+    trace->count = 0;
+
+    if (fread(&header, sizeof(header), 1, trace->file) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION
+        || header.header_size < sizeof(header))
+    {
+        return false;
+    }
+    return fseek(trace->file, header.header_size, SEEK_SET) == 0;
+}
+
+/**
+ * Reads the next command of a trace, and the offset it was recorded at.
+ * Returns false at the end of the trace, or at a record that was only
+ * partly written or is not valid.
+ */
+bool trace_next(trace_t *trace, command_t *command, int64_t *offset)
+{
+    trace_record_t record;
+
+    if (fread(&record, sizeof(record), 1, trace->file) != 1
+        || record.type >= COMMAND_TYPES
+        || record.unit > UNIT_NANOSECONDS
+        || record.length >= sizeof(command->message)
+        || fread(command->message, 1, record.length, trace->file)
+               != record.length)
+    {
+        return false;
+    }
+
+    command->message[record.length] = 0;
+    command->type = record.type;
+    command->unit = record.unit;
+    command->alarm_id = record.alarm_id;
+    command->time = record.time;
+    *offset = record.offset;
+    trace->count++;
+    return true;
+}
+
+#endif
@@ -1,7 +1,19 @@
+#ifndef __types_h
+#define __types_h
+
+#include <pthread.h>
 #include <stdbool.h>
+#include "clock.h"
+#include "timing_wheel.h"
+#include "alarm_heap.h"
+#include "work_deque.h"
+#include "histogram.h"
+#include "lock_stats.h"
+#include "seqlock.h"
 
 /**
- * The six possible types of commands that a user can enter.
+ * The ten possible types of commands that a user can enter (COMMAND_TYPES
+ * is their number).
  */
 typedef enum command_type
 {
@@ -10,61 +22,163 @@ typedef enum command_type
     Cancel_Alarm,
     Suspend_Alarm,
     Reactivate_Alarm,
-    View_Alarms
+    View_Alarms,
+    Checkpoint,
+    Lateness,
+    Stats,
+    Wait,
+    COMMAND_TYPES
 } command_type;
 
+/**
+ * The name of each type of command, as the user types it.
+ */
+static const char *const command_type_names[COMMAND_TYPES] = {
+    "Start_Alarm",
+    "Change_Alarm",
+    "Cancel_Alarm",
+    "Suspend_Alarm",
+    "Reactivate_Alarm",
+    "View_Alarms",
+    "Checkpoint",
+    "Lateness",
+    "Stats",
+    "Wait"
+};
+
+/**
+ * The ways that alarm expiry and periodic printing can be driven. The engine
+ * is chosen when the program starts.
+ *
+ *   - `ENGINE_THREADS` gives every display thread a fixed number of alarms,
+ *     and each display thread waits for the deadlines of its own alarms.
+ *   - `ENGINE_WHEEL` has a single timer thread that keeps every expiry and
+ *     print deadline in a hierarchical timing wheel. Display threads are
+ *     still assigned to alarms (and named in the output), but they are only
+ *     records in the thread list and do not run as threads.
+ *   - `ENGINE_HEAP` is the same as `ENGINE_WHEEL`, but the timer thread
+ *     keeps the deadlines in an indexed binary min-heap.
+ *   - `ENGINE_POOL` has a fixed pool of worker threads (one per CPU by
+ *     default) instead of a single timer thread. Each worker keeps the
+ *     deadlines of its share of the alarms in its own min-heap, and idle
+ *     workers steal due alarms from busy ones.
+ *
+ * `ENGINE_WHEEL`, `ENGINE_HEAP` and `ENGINE_POOL` are the timer engines.
+ */
+typedef enum engine_type
+{
+    ENGINE_THREADS,
+    ENGINE_WHEEL,
+    ENGINE_HEAP,
+    ENGINE_POOL
+} engine_type;
+
 /**
  * Data structure representing a command entered by a user. Includes
  * the type of the command, the alarm_id (if applicable), the time
- * (if applicable), and the message (if applicable).
+ * and its unit (if applicable), and the message (if applicable).
  */
 typedef struct command_t
 {
     command_type type;
     int alarm_id;
     int time;
+    time_unit unit;
     char message[128];
 } command_t;
 
-/**
- * This is the data type that holds information about parsing a
- * command. It contains the type of the command, the regular
- * expression for the command, the number of matches within the
- * command (that must be parsed out).
- */
-typedef struct regex_parser
-{
-    command_type type;
-    const char *regex_string;
-    int expected_matches;
-} regex_parser;
-
 /**
  * Data type for an alarm.
  *
  *   - `alarm_id` is the ID of the alarm.
- *   - `time` is the time entered by the user.
+ *   - `time` is the time entered by the user, and `unit` is its unit.
  *   - `message` is the message entered by the user.
  *   - `next` is the next alarm in the list (since alarms will be
  *     stored as a linked list).
  *   - `status` is the active status of the alarm. If `status` is
  *     true, then the alarm is activated, otherwise the alarm is
  *     suspended.
- *   - `creation_time` is the creation timestamp of the alarm.
+ *   - `creation_time` is the creation timestamp of the alarm (wall clock
+ *     seconds, as printed).
+ *   - `expiration_time` is when the alarm expires, and `time_left` is how
+ *     long it had left when it was suspended. Like every deadline, they are
+ *     in nanoseconds of the monotonic clock (see clock.h).
+ *   - `prev` is the previous alarm in the list, so that an alarm found
+ *     through the alarm index can be unlinked without walking the list.
+ *   - `owner` is the display thread that the alarm is assigned to. Events
+ *     about the alarm are sent to this thread only.
+ *   - `slot` is the slot of the owner that holds the alarm (threads engine
+ *     only). It is chosen when the alarm is assigned, so that events about
+ *     the alarm go straight to its slot.
+ *   - `changes` counts the Change_Alarm commands applied to the alarm, and
+ *     `changes_printed` is the value of `changes` when the alarm was last
+ *     printed with its changed message. The message has changed since it
+ *     was last printed while they differ (see alarm_changed()). Only the
+ *     command thread writes `changes`, and only the thread that prints the
+ *     alarm writes `changes_printed`, so an unrelated change to the alarm
+ *     never hides a changed message that has not been printed yet.
+ *   - `seq` is the sequence counter of the fields that display threads
+ *     print (`time`, `unit`, `message`, `status`, `changes` and
+ *     `expiration_time`). The command thread changes them with the alarm
+ *     list mutex locked, between seqlock_write_begin() and
+ *     seqlock_write_end(), so that the display thread that owns the alarm
+ *     can read them without the mutex (see alarm_read()).
+ *   - `timer` and `heap_node` are the timing wheel and heap entries for the
+ *     alarm's next deadline (the heap is the timer thread's, or the pool
+ *     worker's), and `next_print` is when the alarm is next printed (only
+ *     used by the timer engines).
+ *   - `work_items` is the number of due work items of the pool engine that
+ *     point at the alarm, and `retired` is true once the alarm has expired
+ *     or been cancelled. A retired alarm is freed by whoever drops the last
+ *     item. Both are protected by the mutex of the alarm's pool worker.
+ *     With the threads engine, `retired` is set (with the alarm list mutex)
+ *     when the alarm is cancelled, before its owner is told, so that the
+ *     owner does not expire or print it meanwhile.
+ *   - `view_slot` is the alarm's record in the view table (see snapshot.h).
  */
 typedef struct alarm_t
 {
     int alarm_id;
     int time;
+    time_unit unit;
     char message[128];
     struct alarm_t *next;
     bool status;
     time_t creation_time;
-    time_t expiration_time;
-    bool change_status;
-    int time_left;
+    int64_t expiration_time;
+    uint32_t changes;
+    uint32_t changes_printed;
+    int64_t time_left;
+    struct alarm_t *prev;
+    struct thread_t *owner;
+    int slot;
+    seqlock_t seq;
+    wheel_timer_t timer;
+    heap_node_t heap_node;
+    int64_t next_print;
+    int work_items;
+    bool retired;
+    int view_slot;
 } alarm_t;
 
+/**
+ * A consistent copy of the fields of an alarm that are printed, read without
+ * the alarm list mutex. `change_status` is true if the copied message has
+ * not been printed yet since it was changed, and `changes` is the number of
+ * changes of the alarm that the copy was read at.
+ */
+typedef struct alarm_print_t
+{
+    int alarm_id;
+    int time;
+    time_unit unit;
+    bool status;
+    bool change_status;
+    uint32_t changes;
+    int64_t expiration_time;
+    char message[128];
+} alarm_print_t;
+
 /**
  * Data type representing an event that is sent from the main thread
  * to a display thread.
@@ -72,31 +186,94 @@ typedef struct alarm_t
  *   - `type` is the type of the event, directly correlated to a
  *     command entered by a user.
  *   - `alarmId` is the ID of the alarm that is related to the event.
- *     Note that this is not applicable to every event (for example,
- *     the View_Alarms command is not associated with any specific
- *     alarm).
- *   - `alarm` is a pointer to the alarm that is related to the event.
- *     Note that this is not applicable to every event (for example,
- *     the View_Alarms command is not associated with any specific
- *     alarm).
+ *   - `alarm` is a pointer to the alarm that is related to the event, and
+ *     `slot` is the slot of the display thread that holds it. Only a
+ *     Start_Alarm event may use the alarm itself; other events only
+ *     compare it with the alarm in the slot, since it may have expired
+ *     and been freed by the display thread before the event was posted.
+ *
+ * View_Alarms is not sent to display threads; it is printed from a
+ * snapshot of the alarm table (see snapshot.h).
  */
 typedef struct event_t
 {
     command_type type;
     int alarmId;
     alarm_t *alarm;
+    int slot;
 } event_t;
 
+/**
+ * Number of events that fit in the mailbox of a display thread. When a
+ * mailbox is full, the main thread waits for the display thread to take an
+ * event out before posting another one.
+ */
+#define MAILBOX_CAPACITY 16
+
+/**
+ * Data type for the mailbox of a display thread, a bounded FIFO queue of
+ * events sent to that thread only. It is protected by the alarm list mutex.
+ *
+ *   - `events` is a ring buffer of events. Events are copied in, so posting
+ *     one does not allocate memory.
+ *   - `head` is the index of the oldest event and `count` is the number of
+ *     events in the mailbox.
+ *   - `waiting_posters` is the number of threads waiting for space in the
+ *     mailbox. The display thread does not exit while this is not zero.
+ *   - `cond` is signalled when an event is posted. Only the owner of the
+ *     mailbox waits on it.
+ *   - `not_full` is signalled when an event is taken out of a full mailbox.
+ */
+typedef struct mailbox_t
+{
+    event_t events[MAILBOX_CAPACITY];
+    int head;
+    int count;
+    int waiting_posters;
+    pthread_cond_t cond;
+    pthread_cond_t not_full;
+} mailbox_t;
+
+/**
+ * The deadlines whose lateness is recorded: when an alarm expires, and when
+ * it is printed by its display thread.
+ */
+typedef enum lateness_kind
+{
+    LATENESS_EXPIRY,
+    LATENESS_PRINT,
+    LATENESS_KINDS
+} lateness_kind;
+
 /**
  * Data type representing a display thread.
  *
  *  - `thread_id` is our ID that we give to a thread.
  *  - `alarms` is the number of alarms that the thread currently has.
+ *  - `slots` is the array of alarms held by the thread. It has room for the
+ *     number of alarms per thread chosen when the program starts, and free
+ *     slots are NULL.
+ *  - `free_slots` is a stack of the indexes of the slots that are not
+ *     assigned to an alarm. It holds `alarms_per_thread - alarms` indexes,
+ *     so it is pushed and popped together with the change of `alarms`,
+ *     with the thread list mutex locked.
  *  - `thread` is the pthread handle for the thread.
  *  - `next` is the next thread in the list (since threads will be
  *     stored as a linked list).
+ *  - `prev` is the previous thread in the list (or the header), so that a
+ *     thread is removed from the list without walking it.
  *  - `alarm` is the inital alarm that is given to the thread when it
  *     is created.
+ *  - `mailbox` holds the events sent to this thread by the main thread.
+ *  - `space_next` and `space_prev` link the thread into the list of threads
+ *     that have space for another alarm, while `has_space` is true.
+ *  - `lateness` holds one histogram per kind of deadline (LATENESS_EXPIRY
+ *     and LATENESS_PRINT) of how late the thread's alarms were expired and
+ *     printed. It is allocated when the first one is recorded, and is
+ *     protected by the alarm list mutex.
+ *  - `wakeups` counts the times the thread woke up from waiting on its
+ *     mailbox (threads engine only). It is protected by the alarm list
+ *     mutex.
  */
 typedef struct thread_t
 {
@@ -104,7 +281,84 @@ typedef struct thread_t
     int alarms;
     pthread_t thread;
     struct thread_t *next;
+    struct thread_t *prev;
     alarm_t *alarm;
-
+    alarm_t **slots;
+    int *free_slots;
+    mailbox_t mailbox;
+    struct thread_t *space_next;
+    struct thread_t *space_prev;
+    bool has_space;
+    histogram_t *lateness;
+    wakeup_stats_t wakeups;
 } thread_t;
 
+/**
+ * Data type for a worker thread of the pool engine.
+ *
+ *   - `index` is the position of the worker in the pool. A worker keeps the
+ *     deadlines of the alarms whose display thread ID maps to this index.
+ *   - `thread` is the pthread handle for the worker.
+ *   - `mutex` protects every other field of the worker (but `idle` and
+ *     `idle_index`), and the deadlines of the worker's alarms. It is locked
+ *     after the alarm list mutex, and never together with another worker's
+ *     mutex. Printing an alarm only needs this mutex; expiring one also
+ *     needs the alarm list mutex.
+ *   - `cond` is signalled when the worker has an earlier deadline or when
+ *     another worker has due alarms for it to steal.
+ *   - `heap` holds the next deadline of each active alarm of the worker.
+ *   - `due` holds the alarms whose deadline has passed and that have not
+ *     been fired yet. Other workers steal from it.
+ *   - `deadline` is the time the worker is sleeping until, or -1 if it is
+ *     waiting without a timeout.
+ *   - `idle` is true while the worker has no work of its own and is looking
+ *     for work to steal or waiting for some. Only the worker uses it.
+ *   - `idle_index` is the position of the worker in the stack of idle
+ *     workers, or -1 if it is not in it. It is protected by the idle stack's
+ *     mutex.
+ *   - `steal_hints` is incremented whenever the worker is told that another
+ *     worker has due alarms, so that a hint given while the worker was
+ *     looking is not lost.
+ *   - `wakeups` counts the times the worker woke up from waiting on `cond`.
+ *   - `lateness` holds the lateness of the prints of the worker's alarms,
+ *     which are recorded without the alarm list mutex (LATENESS_PRINT only;
+ *     expiries are recorded in the display thread's histograms).
+ */
+typedef struct pool_worker_t
+{
+    int index;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    min_heap_t heap;
+    work_deque_t due;
+    int64_t deadline;
+    bool idle;
+    int idle_index;
+    unsigned long steal_hints;
+    wakeup_stats_t wakeups;
+    histogram_t lateness[LATENESS_KINDS];
+} pool_worker_t;
+
+/**
+ * Data type for a thread that reads commands from a file (or a pipe) in
+ * batch mode and adds them to the command queue.
+ *
+ *   - `fd` is the file that the commands are read from, and `trace` is
+ *     true if it is a trace to replay (see trace.h) instead of lines of
+ *     commands.
+ *   - `thread` is the pthread handle for the reader.
+ *   - `total` is the number of lines read, and `bad` is the number of them
+ *     that were not valid commands. They are only read once the reader has
+ *     been joined.
+ */
+typedef struct reader_t
+{
+    int fd;
+    bool trace;
+    pthread_t thread;
+    long total;
+    long bad;
+} reader_t;
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * wakeup_bench.c
+ *
+ * Microbenchmark for how display threads are woken up. A number of waiting
+ * threads sleep like display threads (a timed wait of 5 seconds), and a
+ * command thread sends them commands, each for one random thread, in two
+ * ways:
+ *
+ *   - "broadcast" is the original design: every thread waits on one
+ *     condition variable, and each command broadcasts it, so every thread
+ *     wakes up, takes the mutex in turn to see whether the command is for
+ *     it, and goes back to sleep.
+ *   - "mailbox" is the current design (mailbox.h): each thread waits on the
+ *     condition variable of its own mailbox, and each command is posted to
+ *     the mailbox of its thread, which is the only one woken up.
+ *
+ * As in the program, all the threads share one mutex, and the command
+ * thread waits until a command has been handled before sending the next.
+ * For 1000 and 10000 threads, it reports the number of commands per second
+ * and the number of context switches (voluntary and involuntary, of the
+ * whole process) per command.
+ *
+ * Build and run with "make bench_wakeup".
+ */
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "errors.h"
+#include "types.h"
+#include "mailbox.h"
+
+/**
+ * Size of the stacks of the waiting threads, so that 10000 of them fit.
+ */
+#define WAITER_STACK_SIZE (64 * 1024)
+
+/**
+ * The numbers of waiting threads that are measured.
+ */
+static const int waiter_counts[] = {1000, 10000};
+
+/**
+ * A waiting thread.
+ *
+ *   - `index` is its position among the waiting threads.
+ *   - `mailbox` holds its commands (mailbox run only).
+ */
+typedef struct waiter_t
+{
+    int index;
+    pthread_t thread;
+    mailbox_t mailbox;
+} waiter_t;
+
+/**
+ * The mutex shared by every thread, like the alarm list mutex. It protects
+ * everything below.
+ *
+ *   - `use_mailbox` says which way commands are sent.
+ *   - `shared_cond` is the condition variable of the broadcast run, and
+ *     `target` and `generation` say which thread the last command is for.
+ *   - `handled` counts the commands handled, and `handled_cond` wakes up
+ *     the command thread when one is.
+ *   - `parked` counts the threads that have started waiting, and `done`
+ *     tells them to exit.
+ */
+metered_mutex_t bench_mutex = METERED_MUTEX_INITIALIZER;
+bool use_mailbox;
+pthread_cond_t shared_cond;
+int target;
+long generation;
+long handled;
+pthread_cond_t handled_cond = PTHREAD_COND_INITIALIZER;
+int parked;
+bool done;
+
+/**
+ * Handles a command: counts it and wakes up the command thread. The bench
+ * mutex must be locked by the caller.
+ */
+void handle_command()
+{
+    handled++;
+    pthread_cond_signal(&handled_cond);
+}
+
+/**
+ * A waiting thread, which handles the commands sent to it until it is told
+ * to exit.
+ */
+void *waiter_thread(void *arg)
+{
+    waiter_t *waiter = arg;
+    struct timespec t;
+    event_t event;
+    long seen;
+
+    metered_mutex_lock(&bench_mutex);
+    parked++;
+    pthread_cond_signal(&handled_cond);
+    seen = generation;
+
+    while (!done)
+    {
+        clock_timespec(clock_now() + 5 * NSEC_PER_SEC, &t);
+        if (use_mailbox)
+        {
+            if (waiter->mailbox.count == 0)
+            {
+                metered_cond_timedwait(
+                    &waiter->mailbox.cond,
+                    &bench_mutex,
+                    &t);
+            }
+            while (mailbox_take(&waiter->mailbox, &event))
+            {
+                handle_command();
+            }
+        }
+        else
+        {
+            metered_cond_timedwait(&shared_cond, &bench_mutex, &t);
+            if (generation != seen && target == waiter->index)
+            {
+                handle_command();
+            }
+            seen = generation;
+        }
+    }
+
+    metered_mutex_unlock(&bench_mutex);
+    return NULL;
+}
+
+/**
+ * Returns the number of context switches of the process so far.
+ */
+long context_switches()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/**
+ * Returns the current monotonic time in seconds.
+ */
+double now_seconds()
+{
+    return clock_now() / 1e9;
+}
+
+/**
+ * Starts `count` waiting threads, sends them `commands` commands, and
+ * returns the number of commands per second. `*switches` is set to the
+ * number of context switches per command.
+ */
+double run(int count, long commands, double *switches)
+{
+    waiter_t *waiters = calloc(count, sizeof(waiter_t));
+    pthread_attr_t attr;
+    unsigned int seed = 1;
+    event_t event = {Cancel_Alarm, 0, NULL, 0};
+    long before;
+    double start;
+    double rate;
+    int status;
+
+    if (waiters == NULL)
+    {
+        errno_abort("Calloc failed");
+    }
+    clock_cond_init(&shared_cond);
+    generation = 0;
+    handled = 0;
+    parked = 0;
+    done = false;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WAITER_STACK_SIZE);
+    for (int i = 0; i < count; i++)
+    {
+        waiters[i].index = i;
+        mailbox_init(&waiters[i].mailbox);
+        status = pthread_create(
+            &waiters[i].thread, &attr, waiter_thread, &waiters[i]);
+        if (status != 0)
+        {
+            err_abort(status, "Create waiter thread");
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    metered_mutex_lock(&bench_mutex);
+    while (parked < count)
+    {
+        metered_cond_wait(&handled_cond, &bench_mutex);
+    }
+
+    before = context_switches();
+    start = now_seconds();
+    for (long n = 0; n < commands; n++)
+    {
+        if (use_mailbox)
+        {
+            mailbox_post(
+                &waiters[rand_r(&seed) % count].mailbox,
+                event,
+                &bench_mutex);
+        }
+        else
+        {
+            target = rand_r(&seed) % count;
+            generation++;
+            pthread_cond_broadcast(&shared_cond);
+        }
+        while (handled <= n)
+        {
+            metered_cond_wait(&handled_cond, &bench_mutex);
+        }
+    }
+    rate = commands / (now_seconds() - start);
+    *switches = (double)(context_switches() - before) / commands;
+
+    done = true;
+    pthread_cond_broadcast(&shared_cond);
+    for (int i = 0; i < count; i++)
+    {
+        pthread_cond_signal(&waiters[i].mailbox.cond);
+    }
+    metered_mutex_unlock(&bench_mutex);
+
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(waiters[i].thread, NULL);
+        mailbox_destroy(&waiters[i].mailbox);
+    }
+    pthread_cond_destroy(&shared_cond);
+    free(waiters);
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    long commands = argc > 1 ? atol(argv[1]) : 100;
+    double rate;
+    double switches;
+
+    printf(
+        "%-10s %8s %15s %20s\n",
+        "wakeup", "threads", "commands/sec", "switches/command");
+    for (size_t i = 0; i < sizeof(waiter_counts) / sizeof(int); i++)
+    {
+        for (int mailbox = 0; mailbox < 2; mailbox++)
+        {
+            use_mailbox = mailbox;
+            rate = run(waiter_counts[i], commands, &switches);
+            printf(
+                "%-10s %8d %15.0f %20.1f\n",
+                mailbox ? "mailbox" : "broadcast",
+                waiter_counts[i],
+                rate,
+                switches);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef __work_deque_h
+#define __work_deque_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "errors.h"
+
+/**
+ * Data type for a unit of work in a work deque: an alarm whose deadline has
+ * passed and that must be fired.
+ *
+ *   - `alarm` is the alarm. It is not freed while an item points at it, even
+ *     if it is cancelled meanwhile (see the alarm's `work_items`).
+ *   - `deadline` is the deadline that was due, so that an item left over from
+ *     an older deadline of the same alarm can be recognized and skipped.
+ *   - `home` is the index of the pool worker whose heap held the deadline.
+ *     Its mutex protects the alarm's deadline, so whoever fires the item,
+ *     the worker itself or a thief, locks it.
+ */
+typedef struct work_item_t
+{
+    struct alarm_t *alarm;
+    int64_t deadline;
+    int home;
+} work_item_t;
+
+/**
+ * Data type for a double-ended queue of work items.
+ *
+ * The owner of the deque adds items at the back and takes them from the
+ * front, so that due alarms are fired in deadline order. Other workers steal
+ * from the back, taking the work that the owner would get to last.
+ *
+ *   - `items` is a ring buffer of items.
+ *   - `head` is the index of the front item and `count` is the number of
+ *     items in the deque.
+ *   - `capacity` is the allocated length of `items` (always zero or a power
+ *     of two).
+ *
+ * The deque is not thread safe; the caller must protect it with a mutex
+ * (the mutex of the pool worker it belongs to). It is only held to move
+ * items, never while an item is fired.
+ */
+typedef struct work_deque_t
+{
+    work_item_t *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} work_deque_t;
+
+/**
+ * Adds an item at the back of the deque, growing the ring buffer if it is
+ * full.
+ */
+void work_deque_push_back(work_deque_t *deque, work_item_t item)
+{
+    work_item_t *items;
+    size_t capacity;
+
+    if (deque->count == deque->capacity)
+    {
+        capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        items = malloc(capacity * sizeof(work_item_t));
+        if (items == NULL)
+        {
+            errno_abort("Malloc failed");
+        }
+
+        // Unwrap the old ring so that the front item is at index 0.
+        for (size_t i = 0; i < deque->count; i++)
+        {
+            items[i] =
+                deque->items[(deque->head + i) & (deque->capacity - 1)];
+        }
+
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+
+    deque->items[(deque->head + deque->count) & (deque->capacity - 1)] = item;
+    deque->count++;
+}
+
+/**
+ * Takes the item at the front of the deque. Returns false if the deque is
+ * empty.
+ */
+bool work_deque_pop_front(work_deque_t *deque, work_item_t *item)
+{
+    if (deque->count == 0)
+    {
+        return false;
+    }
+
+    *item = deque->items[deque->head];
+    deque->head = (deque->head + 1) & (deque->capacity - 1);
+    deque->count--;
+    return true;
+}
+
+/**
+ * Takes the item at the back of the deque. Returns false if the deque is
+ * empty.
+ */
+bool work_deque_pop_back(work_deque_t *deque, work_item_t *item)
+{
+    if (deque->count == 0)
+    {
+        return false;
+    }
+
+    deque->count--;
+    *item = deque->items[(deque->head + deque->count) & (deque->capacity - 1)];
+    return true;
+}
+
+#endif